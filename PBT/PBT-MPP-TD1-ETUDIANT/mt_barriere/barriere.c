@@ -2,28 +2,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <time.h>
 
-
-typedef struct
-{
-      /*A compléter*/ 
-      pthread_cond_t cond;
-      
-}my_barrier_t;
-
-
-
-/* Initialise une barrière pour num threads*/
-int my_barrier_init(my_barrier_t * barrier, int num)
-{
-      /*A compléter*/ 
-}
-
-/* Bloque tant que tous les threads ne sont pas arrivés */
-int my_barrier_wait(my_barrier_t * barrier)
-{
-      /*A compléter*/ 
-}
+#include "my_barrier.h"
 
 
 my_barrier_t barrier;
@@ -51,7 +33,16 @@ int main(int argc, char ** argv)
    pthread_t threads[NUM_THREADS];
    long i;
    
-   my_barrier_init(&barrier, NUM_THREADS);
+   my_barrier_algo_t algo = MY_BARRIER_CENTRAL;
+
+   /* gcc -O2 -pthread barriere.c my_barrier.c -o barriere
+      ./barriere [central|dissemination|tournament] */
+   if (argc > 1 && strcmp(argv[1], "dissemination") == 0)
+      algo = MY_BARRIER_DISSEMINATION;
+   else if (argc > 1 && strcmp(argv[1], "tournament") == 0)
+      algo = MY_BARRIER_TOURNAMENT;
+
+   my_barrier_init_algo(&barrier, NUM_THREADS, algo);
       
    srand(time(0));
    
@@ -60,6 +51,7 @@ int main(int argc, char ** argv)
    
    for(i=0; i < NUM_THREADS; ++i)
       pthread_join(threads[i], NULL);
-      
+
+   my_barrier_destroy(&barrier);
    return 0;
 }
@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "my_barrier.h"
+
+/*
+ * Latence des barrières, de 2 à 64 threads : chaque thread enchaîne
+ * ITER barrières sans travail entre elles, comme une boucle BSP au pas le
+ * plus court. Temps moyen d'un épisode en nanosecondes.
+ *
+ * gcc -O2 -pthread bench_barriere.c my_barrier.c -o bench_barriere
+ * ./bench_barriere [ITER]
+ */
+
+#define MAX_THREADS 64
+#define WARMUP 100
+
+enum
+{
+   BENCH_CENTRAL,
+   BENCH_DISSEMINATION,
+   BENCH_TOURNAMENT,
+   BENCH_PTHREAD,
+   NB_BENCH
+};
+
+static const char *bench_names[NB_BENCH] = {"central", "dissemination", "tournament", "pthread"};
+
+static int bench;
+static int iter;
+static my_barrier_t barrier;
+static pthread_barrier_t pbarrier;
+static struct timespec start;
+
+static inline void wait_once(void)
+{
+   if (bench == BENCH_PTHREAD)
+      pthread_barrier_wait(&pbarrier);
+   else
+      my_barrier_wait(&barrier);
+}
+
+void *run(void *arg)
+{
+   long rank = (long)arg;
+   int i;
+
+   for (i = 0; i < WARMUP; i++)
+      wait_once();
+
+   /* Le départ est pris une fois tout le monde prêt */
+   if (rank == 0)
+      clock_gettime(CLOCK_MONOTONIC, &start);
+   wait_once();
+
+   for (i = 0; i < iter; i++)
+      wait_once();
+   return NULL;
+}
+
+/* Temps moyen d'une barrière à num threads, en ns */
+double measure(int num)
+{
+   pthread_t threads[MAX_THREADS];
+   struct timespec end;
+   long i;
+
+   if (bench == BENCH_PTHREAD)
+      pthread_barrier_init(&pbarrier, NULL, num);
+   else
+      my_barrier_init_algo(&barrier, num, (my_barrier_algo_t)bench);
+
+   for (i = 0; i < num; ++i)
+      pthread_create(&threads[i], NULL, run, (void *)i);
+   for (i = 0; i < num; ++i)
+      pthread_join(threads[i], NULL);
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   if (bench == BENCH_PTHREAD)
+      pthread_barrier_destroy(&pbarrier);
+   else
+      my_barrier_destroy(&barrier);
+
+   return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iter;
+}
+
+int main(int argc, char **argv)
+{
+   int num;
+
+   iter = argc > 1 ? atoi(argv[1]) : 10000;
+   if (iter <= 0)
+   {
+      fprintf(stderr, "Usage : %s [ITER]\n", argv[0]);
+      return 1;
+   }
+
+   printf("%8s", "threads");
+   for (bench = 0; bench < NB_BENCH; bench++)
+      printf(" %14s", bench_names[bench]);
+   printf("   (ns par barrière)\n");
+
+   for (num = 2; num <= MAX_THREADS; num *= 2)
+   {
+      printf("%8d", num);
+      for (bench = 0; bench < NB_BENCH; bench++)
+      {
+         printf(" %14.0f", measure(num));
+         fflush(stdout);
+      }
+      printf("\n");
+   }
+   return 0;
+}
@@ -0,0 +1,326 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "my_barrier.h"
+
+/*
+ * Trois barrières, toutes bâties sur deux attentes :
+ *  - un thread attend un drapeau que lève un seul autre thread ;
+ *  - les threads attendent que le sens global de la barrière s'inverse.
+ * Dans les deux cas le thread attend d'abord activement, au plus spin
+ * itérations, puis s'endort sur un futex. spin s'adapte à chaque thread :
+ * il tend vers le double des attentes réussies et diminue quand le thread
+ * a dû dormir. Celui qui lève un drapeau ou inverse le sens ne fait d'appel
+ * système que si quelqu'un dort, ce qui est rare avec des boucles BSP.
+ */
+
+#define MY_BARRIER_SPIN_MIN 64
+#define MY_BARRIER_SPIN_INIT 4096
+#define MY_BARRIER_SPIN_MAX (1 << 16)
+
+/* Rangs et état propre à chaque thread, gardés dans un petit cache local
+   au thread, indexé par barrière */
+#define MY_BARRIER_CACHE 8
+
+typedef struct
+{
+   my_barrier_t *barrier;
+   unsigned long id; /* de l'initialisation de la barrière, qui peut être réutilisée */
+   int rank;         /* -1 avec l'algorithme central, qui n'en a pas besoin */
+   int spin;
+} my_barrier_self_t;
+
+static __thread my_barrier_self_t my_barrier_cache[MY_BARRIER_CACHE];
+static __thread int my_barrier_cache_next = 0;
+static volatile unsigned long my_barrier_ids = 0;
+
+static inline void my_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#else
+   __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline void my_futex_wait(volatile int *addr, int val)
+{
+   syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void my_futex_wake(volatile int *addr, int nb)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb, NULL, NULL, 0);
+}
+
+/* Ajuste la limite d'attente active après une attente de spins itérations */
+static inline void my_barrier_adapt(my_barrier_t *barrier, my_barrier_self_t *self, int spins, int slept)
+{
+   if (slept)
+      self->spin -= self->spin / 4;
+   else
+      self->spin += (2 * spins - self->spin) / 8;
+
+   if (self->spin < MY_BARRIER_SPIN_MIN)
+      self->spin = MY_BARRIER_SPIN_MIN;
+   if (self->spin > barrier->spin_max)
+      self->spin = barrier->spin_max;
+}
+
+/* Lève un drapeau, réveille le thread qui dort dessus s'il y en a un */
+static inline void my_flag_set(my_barrier_flag_t *flag)
+{
+   if (__atomic_exchange_n(&flag->val, 1, __ATOMIC_ACQ_REL) == 2)
+      my_futex_wake(&flag->val, 1);
+}
+
+/* Attend qu'un drapeau soit levé, puis le rebaisse */
+static inline void my_flag_wait(my_barrier_t *barrier, my_barrier_self_t *self, my_barrier_flag_t *flag)
+{
+   int spins = 0;
+   int val;
+
+   while (__atomic_load_n(&flag->val, __ATOMIC_ACQUIRE) != 1 && spins < self->spin)
+   {
+      my_cpu_relax();
+      spins++;
+   }
+   my_barrier_adapt(barrier, self, spins, spins == self->spin);
+
+   while ((val = __atomic_load_n(&flag->val, __ATOMIC_ACQUIRE)) != 1)
+   {
+      /* Annonce qu'il dort, sauf si le drapeau vient d'être levé */
+      if (val == 0 && !__atomic_compare_exchange_n(&flag->val, &val, 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+         continue;
+      my_futex_wait(&flag->val, 2);
+   }
+
+   /* Personne ne le relève avant que ce thread n'ait atteint l'épisode suivant */
+   __atomic_store_n(&flag->val, 0, __ATOMIC_RELAXED);
+}
+
+/* Attend que le sens global quitte old */
+static inline void my_barrier_wait_sense(my_barrier_t *barrier, my_barrier_self_t *self, int old)
+{
+   int spins = 0;
+
+   while (__atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE) == old && spins < self->spin)
+   {
+      my_cpu_relax();
+      spins++;
+   }
+   my_barrier_adapt(barrier, self, spins, spins == self->spin);
+   if (__atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE) != old)
+      return;
+
+   /* sleepers avant de relire sense, l'inverse chez my_barrier_release */
+   __atomic_fetch_add(&barrier->sleepers, 1, __ATOMIC_SEQ_CST);
+   while (__atomic_load_n(&barrier->sense, __ATOMIC_SEQ_CST) == old)
+      my_futex_wait(&barrier->sense, old);
+   __atomic_fetch_sub(&barrier->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Inverse le sens global : tous les threads arrêtés sur old repartent */
+static inline void my_barrier_release(my_barrier_t *barrier, int old)
+{
+   __atomic_store_n(&barrier->sense, !old, __ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&barrier->sleepers, __ATOMIC_SEQ_CST) > 0)
+      my_futex_wake(&barrier->sense, INT_MAX);
+}
+
+/* État du thread appelant pour barrier, NULL s'il n'y a plus de rang libre */
+static my_barrier_self_t *my_barrier_self(my_barrier_t *barrier)
+{
+   my_barrier_self_t *self;
+   pthread_t me;
+   int rank;
+   int i;
+
+   for (i = 0; i < MY_BARRIER_CACHE; i++)
+   {
+      self = &my_barrier_cache[i];
+      if (self->barrier == barrier && self->id == barrier->id)
+         return self;
+   }
+
+   self = &my_barrier_cache[my_barrier_cache_next];
+   my_barrier_cache_next = (my_barrier_cache_next + 1) % MY_BARRIER_CACHE;
+   self->barrier = barrier;
+   self->id = barrier->id;
+   self->rank = -1;
+   self->spin = barrier->spin_max < MY_BARRIER_SPIN_INIT ? barrier->spin_max : MY_BARRIER_SPIN_INIT;
+   if (barrier->algo == MY_BARRIER_CENTRAL)
+      return self;
+
+   /* Déjà venu, mais sorti du cache */
+   me = pthread_self();
+   for (rank = 0; rank < barrier->next_rank && rank < barrier->num; rank++)
+   {
+      if (pthread_equal(barrier->local[rank].owner, me))
+      {
+         self->rank = rank;
+         return self;
+      }
+   }
+
+   rank = __atomic_fetch_add(&barrier->next_rank, 1, __ATOMIC_RELAXED);
+   if (rank >= barrier->num)
+   {
+      self->barrier = NULL;
+      return NULL;
+   }
+   barrier->local[rank].owner = me;
+   self->rank = rank;
+   return self;
+}
+
+int my_barrier_init(my_barrier_t *barrier, int num)
+{
+   return my_barrier_init_algo(barrier, num, MY_BARRIER_CENTRAL);
+}
+
+int my_barrier_init_algo(my_barrier_t *barrier, int num, my_barrier_algo_t algo)
+{
+   size_t nb_flags = 0;
+   long nb_cpus;
+
+   if (barrier == NULL || num <= 0 ||
+       (algo != MY_BARRIER_CENTRAL && algo != MY_BARRIER_DISSEMINATION && algo != MY_BARRIER_TOURNAMENT))
+      return EINVAL;
+
+   memset(barrier, 0, sizeof(my_barrier_t));
+   barrier->algo = algo;
+   barrier->num = num;
+   barrier->count = num;
+   barrier->id = __atomic_add_fetch(&my_barrier_ids, 1, __ATOMIC_RELAXED);
+   while ((1 << barrier->rounds) < num)
+      barrier->rounds++;
+
+   /* Plus de threads que de processeurs : attendre activement retarderait
+      ceux qui n'ont pas encore de processeur */
+   nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   barrier->spin_max = nb_cpus > 0 && num > nb_cpus ? 0 : MY_BARRIER_SPIN_MAX;
+
+   if (algo == MY_BARRIER_DISSEMINATION)
+      nb_flags = (size_t)num * 2 * barrier->rounds;
+   else if (algo == MY_BARRIER_TOURNAMENT)
+      nb_flags = (size_t)num * barrier->rounds;
+
+   if (algo != MY_BARRIER_CENTRAL)
+   {
+      if (posix_memalign((void **)&barrier->local, 64, num * sizeof(my_barrier_local_t)) != 0)
+         return ENOMEM;
+      memset(barrier->local, 0, num * sizeof(my_barrier_local_t));
+   }
+   if (nb_flags > 0)
+   {
+      if (posix_memalign((void **)&barrier->flags, 64, nb_flags * sizeof(my_barrier_flag_t)) != 0)
+      {
+         free(barrier->local);
+         return ENOMEM;
+      }
+      memset(barrier->flags, 0, nb_flags * sizeof(my_barrier_flag_t));
+   }
+   return 0;
+}
+
+int my_barrier_destroy(my_barrier_t *barrier)
+{
+   if (barrier == NULL)
+      return EINVAL;
+   if (barrier->sleepers > 0 || (barrier->algo == MY_BARRIER_CENTRAL && barrier->count != barrier->num))
+      return EBUSY;
+
+   free(barrier->local);
+   free(barrier->flags);
+   barrier->local = NULL;
+   barrier->flags = NULL;
+   barrier->id = 0;
+   return 0;
+}
+
+static int my_barrier_wait_central(my_barrier_t *barrier, my_barrier_self_t *self)
+{
+   /* Le sens ne change pas avant que ce thread ne soit compté */
+   int old = __atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE);
+
+   if (__atomic_fetch_sub(&barrier->count, 1, __ATOMIC_ACQ_REL) == 1)
+   {
+      __atomic_store_n(&barrier->count, barrier->num, __ATOMIC_RELAXED);
+      my_barrier_release(barrier, old);
+      return MY_BARRIER_SERIAL_THREAD;
+   }
+   my_barrier_wait_sense(barrier, self, old);
+   return 0;
+}
+
+static int my_barrier_wait_dissemination(my_barrier_t *barrier, my_barrier_self_t *self)
+{
+   int rounds = barrier->rounds;
+   int rank = self->rank;
+   int p = barrier->local[rank].parity;
+   int partner;
+   int r;
+
+   for (r = 0; r < rounds; r++)
+   {
+      partner = (rank + (1 << r)) % barrier->num;
+      my_flag_set(&barrier->flags[(partner * 2 + p) * rounds + r]);
+      my_flag_wait(barrier, self, &barrier->flags[(rank * 2 + p) * rounds + r]);
+   }
+   barrier->local[rank].parity = 1 - p;
+   return rank == 0 ? MY_BARRIER_SERIAL_THREAD : 0;
+}
+
+static int my_barrier_wait_tournament(my_barrier_t *barrier, my_barrier_self_t *self)
+{
+   int old = __atomic_load_n(&barrier->sense, __ATOMIC_ACQUIRE);
+   int rounds = barrier->rounds;
+   int rank = self->rank;
+   int step;
+   int r;
+
+   for (r = 0; r < rounds; r++)
+   {
+      step = 1 << r;
+      /* Perdant de ce tour : il prévient le gagnant et attend la fin */
+      if (rank & step)
+      {
+         my_flag_set(&barrier->flags[(rank - step) * rounds + r]);
+         my_barrier_wait_sense(barrier, self, old);
+         return 0;
+      }
+      if (rank + step < barrier->num)
+         my_flag_wait(barrier, self, &barrier->flags[rank * rounds + r]);
+   }
+
+   /* Vainqueur du tournoi : tout le monde est arrivé */
+   my_barrier_release(barrier, old);
+   return MY_BARRIER_SERIAL_THREAD;
+}
+
+int my_barrier_wait(my_barrier_t *barrier)
+{
+   my_barrier_self_t *self;
+
+   if (barrier == NULL || barrier->id == 0)
+      return EINVAL;
+   self = my_barrier_self(barrier);
+   if (self == NULL)
+      return EINVAL;
+
+   switch (barrier->algo)
+   {
+   case MY_BARRIER_DISSEMINATION:
+      return my_barrier_wait_dissemination(barrier, self);
+   case MY_BARRIER_TOURNAMENT:
+      return my_barrier_wait_tournament(barrier, self);
+   default:
+      return my_barrier_wait_central(barrier, self);
+   }
+}
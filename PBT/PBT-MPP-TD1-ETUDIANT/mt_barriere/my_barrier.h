@@ -0,0 +1,63 @@
+#ifndef MY_BARRIER_H
+#define MY_BARRIER_H
+
+#include <pthread.h>
+
+/* Barrière pour threads noyau : attente active adaptative, puis futex.
+   Compiler avec -pthread, Linux uniquement. */
+
+/* Valeur rendue par my_barrier_wait à un seul des threads */
+#define MY_BARRIER_SERIAL_THREAD (-1)
+
+typedef enum
+{
+   MY_BARRIER_CENTRAL,       /* compteur et sens global inversé */
+   MY_BARRIER_DISSEMINATION, /* log2(num) tours de signaux deux à deux */
+   MY_BARRIER_TOURNAMENT     /* arbre de matchs, le vainqueur libère tout le monde */
+} my_barrier_algo_t;
+
+/* Drapeau sur lequel un thread attend, seul sur sa ligne de cache */
+typedef struct
+{
+   volatile int val; /* 0 : attente, 1 : levé, 2 : le thread dort dessus */
+} __attribute__((aligned(64))) my_barrier_flag_t;
+
+/* État d'un rang, seul sur sa ligne de cache */
+typedef struct
+{
+   pthread_t owner; /* thread qui a pris ce rang */
+   int parity;      /* dissémination : jeu de drapeaux de l'épisode en cours */
+} __attribute__((aligned(64))) my_barrier_local_t;
+
+typedef struct
+{
+   unsigned long id; /* 0 si elle n'est pas initialisée */
+   my_barrier_algo_t algo;
+   int num;
+   int rounds;                 /* ceil(log2(num)) */
+   volatile int next_rank;     /* rangs distribués aux threads, voir my_barrier.c */
+   my_barrier_local_t *local;  /* [num] */
+   my_barrier_flag_t *flags;   /* dissémination : [num][2][rounds], tournoi : [num][rounds] */
+   int spin_max;               /* attente active maximale, nulle s'il y a plus de threads que de processeurs */
+
+   /* Compteur et sens global, seuls sur leurs lignes de cache */
+   volatile int count __attribute__((aligned(64)));
+   volatile int sense __attribute__((aligned(64)));
+   volatile int sleepers; /* threads endormis sur sense */
+} my_barrier_t;
+
+/* Initialise une barrière pour num threads, avec l'algorithme central */
+int my_barrier_init(my_barrier_t *barrier, int num);
+
+/* Idem avec l'algorithme choisi. Avec la dissémination et le tournoi,
+   chaque thread prend un rang à sa première attente : ce sont toujours
+   les mêmes num threads qui doivent attendre. */
+int my_barrier_init_algo(my_barrier_t *barrier, int num, my_barrier_algo_t algo);
+
+int my_barrier_destroy(my_barrier_t *barrier);
+
+/* Bloque tant que tous les threads ne sont pas arrivés. Rend
+   MY_BARRIER_SERIAL_THREAD à un seul d'entre eux, 0 aux autres. */
+int my_barrier_wait(my_barrier_t *barrier);
+
+#endif
@@ -0,0 +1,224 @@
+#include <float.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reduce.h"
+
+/*
+ * Débit des réductions en Go/s (octets du tableau lus par seconde), pour
+ * chaque opération et chaque type, avec 1 à P threads du groupe. Deux
+ * références : une boucle séquentielle simple, et P threads créés à chaque
+ * appel comme dans la version naïve de max_tab. Meilleur temps sur REPS
+ * appels.
+ *
+ * gcc -O2 -pthread bench_reduce.c reduce.c -o bench_reduce
+ * ./bench_reduce [MO] [REPS]
+ */
+
+#define NB_COLS 8
+
+static const char *col_names[NB_COLS] = {"sum int", "min int", "max int", "argmax int",
+                                         "sum dbl", "min dbl", "max dbl", "argmax dbl"};
+
+typedef struct
+{
+   reduce_op_t op;
+   reduce_type_t type;
+   const void *tab;
+   long begin;
+   long end;
+   reduce_result_t res;
+} naive_arg_t;
+
+static double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Version de référence, une simple boucle */
+static void naive(naive_arg_t *a)
+{
+   const int *ti = a->tab;
+   const double *td = a->tab;
+   long i;
+
+   a->res.index = a->begin;
+   if (a->type == REDUCE_INT)
+   {
+      a->res.val.i = a->op == REDUCE_SUM ? 0 : ti[a->begin];
+      for (i = a->begin; i < a->end; i++)
+      {
+         if (a->op == REDUCE_SUM)
+            a->res.val.i += ti[i];
+         else if (a->op == REDUCE_MIN && ti[i] < a->res.val.i)
+            a->res.val.i = ti[i];
+         else if (a->op >= REDUCE_MAX && ti[i] > a->res.val.i)
+         {
+            a->res.val.i = ti[i];
+            a->res.index = i;
+         }
+      }
+   }
+   else
+   {
+      a->res.val.d = a->op == REDUCE_SUM ? 0 : td[a->begin];
+      for (i = a->begin; i < a->end; i++)
+      {
+         if (a->op == REDUCE_SUM)
+            a->res.val.d += td[i];
+         else if (a->op == REDUCE_MIN && td[i] < a->res.val.d)
+            a->res.val.d = td[i];
+         else if (a->op >= REDUCE_MAX && td[i] > a->res.val.d)
+         {
+            a->res.val.d = td[i];
+            a->res.index = i;
+         }
+      }
+   }
+}
+
+static void *naive_thread(void *arg)
+{
+   naive(arg);
+   return NULL;
+}
+
+/* Threads créés puis détruits à chaque appel ; résultat non combiné, seul
+   le temps compte ici */
+static void naive_mt(int nthreads, reduce_op_t op, reduce_type_t type, const void *tab, long n)
+{
+   pthread_t threads[nthreads];
+   naive_arg_t args[nthreads];
+   int k;
+
+   for (k = 0; k < nthreads; k++)
+   {
+      args[k].op = op;
+      args[k].type = type;
+      args[k].tab = tab;
+      args[k].begin = n * k / nthreads;
+      args[k].end = n * (k + 1) / nthreads;
+      pthread_create(&threads[k], NULL, naive_thread, &args[k]);
+   }
+   for (k = 0; k < nthreads; k++)
+      pthread_join(threads[k], NULL);
+}
+
+/* mode : 0 pour le groupe, -1 séquentiel, sinon nombre de threads créés */
+static double measure(reduce_pool_t *pool, int mode, int col, const void *tab, long n, int reps)
+{
+   reduce_op_t op = col % 4;
+   reduce_type_t type = col < 4 ? REDUCE_INT : REDUCE_DOUBLE;
+   size_t elsize = type == REDUCE_INT ? sizeof(int) : sizeof(double);
+   double best = DBL_MAX;
+   double t;
+   reduce_result_t res;
+   naive_arg_t arg = {op, type, tab, 0, n, {0, {0}}};
+   int r;
+
+   for (r = 0; r < reps; r++)
+   {
+      t = now();
+      if (mode == 0)
+         reduce_run(pool, op, type, tab, n, &res);
+      else if (mode < 0)
+         naive(&arg);
+      else
+         naive_mt(mode, op, type, tab, n);
+      t = now() - t;
+      best = t < best ? t : best;
+   }
+   return n * elsize / best / 1e9;
+}
+
+/* Une ligne du tableau ; le tableau est alloué par pool s'il y en a un */
+static void row(const char *name, reduce_pool_t *pool, int mode, size_t bytes, int reps)
+{
+   int *ti;
+   double *td;
+   long i;
+   int col;
+
+   if (pool != NULL)
+   {
+      ti = reduce_alloc(pool, bytes);
+      td = reduce_alloc(pool, bytes);
+   }
+   else
+   {
+      ti = malloc(bytes);
+      td = malloc(bytes);
+   }
+   for (i = 0; i < (long)(bytes / sizeof(int)); i++)
+      ti[i] = rand();
+   for (i = 0; i < (long)(bytes / sizeof(double)); i++)
+      td[i] = rand() / (double)RAND_MAX;
+
+   printf("%-14s", name);
+   for (col = 0; col < NB_COLS; col++)
+   {
+      if (col < 4)
+         printf(" %10.2f", measure(pool, mode, col, ti, bytes / sizeof(int), reps));
+      else
+         printf(" %10.2f", measure(pool, mode, col, td, bytes / sizeof(double), reps));
+      fflush(stdout);
+   }
+   printf("\n");
+
+   if (pool != NULL)
+   {
+      reduce_free(ti, bytes);
+      reduce_free(td, bytes);
+   }
+   else
+   {
+      free(ti);
+      free(td);
+   }
+}
+
+int main(int argc, char **argv)
+{
+   size_t bytes = (argc > 1 ? atol(argv[1]) : 256) << 20;
+   int reps = argc > 2 ? atoi(argv[2]) : 10;
+   int nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   reduce_pool_t *pool;
+   char name[32];
+   int nt;
+   int col;
+
+   if (bytes == 0 || reps <= 0)
+   {
+      fprintf(stderr, "Usage : %s [MO] [REPS]\n", argv[0]);
+      return 1;
+   }
+
+   /* Les noyaux sont choisis à la création du premier groupe */
+   pool = reduce_pool_create(1);
+   printf("%zu Mo par tableau, %d processeurs, noyaux %s (Go/s)\n", bytes >> 20, nb_cpus, reduce_isa());
+   reduce_pool_destroy(pool);
+
+   printf("%-14s", "");
+   for (col = 0; col < NB_COLS; col++)
+      printf(" %10s", col_names[col]);
+   printf("\n");
+
+   row("sequentiel", NULL, -1, bytes, reps);
+   snprintf(name, sizeof(name), "crees x%d", nb_cpus);
+   row(name, NULL, nb_cpus, bytes, reps);
+
+   /* Puissances de deux, puis tous les processeurs */
+   for (nt = 1; nt <= nb_cpus; nt = nt < nb_cpus && nt * 2 > nb_cpus ? nb_cpus : nt * 2)
+   {
+      pool = reduce_pool_create(nt);
+      snprintf(name, sizeof(name), "groupe x%d", nt);
+      row(name, pool, 0, bytes, reps);
+      reduce_pool_destroy(pool);
+   }
+   return 0;
+}
@@ -1,6 +1,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "reduce.h"
+
+/* gcc -O2 -pthread max_tab.c reduce.c -o max_tab
+   ./max_tab NELT NTHREADS */
+
 #define MAX_VAL 1000
 
 int max_seq(int *tab, int nelt)
@@ -21,14 +26,34 @@ int max_seq(int *tab, int nelt)
 
 int main(int argc, char **argv)
 {
-    int nthreads, nelt, i, t, maxv_seq, maxv_mt;
+    int nthreads, nelt, i, maxv_seq, maxv_mt;
     int *tab;
+    reduce_pool_t *pool;
+    reduce_result_t res;
 
+    if (argc < 3)
+    {
+	fprintf(stderr, "Usage : %s NELT NTHREADS\n", argv[0]);
+	return 1;
+    }
     nelt     = atoi(argv[1]); /* Taille du tableau */
     nthreads = atoi(argv[2]); /* Nombre de threads a creer */
 
-    /* Creation du tableau et remplissage aleatoire */
-    tab = (int*)malloc(nelt*sizeof(int));
+    /* Creation du tableau et remplissage aleatoire : alloue par le groupe
+       de threads pour que chacun ait sa tranche pres de lui */
+    pool = reduce_pool_create(nthreads);
+    if (pool == NULL)
+    {
+	fprintf(stderr, "Impossible de creer %d threads\n", nthreads);
+	return 1;
+    }
+    tab = (int*)reduce_alloc(pool, nelt*sizeof(int));
+    if (tab == NULL)
+    {
+	fprintf(stderr, "Impossible d'allouer %d elements\n", nelt);
+	reduce_pool_destroy(pool);
+	return 1;
+    }
 
     srand(nelt);
     for( i = 0 ; i < nelt ; i++)
@@ -38,7 +63,10 @@ int main(int argc, char **argv)
 
     /* Recherche du max de tab en contexte multithread => maxv_mt*/
     maxv_mt = 0;
-    /* A ECRIRE */
+    if (reduce_run(pool, REDUCE_MAX, REDUCE_INT, tab, nelt, &res) == 0)
+    {
+	maxv_mt = res.val.i;
+    }
 
     /* Recherche du max en sequentiel pour verification => maxv_seq */
     maxv_seq = max_seq(tab, nelt);
@@ -54,7 +82,8 @@ int main(int argc, char **argv)
 	printf("Votre valeur    : %d\n", maxv_mt);
     }
 
-    free(tab);
+    reduce_free(tab, nelt*sizeof(int));
+    reduce_pool_destroy(pool);
 
     return 0;
 }
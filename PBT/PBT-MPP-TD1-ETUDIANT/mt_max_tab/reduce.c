@@ -0,0 +1,661 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "reduce.h"
+
+/*
+ * Les threads du groupe attendent un travail sur un compteur de
+ * générations : attente active courte, puis futex. Le thread appelant
+ * publie le travail, incrémente la génération et attend que le compteur
+ * pending retombe à zéro, de la même façon. Chaque thread écrit son
+ * résultat partiel dans sa propre ligne de cache, l'appelant les combine.
+ *
+ * Le tableau est découpé en tranches d'un nombre entier de pages, calculées
+ * à partir de sa taille en octets, les mêmes pour reduce_alloc et pour
+ * reduce_run si cette taille est la même : chaque thread relit alors les
+ * pages qu'il a touchées en premier, donc placées sur son noeud NUMA.
+ *
+ * Les noyaux existent en AVX-512, AVX2 et scalaire, choisis selon le
+ * processeur. La somme de doubles n'est pas faite dans l'ordre du
+ * tableau : elle peut différer de la somme séquentielle dans les derniers
+ * bits.
+ */
+
+#define REDUCE_PAGE 4096
+#define REDUCE_SPIN 20000
+#define REDUCE_BLOCK 2048 /* éléments par bloc pour REDUCE_ARGMAX */
+
+typedef void (*reduce_kernel_t)(const void *tab, long begin, long end, reduce_result_t *res);
+
+enum
+{
+   JOB_RUN,
+   JOB_TOUCH,
+   JOB_EXIT
+};
+
+typedef struct
+{
+   reduce_result_t res;
+   int empty; /* tranche vide, rien à combiner */
+} __attribute__((aligned(64))) reduce_partial_t;
+
+struct reduce_pool_s
+{
+   int nthreads;
+   pthread_t *threads;
+   reduce_partial_t *partial;
+
+   /* Travail en cours, écrit par l'appelant avant d'incrémenter gen */
+   int job;
+   reduce_op_t op;
+   reduce_type_t type;
+   const char *tab;
+   size_t bytes;
+   size_t elsize;
+
+   volatile int gen __attribute__((aligned(64)));
+   volatile int sleepers; /* threads endormis sur gen */
+   volatile int pending __attribute__((aligned(64)));
+   volatile int caller_sleeping;
+};
+
+typedef struct
+{
+   reduce_pool_t *pool;
+   int rank;
+} reduce_worker_arg_t;
+
+/* Noyaux */
+
+static void sum_int_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   long s = 0;
+   long i;
+   for (i = b; i < e; i++)
+      s += tab[i];
+   res->val.i = s;
+}
+
+static void sum_double_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   double s = 0;
+   long i;
+   for (i = b; i < e; i++)
+      s += tab[i];
+   res->val.d = s;
+}
+
+static void min_int_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   int m = INT_MAX;
+   long i;
+   for (i = b; i < e; i++)
+      m = tab[i] < m ? tab[i] : m;
+   res->val.i = m;
+}
+
+static void max_int_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   int m = INT_MIN;
+   long i;
+   for (i = b; i < e; i++)
+      m = tab[i] > m ? tab[i] : m;
+   res->val.i = m;
+}
+
+static void min_double_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   double m = INFINITY;
+   long i;
+   for (i = b; i < e; i++)
+      m = tab[i] < m ? tab[i] : m;
+   res->val.d = m;
+}
+
+static void max_double_scalar(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   double m = -INFINITY;
+   long i;
+   for (i = b; i < e; i++)
+      m = tab[i] > m ? tab[i] : m;
+   res->val.d = m;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) static void sum_int_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m256i acc0 = _mm256_setzero_si256();
+   __m256i acc1 = _mm256_setzero_si256();
+   long tmp[4];
+   long i;
+
+   /* Élargis en 64 bits avant d'additionner */
+   for (i = b; i + 8 <= e; i += 8)
+   {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(tab + i));
+      acc0 = _mm256_add_epi64(acc0, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+      acc1 = _mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+   }
+   _mm256_storeu_si256((__m256i *)tmp, _mm256_add_epi64(acc0, acc1));
+   sum_int_scalar(t, i, e, res);
+   res->val.i += tmp[0] + tmp[1] + tmp[2] + tmp[3];
+}
+
+__attribute__((target("avx2"))) static void sum_double_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m256d acc0 = _mm256_setzero_pd();
+   __m256d acc1 = _mm256_setzero_pd();
+   double tmp[4];
+   long i;
+
+   for (i = b; i + 8 <= e; i += 8)
+   {
+      acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(tab + i));
+      acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(tab + i + 4));
+   }
+   _mm256_storeu_pd(tmp, _mm256_add_pd(acc0, acc1));
+   sum_double_scalar(t, i, e, res);
+   res->val.d += (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+}
+
+__attribute__((target("avx2"))) static void min_int_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m256i m = _mm256_set1_epi32(INT_MAX);
+   int tmp[8];
+   long i;
+   int k;
+
+   for (i = b; i + 8 <= e; i += 8)
+      m = _mm256_min_epi32(m, _mm256_loadu_si256((const __m256i *)(tab + i)));
+   _mm256_storeu_si256((__m256i *)tmp, m);
+   min_int_scalar(t, i, e, res);
+   for (k = 0; k < 8; k++)
+      res->val.i = tmp[k] < res->val.i ? tmp[k] : res->val.i;
+}
+
+__attribute__((target("avx2"))) static void max_int_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m256i m = _mm256_set1_epi32(INT_MIN);
+   int tmp[8];
+   long i;
+   int k;
+
+   for (i = b; i + 8 <= e; i += 8)
+      m = _mm256_max_epi32(m, _mm256_loadu_si256((const __m256i *)(tab + i)));
+   _mm256_storeu_si256((__m256i *)tmp, m);
+   max_int_scalar(t, i, e, res);
+   for (k = 0; k < 8; k++)
+      res->val.i = tmp[k] > res->val.i ? tmp[k] : res->val.i;
+}
+
+__attribute__((target("avx2"))) static void min_double_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m256d m = _mm256_set1_pd(INFINITY);
+   double tmp[4];
+   long i;
+   int k;
+
+   for (i = b; i + 4 <= e; i += 4)
+      m = _mm256_min_pd(m, _mm256_loadu_pd(tab + i));
+   _mm256_storeu_pd(tmp, m);
+   min_double_scalar(t, i, e, res);
+   for (k = 0; k < 4; k++)
+      res->val.d = tmp[k] < res->val.d ? tmp[k] : res->val.d;
+}
+
+__attribute__((target("avx2"))) static void max_double_avx2(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m256d m = _mm256_set1_pd(-INFINITY);
+   double tmp[4];
+   long i;
+   int k;
+
+   for (i = b; i + 4 <= e; i += 4)
+      m = _mm256_max_pd(m, _mm256_loadu_pd(tab + i));
+   _mm256_storeu_pd(tmp, m);
+   max_double_scalar(t, i, e, res);
+   for (k = 0; k < 4; k++)
+      res->val.d = tmp[k] > res->val.d ? tmp[k] : res->val.d;
+}
+
+__attribute__((target("avx512f"))) static void sum_int_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m512i acc0 = _mm512_setzero_si512();
+   __m512i acc1 = _mm512_setzero_si512();
+   long i;
+
+   for (i = b; i + 16 <= e; i += 16)
+   {
+      __m512i v = _mm512_loadu_si512(tab + i);
+      acc0 = _mm512_add_epi64(acc0, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+      acc1 = _mm512_add_epi64(acc1, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+   }
+   sum_int_scalar(t, i, e, res);
+   res->val.i += _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static void sum_double_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m512d acc0 = _mm512_setzero_pd();
+   __m512d acc1 = _mm512_setzero_pd();
+   long i;
+
+   for (i = b; i + 16 <= e; i += 16)
+   {
+      acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(tab + i));
+      acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(tab + i + 8));
+   }
+   sum_double_scalar(t, i, e, res);
+   res->val.d += _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static void min_int_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m512i m = _mm512_set1_epi32(INT_MAX);
+   long i;
+   int v;
+
+   for (i = b; i + 16 <= e; i += 16)
+      m = _mm512_min_epi32(m, _mm512_loadu_si512(tab + i));
+   min_int_scalar(t, i, e, res);
+   v = _mm512_reduce_min_epi32(m);
+   res->val.i = v < res->val.i ? v : res->val.i;
+}
+
+__attribute__((target("avx512f"))) static void max_int_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const int *tab = t;
+   __m512i m = _mm512_set1_epi32(INT_MIN);
+   long i;
+   int v;
+
+   for (i = b; i + 16 <= e; i += 16)
+      m = _mm512_max_epi32(m, _mm512_loadu_si512(tab + i));
+   max_int_scalar(t, i, e, res);
+   v = _mm512_reduce_max_epi32(m);
+   res->val.i = v > res->val.i ? v : res->val.i;
+}
+
+__attribute__((target("avx512f"))) static void min_double_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m512d m = _mm512_set1_pd(INFINITY);
+   long i;
+   double v;
+
+   for (i = b; i + 8 <= e; i += 8)
+      m = _mm512_min_pd(m, _mm512_loadu_pd(tab + i));
+   min_double_scalar(t, i, e, res);
+   v = _mm512_reduce_min_pd(m);
+   res->val.d = v < res->val.d ? v : res->val.d;
+}
+
+__attribute__((target("avx512f"))) static void max_double_avx512(const void *t, long b, long e, reduce_result_t *res)
+{
+   const double *tab = t;
+   __m512d m = _mm512_set1_pd(-INFINITY);
+   long i;
+   double v;
+
+   for (i = b; i + 8 <= e; i += 8)
+      m = _mm512_max_pd(m, _mm512_loadu_pd(tab + i));
+   max_double_scalar(t, i, e, res);
+   v = _mm512_reduce_max_pd(m);
+   res->val.d = v > res->val.d ? v : res->val.d;
+}
+
+#endif
+
+/* Noyaux choisis par reduce_pool_create : [op][type], sans REDUCE_ARGMAX */
+static reduce_kernel_t kernels[REDUCE_ARGMAX][2] = {
+    {sum_int_scalar, sum_double_scalar},
+    {min_int_scalar, min_double_scalar},
+    {max_int_scalar, max_double_scalar}};
+static const char *isa = "scalaire";
+
+static void reduce_select_kernels(void)
+{
+#if defined(__x86_64__)
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f"))
+   {
+      reduce_kernel_t k[REDUCE_ARGMAX][2] = {
+          {sum_int_avx512, sum_double_avx512},
+          {min_int_avx512, min_double_avx512},
+          {max_int_avx512, max_double_avx512}};
+      memcpy(kernels, k, sizeof(kernels));
+      isa = "avx512";
+   }
+   else if (__builtin_cpu_supports("avx2"))
+   {
+      reduce_kernel_t k[REDUCE_ARGMAX][2] = {
+          {sum_int_avx2, sum_double_avx2},
+          {min_int_avx2, min_double_avx2},
+          {max_int_avx2, max_double_avx2}};
+      memcpy(kernels, k, sizeof(kernels));
+      isa = "avx2";
+   }
+#endif
+}
+
+const char *reduce_isa(void)
+{
+   return isa;
+}
+
+/* Maximum de chaque bloc avec le noyau vectoriel ; le bloc n'est relu,
+   depuis le cache, que s'il contient un nouveau maximum. La relecture
+   cherche elle-même le premier maximum du bloc, sans comparer à la valeur
+   rendue par le noyau */
+static void reduce_argmax(reduce_type_t type, const void *tab, long b, long e, reduce_result_t *res)
+{
+   reduce_kernel_t max = kernels[REDUCE_MAX][type];
+   const int *ti = tab;
+   const double *td = tab;
+   reduce_result_t block;
+   long best;
+   long end;
+   long i;
+
+   res->index = -1;
+   for (; b < e; b = end)
+   {
+      end = b + REDUCE_BLOCK < e ? b + REDUCE_BLOCK : e;
+      max(tab, b, end, &block);
+      if (type == REDUCE_INT && (res->index < 0 || block.val.i > res->val.i))
+      {
+         for (best = b, i = b + 1; i < end; i++)
+            best = ti[i] > ti[best] ? i : best;
+         res->val.i = ti[best];
+         res->index = best;
+      }
+      else if (type == REDUCE_DOUBLE && (res->index < 0 || block.val.d > res->val.d))
+      {
+         for (best = b, i = b + 1; i < end; i++)
+            best = td[i] > td[best] ? i : best;
+         res->val.d = td[best];
+         res->index = best;
+      }
+   }
+}
+
+/* Groupe de threads */
+
+static inline void reduce_futex_wait(volatile int *addr, int val)
+{
+   syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void reduce_futex_wake(volatile int *addr, int nb)
+{
+   syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb, NULL, NULL, 0);
+}
+
+static inline void reduce_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_ia32_pause();
+#endif
+}
+
+/* Attend que *addr quitte val, en s'annonçant dans *sleeping avant de dormir */
+static void reduce_wait(volatile int *addr, int val, volatile int *sleeping)
+{
+   int spins;
+
+   for (spins = 0; spins < REDUCE_SPIN; spins++)
+   {
+      if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != val)
+         return;
+      reduce_cpu_relax();
+   }
+
+   __atomic_fetch_add(sleeping, 1, __ATOMIC_SEQ_CST);
+   while (__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val)
+      reduce_futex_wait(addr, val);
+   __atomic_fetch_sub(sleeping, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Tranche du thread rank sur bytes octets : des pages entières */
+static void reduce_slice(reduce_pool_t *pool, size_t bytes, int rank, size_t *begin, size_t *end)
+{
+   size_t chunk = (bytes + pool->nthreads - 1) / pool->nthreads;
+
+   chunk = (chunk + REDUCE_PAGE - 1) / REDUCE_PAGE * REDUCE_PAGE;
+   *begin = (size_t)rank * chunk < bytes ? (size_t)rank * chunk : bytes;
+   *end = *begin + chunk < bytes ? *begin + chunk : bytes;
+}
+
+static void *reduce_worker(void *arg)
+{
+   reduce_pool_t *pool = ((reduce_worker_arg_t *)arg)->pool;
+   int rank = ((reduce_worker_arg_t *)arg)->rank;
+   reduce_partial_t *partial = &pool->partial[rank];
+   int gen = 0;
+   size_t begin, end, i;
+
+   free(arg);
+   while (1)
+   {
+      reduce_wait(&pool->gen, gen, &pool->sleepers);
+      gen = pool->gen;
+      if (pool->job == JOB_EXIT)
+         break;
+
+      reduce_slice(pool, pool->bytes, rank, &begin, &end);
+      partial->empty = begin == end;
+      if (pool->job == JOB_TOUCH)
+      {
+         for (i = begin; i < end; i += REDUCE_PAGE)
+            ((volatile char *)pool->tab)[i] = 0;
+      }
+      else if (begin < end && pool->op == REDUCE_ARGMAX)
+      {
+         reduce_argmax(pool->type, pool->tab, begin / pool->elsize, end / pool->elsize, &partial->res);
+      }
+      else if (begin < end)
+      {
+         kernels[pool->op][pool->type](pool->tab, begin / pool->elsize, end / pool->elsize, &partial->res);
+      }
+
+      if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0 &&
+          __atomic_load_n(&pool->caller_sleeping, __ATOMIC_SEQ_CST) > 0)
+         reduce_futex_wake(&pool->pending, 1);
+   }
+   return NULL;
+}
+
+/* Lance le travail décrit dans pool sur tous les threads et l'attend */
+static void reduce_dispatch(reduce_pool_t *pool, int job)
+{
+   int pending;
+
+   pool->job = job;
+   __atomic_store_n(&pool->pending, pool->nthreads, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&pool->gen, 1, __ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0)
+      reduce_futex_wake(&pool->gen, INT_MAX);
+   if (job == JOB_EXIT)
+      return;
+
+   while ((pending = __atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE)) != 0)
+      reduce_wait(&pool->pending, pending, &pool->caller_sleeping);
+}
+
+reduce_pool_t *reduce_pool_create(int nthreads)
+{
+   reduce_pool_t *pool;
+   reduce_worker_arg_t *arg;
+   pthread_attr_t attr;
+   cpu_set_t allowed;
+   cpu_set_t set;
+   int cpus[CPU_SETSIZE];
+   int nb_cpus = 0;
+   int err;
+   int i;
+
+   if (nthreads <= 0)
+      return NULL;
+   reduce_select_kernels();
+
+   pool = calloc(1, sizeof(reduce_pool_t));
+   if (pool == NULL)
+      return NULL;
+   pool->nthreads = nthreads;
+   pool->threads = malloc(nthreads * sizeof(pthread_t));
+   if (pool->threads == NULL || posix_memalign((void **)&pool->partial, 64, nthreads * sizeof(reduce_partial_t)) != 0)
+   {
+      free(pool->threads);
+      free(pool);
+      return NULL;
+   }
+
+   if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+   {
+      for (i = 0; i < CPU_SETSIZE; i++)
+         if (CPU_ISSET(i, &allowed))
+            cpus[nb_cpus++] = i;
+   }
+
+   for (i = 0; i < nthreads; i++)
+   {
+      arg = malloc(sizeof(reduce_worker_arg_t));
+      if (arg == NULL)
+         break;
+      arg->pool = pool;
+      arg->rank = i;
+      pthread_attr_init(&attr);
+      if (nb_cpus > 0)
+      {
+         CPU_ZERO(&set);
+         CPU_SET(cpus[i % nb_cpus], &set);
+         pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+      }
+      err = pthread_create(&pool->threads[i], &attr, reduce_worker, arg);
+      pthread_attr_destroy(&attr);
+      if (err != 0)
+      {
+         free(arg);
+         break;
+      }
+   }
+
+   /* Un thread manquant ne décrémenterait jamais pending : on arrête ceux
+      qui tournent déjà */
+   if (i < nthreads)
+   {
+      pool->nthreads = i;
+      reduce_pool_destroy(pool);
+      return NULL;
+   }
+   return pool;
+}
+
+void reduce_pool_destroy(reduce_pool_t *pool)
+{
+   int i;
+
+   if (pool == NULL)
+      return;
+   reduce_dispatch(pool, JOB_EXIT);
+   for (i = 0; i < pool->nthreads; i++)
+      pthread_join(pool->threads[i], NULL);
+   free(pool->partial);
+   free(pool->threads);
+   free(pool);
+}
+
+void *reduce_alloc(reduce_pool_t *pool, size_t size)
+{
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   if (ptr == MAP_FAILED)
+      return NULL;
+   pool->tab = ptr;
+   pool->bytes = size;
+   reduce_dispatch(pool, JOB_TOUCH);
+   return ptr;
+}
+
+void reduce_free(void *ptr, size_t size)
+{
+   munmap(ptr, size);
+}
+
+int reduce_run(reduce_pool_t *pool, reduce_op_t op, reduce_type_t type, const void *tab, long n,
+               reduce_result_t *res)
+{
+   reduce_result_t *r;
+   int found = 0;
+   int i;
+
+   if (pool == NULL || tab == NULL || n <= 0 || res == NULL || op < REDUCE_SUM || op > REDUCE_ARGMAX ||
+       (type != REDUCE_INT && type != REDUCE_DOUBLE))
+      return EINVAL;
+
+   pool->op = op;
+   pool->type = type;
+   pool->tab = tab;
+   pool->elsize = type == REDUCE_INT ? sizeof(int) : sizeof(double);
+   pool->bytes = n * pool->elsize;
+   reduce_dispatch(pool, JOB_RUN);
+
+   /* Tranches dans l'ordre : à égalité, le premier indice l'emporte */
+   for (i = 0; i < pool->nthreads; i++)
+   {
+      if (pool->partial[i].empty)
+         continue;
+      r = &pool->partial[i].res;
+      if (!found)
+      {
+         *res = *r;
+         found = 1;
+      }
+      else if (type == REDUCE_INT)
+      {
+         if (op == REDUCE_SUM)
+            res->val.i += r->val.i;
+         else if ((op == REDUCE_MIN && r->val.i < res->val.i) || (op != REDUCE_MIN && r->val.i > res->val.i))
+            *res = *r;
+      }
+      else
+      {
+         if (op == REDUCE_SUM)
+            res->val.d += r->val.d;
+         else if ((op == REDUCE_MIN && r->val.d < res->val.d) || (op != REDUCE_MIN && r->val.d > res->val.d))
+            *res = *r;
+      }
+   }
+   return 0;
+}
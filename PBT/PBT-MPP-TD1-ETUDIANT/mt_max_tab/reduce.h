@@ -0,0 +1,57 @@
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stddef.h>
+
+/* Réductions parallèles sur un tableau : un groupe de threads noyau créés
+   une seule fois, fixés chacun sur un processeur, qui se partagent le
+   tableau par tranches. Compiler avec -pthread, Linux uniquement. */
+
+typedef enum
+{
+   REDUCE_SUM,
+   REDUCE_MIN,
+   REDUCE_MAX,
+   REDUCE_ARGMAX /* premier indice du maximum */
+} reduce_op_t;
+
+typedef enum
+{
+   REDUCE_INT,
+   REDUCE_DOUBLE
+} reduce_type_t;
+
+typedef struct
+{
+   long index; /* REDUCE_ARGMAX uniquement */
+   union
+   {
+      long i; /* somme d'entiers sur 64 bits, sans débordement */
+      double d;
+   } val;
+} reduce_result_t;
+
+typedef struct reduce_pool_s reduce_pool_t;
+
+/* Crée nthreads threads, fixés sur les processeurs autorisés à tour de
+   rôle.  NULL en cas d'échec. */
+reduce_pool_t *reduce_pool_create(int nthreads);
+void reduce_pool_destroy(reduce_pool_t *pool);
+
+/* Alloue size octets dont chaque tranche est touchée en premier par le
+   thread qui la parcourra : ses pages sont sur le noeud NUMA de ce thread.
+   Mis à zéro. Les tranches dépendent de la taille : reduce_run ne les
+   retrouve que sur n éléments avec n * taille d'un élément == size. */
+void *reduce_alloc(reduce_pool_t *pool, size_t size);
+void reduce_free(void *ptr, size_t size);
+
+/* Calcule op sur les n éléments de tab, de type type.  Rend 0, ou EINVAL.
+   Un seul appel à la fois par groupe. */
+int reduce_run(reduce_pool_t *pool, reduce_op_t op, reduce_type_t type, const void *tab, long n,
+               reduce_result_t *res);
+
+/* Jeu d'instructions des noyaux choisi à la création : "avx512", "avx2"
+   ou "scalaire" */
+const char *reduce_isa(void);
+
+#endif
@@ -16,6 +16,9 @@
 /* Define to 1 if you have the <dmalloc.h> header file. */
 /* #undef HAVE_DMALLOC_H */
 
+/* Define to 1 if you have the `epoll_create' function. */
+#define HAVE_EPOLL_CREATE 1
+
 /* Define to 1 if you have the <errno.h> header file. */
 #define HAVE_ERRNO_H 1
 
@@ -283,7 +286,7 @@
 #define PTH_STACKGROWTH -1
 
 /* define for the paths to syscall dynamic libraries */
-#define PTH_SYSCALL_LIBS "/usr/lib/libnsl.so:/lib/libnsl.so:/usr/lib/libc.so:/lib/libc.so"
+#define PTH_SYSCALL_LIBS ""
 
 /* Define to 1 if you have the ANSI C header files. */
 #define STDC_HEADERS 1
@@ -70,6 +70,9 @@
 #ifdef HAVE_DLFCN_H
 #include <dlfcn.h>
 #endif
+#ifdef HAVE_EPOLL_CREATE
+#include <sys/epoll.h>
+#endif
 
 /* dmalloc support */
 #ifdef PTH_DMALLOC
@@ -405,6 +408,7 @@ struct pth_st {
 
     /* event handling */
     pth_event_t    events;               /* events the tread is waiting for             */
+    int            iowait;               /* parked in the fd index instead of the WQ    */
 
     /* per-thread signal handling */
     sigset_t       sigpending;           /* set    of pending signals                   */
@@ -486,6 +490,10 @@ struct pth_event_st {
         struct { pth_t tid; }                                       TID;
         struct { pth_event_func_t func; void *arg; pth_time_t tv; } FUNC;
     } ev_args;
+    /* fd index of the epoll(7) backend, see pth_sched.c */
+    pth_t ev_fdtid;                    /* waiting thread while registered, else NULL */
+    struct pth_event_st *ev_fdnext;    /* other events registered for the same fd   */
+    struct pth_event_st *ev_fdprev;
 };
 
 #line 30 "../pth_msg.c"
@@ -542,6 +550,8 @@ struct pth_attr_st {
 #define pth_DQ __pth_DQ
 #define pth_favournew __pth_favournew
 #define pth_loadval __pth_loadval
+#define pth_epfd __pth_epfd
+#define pth_iowait_num __pth_iowait_num
 #define pth_initialized __pth_initialized
 
 /* move intern functions to hidden namespace */
@@ -556,6 +566,7 @@ struct pth_attr_st {
 #define pth_sc_connect __pth_sc_connect
 #define pth_sc_accept __pth_sc_accept
 #define pth_sc_select __pth_sc_select
+#define pth_sc_poll __pth_sc_poll
 #define pth_sc_read __pth_sc_read
 #define pth_sc_write __pth_sc_write
 #define pth_sc_readv __pth_sc_readv
@@ -593,6 +604,7 @@ struct pth_attr_st {
 #define pth_util_sigdelete __pth_util_sigdelete
 #define pth_util_cpystrn __pth_util_cpystrn
 #define pth_util_fd_valid __pth_util_fd_valid
+#define pth_util_fd_poll __pth_util_fd_poll
 #define pth_util_fds_merge __pth_util_fds_merge
 #define pth_util_fds_test __pth_util_fds_test
 #define pth_util_fds_select __pth_util_fds_select
@@ -605,6 +617,9 @@ struct pth_attr_st {
 #define pth_pqueue_tail __pth_pqueue_tail
 #define pth_pqueue_walk __pth_pqueue_walk
 #define pth_pqueue_contains __pth_pqueue_contains
+#define pth_sched_iowait_park __pth_sched_iowait_park
+#define pth_sched_iowait_unpark __pth_sched_iowait_unpark
+#define pth_sched_iowait_contains __pth_sched_iowait_contains
 #define pth_scheduler_init __pth_scheduler_init
 #define pth_scheduler_drop __pth_scheduler_drop
 #define pth_scheduler_kill __pth_scheduler_kill
@@ -634,7 +649,7 @@ extern int pth_errno_storage;
 extern int pth_errno_flag;
 #line 40 "../pth_time.c"
 extern pth_time_t pth_time_zero;
-#line 91 "../pth_tcb.c"
+#line 92 "../pth_tcb.c"
 extern const char *pth_state_names[];
 #line 30 "../pth_sched.c"
 extern pth_t pth_main;
@@ -656,6 +671,10 @@ extern pth_pqueue_t pth_DQ;
 extern int pth_favournew;
 #line 39 "../pth_sched.c"
 extern float pth_loadval;
+#line 50 "../pth_sched.c"
+extern int pth_epfd;
+#line 51 "../pth_sched.c"
+extern int pth_iowait_num;
 #line 39 "../pth_lib.c"
 extern int pth_initialized;
 
@@ -664,7 +683,7 @@ extern int pth_initialized;
 extern void pth_debug(const char *, int, int, const char *, ...);
 #line 81 "../pth_debug.c"
 extern void pth_dumpstate(FILE *);
-#line 98 "../pth_debug.c"
+#line 99 "../pth_debug.c"
 extern void pth_dumpqueue(FILE *, const char *, pth_pqueue_t *);
 #line 187 "../pth_syscall.c"
 extern void pth_syscall_init(void);
@@ -682,21 +701,23 @@ extern int pth_sc_connect(int, const struct sockaddr *, socklen_t);
 extern int pth_sc_accept(int, struct sockaddr *, socklen_t *);
 #line 482 "../pth_syscall.c"
 extern int pth_sc_select(int, fd_set *, fd_set *, fd_set *, struct timeval *);
-#line 530 "../pth_syscall.c"
+#line 519 "../pth_syscall.c"
+extern int pth_sc_poll(struct pollfd *, nfds_t, int);
+#line 541 "../pth_syscall.c"
 extern ssize_t pth_sc_read(int, void *, size_t);
-#line 552 "../pth_syscall.c"
+#line 563 "../pth_syscall.c"
 extern ssize_t pth_sc_write(int, const void *, size_t);
-#line 574 "../pth_syscall.c"
+#line 585 "../pth_syscall.c"
 extern ssize_t pth_sc_readv(int, const struct iovec *, int);
-#line 596 "../pth_syscall.c"
+#line 607 "../pth_syscall.c"
 extern ssize_t pth_sc_writev(int, const struct iovec *, int);
-#line 640 "../pth_syscall.c"
+#line 651 "../pth_syscall.c"
 extern ssize_t pth_sc_recv(int, void *, size_t, int);
-#line 664 "../pth_syscall.c"
+#line 675 "../pth_syscall.c"
 extern ssize_t pth_sc_send(int, void *, size_t, int);
-#line 688 "../pth_syscall.c"
+#line 699 "../pth_syscall.c"
 extern ssize_t pth_sc_recvfrom(int, void *, size_t, int, struct sockaddr *, socklen_t *);
-#line 710 "../pth_syscall.c"
+#line 721 "../pth_syscall.c"
 extern ssize_t pth_sc_sendto(int, const void *, size_t, int, const struct sockaddr *, socklen_t);
 #line 45 "../pth_ring.c"
 extern void pth_ring_init(pth_ring_t *);
@@ -746,21 +767,23 @@ extern double pth_time_t2d(pth_time_t *);
 extern int pth_time_t2i(pth_time_t *);
 #line 175 "../pth_time.c"
 extern int pth_time_pos(pth_time_t *);
-#line 103 "../pth_tcb.c"
+#line 104 "../pth_tcb.c"
 extern pth_t pth_tcb_alloc(unsigned int, void *);
-#line 137 "../pth_tcb.c"
+#line 138 "../pth_tcb.c"
 extern void pth_tcb_free(pth_t);
 #line 42 "../pth_util.c"
 extern int pth_util_sigdelete(int);
 #line 78 "../pth_util.c"
 extern char *pth_util_cpystrn(char *, const char *, size_t);
-#line 95 "../pth_util.c"
+#line 96 "../pth_util.c"
 extern int pth_util_fd_valid(int);
-#line 105 "../pth_util.c"
+#line 107 "../pth_util.c"
+extern int pth_util_fd_poll(int, int);
+#line 152 "../pth_util.c"
 extern void pth_util_fds_merge(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
-#line 127 "../pth_util.c"
+#line 174 "../pth_util.c"
 extern int pth_util_fds_test(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
-#line 153 "../pth_util.c"
+#line 200 "../pth_util.c"
 extern int pth_util_fds_select(int, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *, fd_set *);
 #line 42 "../pth_pqueue.c"
 extern void pth_pqueue_init(pth_pqueue_t *);
@@ -780,17 +803,23 @@ extern pth_t pth_pqueue_tail(pth_pqueue_t *);
 extern pth_t pth_pqueue_walk(pth_pqueue_t *, pth_t, int);
 #line 241 "../pth_pqueue.c"
 extern int pth_pqueue_contains(pth_pqueue_t *, pth_t);
-#line 51 "../pth_sched.c"
+#line 346 "../pth_sched.c"
+extern int pth_sched_iowait_park(pth_t);
+#line 381 "../pth_sched.c"
+extern void pth_sched_iowait_unpark(pth_t);
+#line 396 "../pth_sched.c"
+extern int pth_sched_iowait_contains(pth_t);
+#line 406 "../pth_sched.c"
 extern int pth_scheduler_init(void);
-#line 83 "../pth_sched.c"
+#line 444 "../pth_sched.c"
 extern void pth_scheduler_drop(void);
-#line 115 "../pth_sched.c"
+#line 486 "../pth_sched.c"
 extern void pth_scheduler_kill(void);
-#line 156 "../pth_sched.c"
+#line 534 "../pth_sched.c"
 extern void *pth_scheduler(void *);
-#line 383 "../pth_sched.c"
+#line 766 "../pth_sched.c"
 extern void pth_sched_eventmanager(pth_time_t *, int);
-#line 842 "../pth_sched.c"
+#line 1291 "../pth_sched.c"
 extern void pth_sched_eventmanager_sighandler(int);
 #line 95 "../pth_data.c"
 extern void pth_key_destroydata(pth_t);
@@ -798,17 +827,17 @@ extern void pth_key_destroydata(pth_t);
 extern void pth_mutex_releaseall(pth_t);
 #line 119 "../pth_attr.c"
 extern int pth_attr_ctrl(int, pth_attr_t, int, va_list);
-#line 367 "../pth_lib.c"
+#line 368 "../pth_lib.c"
 extern int pth_thread_exists(pth_t);
-#line 379 "../pth_lib.c"
+#line 381 "../pth_lib.c"
 extern void pth_thread_cleanup(pth_t);
-#line 955 "../pth_high.c"
+#line 1038 "../pth_high.c"
 extern ssize_t pth_readv_faked(int, const struct iovec *, int);
-#line 1138 "../pth_high.c"
+#line 1214 "../pth_high.c"
 extern ssize_t pth_writev_iov_bytes(const struct iovec *, int);
-#line 1153 "../pth_high.c"
+#line 1229 "../pth_high.c"
 extern void pth_writev_iov_advance(const struct iovec *, int, size_t, struct iovec **, int *, struct iovec *, int);
-#line 1191 "../pth_high.c"
+#line 1267 "../pth_high.c"
 extern ssize_t pth_writev_faked(int, const struct iovec *, int);
 #line 647 "../pth_string.c"
 extern int pth_vsnprintf(char *, size_t, const char *, va_list);
@@ -818,7 +847,7 @@ extern int pth_snprintf(char *, size_t, const char *, ...);
 extern char * pth_vasprintf(const char *, va_list);
 #line 693 "../pth_string.c"
 extern char * pth_asprintf(const char *, ...);
-#line 128 "../pth_p.h.in"
+#line 131 "../pth_p.h.in"
 END_DECLARATION
 
 #endif /* _PTH_P_H_ */
@@ -69,6 +69,11 @@ int pth_cancel(pth_t thread)
     /* now mark the thread as cancelled */
     thread->cancelreq = TRUE;
 
+    /* a thread parked in the fd index has to get back into the
+       waiting queue for the scheduler to notice the request */
+    if (thread->state == PTH_STATE_WAITING)
+        pth_sched_iowait_unpark(thread);
+
     /* when cancellation is enabled in async mode we cancel the thread immediately */
     if (   thread->cancelstate & PTH_CANCEL_ENABLE
         && thread->cancelstate & PTH_CANCEL_ASYNCHRONOUS) {
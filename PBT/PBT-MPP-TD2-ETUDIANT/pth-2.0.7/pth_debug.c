@@ -89,6 +89,7 @@ intern void pth_dumpstate(FILE *fp)
     fprintf(fp, "|   1. thread 0x%lx (\"%s\")\n",
             (unsigned long)pth_current, pth_current->name);
     pth_dumpqueue(fp, "WAITING", &pth_WQ);
+    fprintf(fp, "| Thread Queue WAITING (parked in fd index): %d threads\n", pth_iowait_num);
     pth_dumpqueue(fp, "SUSPENDED", &pth_SQ);
     pth_dumpqueue(fp, "DEAD", &pth_DQ);
     fprintf(fp, "+----------------------------------------------------------------------\n");
@@ -52,6 +52,10 @@ struct pth_event_st {
         struct { pth_t tid; }                                       TID;
         struct { pth_event_func_t func; void *arg; pth_time_t tv; } FUNC;
     } ev_args;
+    /* fd index of the epoll(7) backend, see pth_sched.c */
+    pth_t ev_fdtid;                    /* waiting thread while registered, else NULL */
+    struct pth_event_st *ev_fdnext;    /* other events registered for the same fd   */
+    struct pth_event_st *ev_fdprev;
 };
 
 #endif /* cpp */
@@ -113,6 +117,7 @@ pth_event_t pth_event(unsigned long spec, ...)
 
     /* initialize common ingredients */
     ev->ev_status = PTH_STATUS_PENDING;
+    ev->ev_fdtid  = NULL;
 
     /* initialize event specific ingredients */
     if (spec & PTH_EVENT_FD) {
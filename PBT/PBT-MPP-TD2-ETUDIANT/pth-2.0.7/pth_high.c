@@ -460,9 +460,107 @@ int pth_poll(struct pollfd *pfd, nfds_t nfd, int timeout)
     return pth_poll_ev(pfd, nfd, timeout, NULL);
 }
 
+#if !(PTH_FAKE_POLL)
+/* pth_poll_ev(3) for the epoll(7) backend of the scheduler: one
+   filedescriptor event per entry, the results come from poll(2) itself */
+static int pth_poll_fdwait(struct pollfd *pfd, nfds_t nfd, struct timeval *ptv, pth_event_t ev_extra)
+{
+    pth_event_t *evs;
+    pth_event_t ev_timeout;
+    unsigned int i;
+    unsigned int nev;
+    int woken;
+    int goal;
+    int n;
+
+    /* directly poll first to avoid unnecessary event handling
+       through the scheduler */
+    while ((n = pth_sc(poll)(pfd, nfd, 0)) < 0
+           && errno == EINTR) ;
+    if (n < 0)
+        return pth_error(-1, errno);
+    if (n > 0 || (ptv != NULL && ptv->tv_sec == 0 && ptv->tv_usec == 0))
+        return n;
+
+    /* create a ring with one filedescriptor event per
+       entry which waits for something, plus the timeout */
+    if ((evs = (pth_event_t *)malloc((nfd+1) * sizeof(pth_event_t))) == NULL)
+        return pth_error(-1, ENOMEM);
+    nev = 0;
+    for (i = 0; i < nfd; i++) {
+        goal = 0;
+        if (pfd[i].events & (POLLIN|POLLRDNORM))
+            goal |= PTH_UNTIL_FD_READABLE;
+        if (pfd[i].events & (POLLOUT|POLLWRNORM|POLLWRBAND))
+            goal |= PTH_UNTIL_FD_WRITEABLE;
+        if (pfd[i].events & (POLLPRI|POLLRDBAND))
+            goal |= PTH_UNTIL_FD_EXCEPTION;
+        if (pfd[i].fd < 0 || goal == 0)
+            continue;
+        if (nev == 0)
+            evs[nev] = pth_event(PTH_EVENT_FD|goal, pfd[i].fd);
+        else
+            evs[nev] = pth_event(PTH_EVENT_FD|goal|PTH_MODE_CHAIN, evs[0], pfd[i].fd);
+        if (evs[nev] == NULL)
+            break;
+        nev++;
+    }
+    ev_timeout = NULL;
+    if (i == nfd && nev > 0 && ptv != NULL) {
+        ev_timeout = pth_event(PTH_EVENT_TIME|PTH_MODE_CHAIN, evs[0],
+                               pth_timeout(ptv->tv_sec, ptv->tv_usec));
+        if (ev_timeout != NULL)
+            evs[nev++] = ev_timeout;
+    }
+    if (i < nfd || nev == 0 || (ptv != NULL && ev_timeout == NULL)) {
+        /* like the select(2) based variant, nothing to wait for is a timeout */
+        n = 0;
+        if (i < nfd || nev > 0)
+            n = pth_error(-1, errno);
+        while (nev > 0)
+            pth_event_free(evs[--nev], PTH_FREE_THIS);
+        free(evs);
+        return n;
+    }
+    if (ev_extra != NULL)
+        pth_event_concat(evs[0], ev_extra, NULL);
+
+    /* wait until poll(2) finds something or the timeout
+       or extra events occurred (another thread may have
+       consumed what woke us up, so wait again then) */
+    for (;;) {
+        pth_wait(evs[0]);
+        while ((n = pth_sc(poll)(pfd, nfd, 0)) < 0
+               && errno == EINTR) ;
+        if (n < 0) {
+            n = pth_error(-1, errno);
+            break;
+        }
+        if (n > 0)
+            break;
+        if (ev_timeout != NULL && pth_event_status(ev_timeout) == PTH_STATUS_OCCURRED)
+            break;
+        woken = FALSE;
+        for (i = 0; i < nev; i++)
+            if (evs[i] != ev_timeout && pth_event_status(evs[i]) != PTH_STATUS_PENDING)
+                woken = TRUE;
+        if (!woken) {
+            n = pth_error(-1, EINTR);
+            break;
+        }
+    }
+
+    /* removing our events one by one leaves the extra events intact */
+    for (i = 0; i < nev; i++)
+        pth_event_free(evs[i], PTH_FREE_THIS);
+    free(evs);
+    return n;
+}
+#endif
+
 /* Pth variant of poll(2) with extra events:
-   NOTICE: THIS HAS TO BE BASED ON pth_select(2) BECAUSE
-           INTERNALLY THE SCHEDULER IS ONLY select(2) BASED!! */
+   NOTICE: WITHOUT epoll(7) THIS HAS TO BE BASED ON pth_select(2)
+           BECAUSE THE SCHEDULER IS THEN ONLY select(2) BASED!! */
 int pth_poll_ev(struct pollfd *pfd, nfds_t nfd, int timeout, pth_event_t ev_extra)
 {
     fd_set rfds, wfds, efds, xfds;
@@ -477,8 +575,6 @@ int pth_poll_ev(struct pollfd *pfd, nfds_t nfd, int timeout, pth_event_t ev_extr
     /* argument sanity checks */
     if (pfd == NULL)
         return pth_error(-1, EFAULT);
-    if (nfd < 0 || nfd > FD_SETSIZE)
-        return pth_error(-1, EINVAL);
 
     /* convert timeout number into a timeval structure */
     ptv = &tv;
@@ -499,6 +595,14 @@ int pth_poll_ev(struct pollfd *pfd, nfds_t nfd, int timeout, pth_event_t ev_extr
     else
         return pth_error(-1, EINVAL);
 
+#if !(PTH_FAKE_POLL)
+    /* the epoll(7) backend needs no fd sets (and knows no FD_SETSIZE) */
+    if (pth_epfd != -1)
+        return pth_poll_fdwait(pfd, nfd, ptv, ev_extra);
+#endif
+    if (nfd < 0 || nfd > FD_SETSIZE)
+        return pth_error(-1, EINVAL);
+
     /* create fd sets and determine max fd */
     maxfd = -1;
     FD_ZERO(&rfds);
@@ -714,10 +818,8 @@ ssize_t pth_read(int fd, void *buf, size_t nbytes)
 /* Pth variant of read(2) with extra event(s) */
 ssize_t pth_read_ev(int fd, void *buf, size_t nbytes, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     int n;
 
@@ -740,12 +842,7 @@ ssize_t pth_read_ev(int fd, void *buf, size_t nbytes, pth_event_t ev_extra)
         /* now directly poll filedescriptor for readability
            to avoid unneccessary (and resource consuming because of context
            switches, etc) event handling through the scheduler */
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, &fds, NULL, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_READABLE);
         if (n < 0 && (errno == EINVAL || errno == EBADF))
             return pth_error(-1, errno);
 
@@ -785,10 +882,8 @@ ssize_t pth_write(int fd, const void *buf, size_t nbytes)
 /* Pth variant of write(2) with extra event(s) */
 ssize_t pth_write_ev(int fd, const void *buf, size_t nbytes, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     ssize_t rv;
     ssize_t s;
@@ -813,12 +908,7 @@ ssize_t pth_write_ev(int fd, const void *buf, size_t nbytes, pth_event_t ev_extr
         /* now directly poll filedescriptor for writeability
            to avoid unneccessary (and resource consuming because of context
            switches, etc) event handling through the scheduler */
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, NULL, &fds, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_WRITEABLE);
         if (n < 0 && (errno == EINVAL || errno == EBADF))
             return pth_error(-1, errno);
 
@@ -886,10 +976,8 @@ ssize_t pth_readv(int fd, const struct iovec *iov, int iovcnt)
 /* Pth variant of readv(2) with extra event(s) */
 ssize_t pth_readv_ev(int fd, const struct iovec *iov, int iovcnt, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     int n;
 
@@ -912,12 +1000,7 @@ ssize_t pth_readv_ev(int fd, const struct iovec *iov, int iovcnt, pth_event_t ev
         /* first directly poll filedescriptor for readability
            to avoid unneccessary (and resource consuming because of context
            switches, etc) event handling through the scheduler */
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, &fds, NULL, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_READABLE);
 
         /* if filedescriptor is still not readable,
            let thread sleep until it is or event occurs */
@@ -1004,10 +1087,8 @@ ssize_t pth_writev(int fd, const struct iovec *iov, int iovcnt)
 /* Pth variant of writev(2) with extra event(s) */
 ssize_t pth_writev_ev(int fd, const struct iovec *iov, int iovcnt, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     struct iovec *liov;
     int liovcnt;
@@ -1057,12 +1138,7 @@ ssize_t pth_writev_ev(int fd, const struct iovec *iov, int iovcnt, pth_event_t e
         /* first directly poll filedescriptor for writeability
            to avoid unneccessary (and resource consuming because of context
            switches, etc) event handling through the scheduler */
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, NULL, &fds, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_WRITEABLE);
 
         for (;;) {
             /* if filedescriptor is still not writeable,
@@ -1315,10 +1391,8 @@ ssize_t pth_recvfrom(int s, void *buf, size_t len, int flags, struct sockaddr *f
 /* Pth variant of SUSv2 recvfrom(2) with extra event(s) */
 ssize_t pth_recvfrom_ev(int fd, void *buf, size_t nbytes, int flags, struct sockaddr *from, socklen_t *fromlen, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     int n;
 
@@ -1343,12 +1417,7 @@ ssize_t pth_recvfrom_ev(int fd, void *buf, size_t nbytes, int flags, struct sock
            switches, etc) event handling through the scheduler */
         if (!pth_util_fd_valid(fd))
             return pth_error(-1, EBADF);
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, &fds, NULL, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_READABLE);
         if (n < 0 && (errno == EINVAL || errno == EBADF))
             return pth_error(-1, errno);
 
@@ -1400,10 +1469,8 @@ ssize_t pth_sendto(int s, const void *buf, size_t len, int flags, const struct s
 /* Pth variant of SUSv2 sendto(2) with extra event(s) */
 ssize_t pth_sendto_ev(int fd, const void *buf, size_t nbytes, int flags, const struct sockaddr *to, socklen_t tolen, pth_event_t ev_extra)
 {
-    struct timeval delay;
     pth_event_t ev;
     static pth_key_t ev_key = PTH_KEY_INIT;
-    fd_set fds;
     int fdmode;
     ssize_t rv;
     ssize_t s;
@@ -1432,12 +1499,7 @@ ssize_t pth_sendto_ev(int fd, const void *buf, size_t nbytes, int flags, const s
             pth_fdmode(fd, fdmode);
             return pth_error(-1, EBADF);
         }
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
-        delay.tv_sec  = 0;
-        delay.tv_usec = 0;
-        while ((n = pth_sc(select)(fd+1, NULL, &fds, NULL, &delay)) < 0
-               && errno == EINTR) ;
+        n = pth_util_fd_poll(fd, PTH_UNTIL_FD_WRITEABLE);
         if (n < 0 && (errno == EINVAL || errno == EBADF))
             return pth_error(-1, errno);
 
@@ -173,7 +173,7 @@ long pth_ctrl(unsigned long query, ...)
         if (query & PTH_CTRL_GETTHREADS_RUNNING)
             rc += 1; /* pth_current only */
         if (query & PTH_CTRL_GETTHREADS_WAITING)
-            rc += pth_pqueue_elements(&pth_WQ);
+            rc += pth_pqueue_elements(&pth_WQ) + pth_iowait_num;
         if (query & PTH_CTRL_GETTHREADS_SUSPENDED)
             rc += pth_pqueue_elements(&pth_SQ);
         if (query & PTH_CTRL_GETTHREADS_DEAD)
@@ -281,6 +281,7 @@ pth_t pth_spawn(pth_attr_t attr, void *(*func)(void *), void *arg)
 
     /* initialize events */
     t->events = NULL;
+    t->iowait = FALSE;
 
     /* clear raised signals */
     sigemptyset(&t->sigpending);
@@ -371,7 +372,8 @@ intern int pth_thread_exists(pth_t t)
             if (!pth_pqueue_contains(&pth_WQ, t))
                 if (!pth_pqueue_contains(&pth_SQ, t))
                     if (!pth_pqueue_contains(&pth_DQ, t))
-                        return pth_error(FALSE, ESRCH); /* not found */
+                        if (!pth_sched_iowait_contains(t))
+                            return pth_error(FALSE, ESRCH); /* not found */
     return TRUE;
 }
 
@@ -411,7 +413,7 @@ static int pth_exit_cb(void *arg)
     rc = 0;
     rc += pth_pqueue_elements(&pth_NQ);
     rc += pth_pqueue_elements(&pth_RQ);
-    rc += pth_pqueue_elements(&pth_WQ);
+    rc += pth_pqueue_elements(&pth_WQ) + pth_iowait_num;
     rc += pth_pqueue_elements(&pth_SQ);
 
     if (rc == 1 /* just our main thread */)
@@ -546,6 +548,8 @@ int pth_suspend(pth_t t)
     }
     if (q == NULL)
         return pth_error(FALSE, EPERM);
+    if (q == &pth_WQ)
+        pth_sched_iowait_unpark(t);
     if (!pth_pqueue_contains(q, t))
         return pth_error(FALSE, ESRCH);
     pth_pqueue_delete(q, t);
@@ -47,6 +47,361 @@ static sigset_t     pth_sigraised;  /* mask of raised signals                */
 static pth_time_t   pth_loadticknext;
 static pth_time_t   pth_loadtickgap = PTH_TIME(1,0);
 
+intern int          pth_epfd = -1;  /* epoll(7) instance, or -1 for select(2) */
+intern int          pth_iowait_num; /* threads parked in the fd index        */
+
+/*
+ * The epoll(7) event backend.
+ *
+ * Instead of assembling fd sets out of every waiting thread on each
+ * scheduler pass, a PTH_EVENT_FD event is registered once in an index
+ * from filedescriptors to the events waiting for them, and the kernel
+ * keeps the interest until it reports the filedescriptor. Registrations
+ * are one-shot: a report disarms the filedescriptor, so a stale one (the
+ * waiter went away or the filedescriptor was closed) costs at most one
+ * spurious wakeup.
+ *
+ * A thread waiting for filedescriptor events only is parked: it is kept
+ * in the index instead of the waiting queue and costs the scheduler
+ * nothing until one of its filedescriptors is reported. Threads waiting
+ * for other events, too, stay in the waiting queue but their
+ * filedescriptor events are still served by the index. PTH_EVENT_SELECT
+ * events, filedescriptors epoll(7) refuses and platforms without epoll(7)
+ * fall back to select(2).
+ */
+#if defined(HAVE_EPOLL_CREATE)
+
+#define PTH_EPOLL_BATCH 256
+
+struct pth_fdwait_st {
+    pth_event_t fw_events;          /* events registered for the filedescriptor */
+    int         fw_armed;           /* EPOLLIN/OUT/PRI armed in the kernel      */
+    int         fw_added;           /* whether it is in the epoll set at all    */
+};
+
+static struct pth_fdwait_st *pth_fdwait;      /* the fd index, indexed by fd      */
+static int pth_fdwait_size;                   /* number of slots in the fd index  */
+static int pth_fdwait_num;                    /* number of registered events      */
+static int pth_iowait_sigs[PTH_NSIG];         /* parked threads not blocking sig  */
+static struct epoll_event pth_epoll_ev[PTH_EPOLL_BATCH];
+
+/* create the epoll instance (which permanently watches the signal pipe) */
+static void pth_sched_epoll_open(void)
+{
+    struct epoll_event ee;
+
+    if ((pth_epfd = epoll_create(PTH_EPOLL_BATCH)) == -1)
+        return;
+    fcntl(pth_epfd, F_SETFD, FD_CLOEXEC);
+    memset(&ee, 0, sizeof(ee));
+    ee.events  = EPOLLIN;
+    ee.data.fd = pth_sigpipe[0];
+    if (epoll_ctl(pth_epfd, EPOLL_CTL_ADD, pth_sigpipe[0], &ee) == -1) {
+        close(pth_epfd);
+        pth_epfd = -1;
+    }
+    return;
+}
+
+/* (re)arm the kernel interest for a filedescriptor */
+static int pth_sched_fdwait_arm(int fd, int mask)
+{
+    struct pth_fdwait_st *fw;
+    struct epoll_event ee;
+    int rc;
+
+    fw = &pth_fdwait[fd];
+    memset(&ee, 0, sizeof(ee));
+    ee.events  = (unsigned int)mask | EPOLLONESHOT;
+    ee.data.fd = fd;
+    if (fw->fw_added) {
+        /* it vanished if it was closed and reopened meanwhile */
+        if ((rc = epoll_ctl(pth_epfd, EPOLL_CTL_MOD, fd, &ee)) == -1 && errno == ENOENT)
+            rc = epoll_ctl(pth_epfd, EPOLL_CTL_ADD, fd, &ee);
+    }
+    else {
+        if ((rc = epoll_ctl(pth_epfd, EPOLL_CTL_ADD, fd, &ee)) == -1 && errno == EEXIST)
+            rc = epoll_ctl(pth_epfd, EPOLL_CTL_MOD, fd, &ee);
+    }
+    if (rc == -1) {
+        fw->fw_added = FALSE;
+        fw->fw_armed = 0;
+        return FALSE;
+    }
+    fw->fw_added = TRUE;
+    fw->fw_armed = mask;
+    return TRUE;
+}
+
+/* register a pending filedescriptor event of a waiting thread */
+static int pth_sched_fdwait_add(pth_t t, pth_event_t ev)
+{
+    struct pth_fdwait_st *fw;
+    int fd;
+    int mask;
+    int n;
+
+    /* grow the index to cover the filedescriptor */
+    fd = ev->ev_args.FD.fd;
+    if (fd >= pth_fdwait_size) {
+        n = (pth_fdwait_size > 0 ? pth_fdwait_size : 64);
+        while (n <= fd)
+            n *= 2;
+        if ((fw = (struct pth_fdwait_st *)realloc(pth_fdwait, n * sizeof(struct pth_fdwait_st))) == NULL)
+            return pth_error(FALSE, ENOMEM);
+        memset(fw+pth_fdwait_size, 0, (n-pth_fdwait_size) * sizeof(struct pth_fdwait_st));
+        pth_fdwait = fw;
+        pth_fdwait_size = n;
+    }
+
+    /* arm the kernel only if it does not watch for this goal already */
+    mask = 0;
+    if (ev->ev_goal & PTH_UNTIL_FD_READABLE)
+        mask |= EPOLLIN;
+    if (ev->ev_goal & PTH_UNTIL_FD_WRITEABLE)
+        mask |= EPOLLOUT;
+    if (ev->ev_goal & PTH_UNTIL_FD_EXCEPTION)
+        mask |= EPOLLPRI;
+    fw = &pth_fdwait[fd];
+    if ((fw->fw_armed & mask) != mask)
+        if (!pth_sched_fdwait_arm(fd, fw->fw_armed|mask))
+            return FALSE;
+
+    ev->ev_fdtid  = t;
+    ev->ev_fdprev = NULL;
+    ev->ev_fdnext = fw->fw_events;
+    if (ev->ev_fdnext != NULL)
+        ev->ev_fdnext->ev_fdprev = ev;
+    fw->fw_events = ev;
+    pth_fdwait_num++;
+    return TRUE;
+}
+
+/* unregister a filedescriptor event */
+static void pth_sched_fdwait_remove(pth_event_t ev)
+{
+    if (ev->ev_fdprev != NULL)
+        ev->ev_fdprev->ev_fdnext = ev->ev_fdnext;
+    else
+        pth_fdwait[ev->ev_args.FD.fd].fw_events = ev->ev_fdnext;
+    if (ev->ev_fdnext != NULL)
+        ev->ev_fdnext->ev_fdprev = ev->ev_fdprev;
+    ev->ev_fdtid = NULL;
+    pth_fdwait_num--;
+    return;
+}
+
+/* unregister all events of a thread and unpark it */
+static void pth_sched_fdwait_forget(pth_t t)
+{
+    pth_event_t ev;
+    int sig;
+
+    if (t->events != NULL) {
+        ev = t->events;
+        do {
+            if (ev->ev_fdtid != NULL)
+                pth_sched_fdwait_remove(ev);
+        } while ((ev = ev->ev_next) != t->events);
+    }
+    if (t->iowait) {
+        for (sig = 1; sig < PTH_NSIG; sig++)
+            if (!sigismember(&(t->mctx.sigs), sig))
+                pth_iowait_sigs[sig]--;
+        t->iowait = FALSE;
+        pth_iowait_num--;
+    }
+    return;
+}
+
+/* hand the filedescriptors reported by epoll_wait(2) to their events */
+static void pth_sched_fdwait_dispatch(int n)
+{
+    struct pth_fdwait_st *fw;
+    pth_event_t ev;
+    pth_status_t status;
+    pth_t t;
+    int goal;
+    int mask;
+    int fd;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        fd = pth_epoll_ev[i].data.fd;
+        if (fd == pth_sigpipe[0] || fd >= pth_fdwait_size)
+            continue;
+        fw = &pth_fdwait[fd];
+        fw->fw_armed = 0;
+
+        /* like poll(2), errors and hangups wake up every waiter */
+        goal = 0;
+        if (pth_epoll_ev[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+            goal |= PTH_UNTIL_FD_READABLE;
+        if (pth_epoll_ev[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+            goal |= PTH_UNTIL_FD_WRITEABLE;
+        if (pth_epoll_ev[i].events & (EPOLLPRI|EPOLLERR|EPOLLHUP))
+            goal |= PTH_UNTIL_FD_EXCEPTION;
+        status = PTH_STATUS_OCCURRED;
+
+        for (;;) {
+            /* restart the scan after each hit: waking up a parked thread
+               also unregisters its other events on this filedescriptor */
+            ev = fw->fw_events;
+            while (ev != NULL) {
+                if (!(ev->ev_goal & goal)) {
+                    ev = ev->ev_fdnext;
+                    continue;
+                }
+                pth_debug2("pth_sched_eventmanager: "
+                           "[I/O] event occurred for thread \"%s\"", ev->ev_fdtid->name);
+                ev->ev_status = status;
+                t = ev->ev_fdtid;
+                if (t->iowait) {
+                    pth_sched_fdwait_forget(t);
+                    t->state = PTH_STATE_READY;
+                    pth_pqueue_insert(&pth_RQ, t->prio+1, t);
+                    pth_debug2("pth_sched_eventmanager: thread \"%s\" moved from fd index "
+                               "to ready queue", t->name);
+                }
+                else
+                    pth_sched_fdwait_remove(ev);
+                ev = fw->fw_events;
+            }
+
+            /* re-arm for the remaining waiters, or fail them */
+            if (fw->fw_events == NULL)
+                break;
+            mask = 0;
+            for (ev = fw->fw_events; ev != NULL; ev = ev->ev_fdnext) {
+                if (ev->ev_goal & PTH_UNTIL_FD_READABLE)
+                    mask |= EPOLLIN;
+                if (ev->ev_goal & PTH_UNTIL_FD_WRITEABLE)
+                    mask |= EPOLLOUT;
+                if (ev->ev_goal & PTH_UNTIL_FD_EXCEPTION)
+                    mask |= EPOLLPRI;
+            }
+            if (pth_sched_fdwait_arm(fd, mask))
+                break;
+            goal = PTH_UNTIL_FD_READABLE|PTH_UNTIL_FD_WRITEABLE|PTH_UNTIL_FD_EXCEPTION;
+            status = PTH_STATUS_FAILED;
+        }
+    }
+    return;
+}
+
+/* unpark and free all parked threads and start over with a fresh index */
+static void pth_sched_fdwait_drop(void)
+{
+    pth_event_t ev;
+    pth_t t;
+    int parked;
+    int fd;
+
+    for (fd = 0; fd < pth_fdwait_size; fd++) {
+        while ((ev = pth_fdwait[fd].fw_events) != NULL) {
+            t = ev->ev_fdtid;
+            parked = t->iowait;
+            pth_sched_fdwait_forget(t);
+            if (parked)
+                pth_tcb_free(t);
+        }
+    }
+    if (pth_fdwait != NULL)
+        free(pth_fdwait);
+    pth_fdwait = NULL;
+    pth_fdwait_size = 0;
+    pth_fdwait_num = 0;
+    return;
+}
+
+#endif /* HAVE_EPOLL_CREATE */
+
+/* decide how a pending filedescriptor event of a thread in the waiting
+   queue is watched: TRUE if by the fd index (or if it was decided right
+   away), FALSE if it has to go into the select(2) fd sets */
+static int pth_sched_fdwait_watch(pth_t t, pth_event_t ev)
+{
+#if defined(HAVE_EPOLL_CREATE)
+    if (ev->ev_fdtid != NULL)
+        return TRUE;
+    if (pth_epfd != -1) {
+        if (pth_sched_fdwait_add(t, ev))
+            return TRUE;
+        if (errno == EPERM) {
+            /* regular files and the like: always ready, as for select(2) */
+            ev->ev_status = PTH_STATUS_OCCURRED;
+            return TRUE;
+        }
+    }
+#endif
+    if (ev->ev_args.FD.fd >= FD_SETSIZE) {
+        ev->ev_status = PTH_STATUS_FAILED;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* park a thread which waits for filedescriptor events only in the fd
+   index instead of the waiting queue (FALSE if it cannot be parked) */
+intern int pth_sched_iowait_park(pth_t t)
+{
+#if defined(HAVE_EPOLL_CREATE)
+    pth_event_t ev;
+    int sig;
+
+    if (pth_epfd == -1 || t->events == NULL || t->cancelreq == TRUE)
+        return FALSE;
+    ev = t->events;
+    do {
+        if (ev->ev_type != PTH_EVENT_FD || ev->ev_status != PTH_STATUS_PENDING)
+            return FALSE;
+    } while ((ev = ev->ev_next) != t->events);
+    do {
+        if (!pth_sched_fdwait_add(t, ev)) {
+            pth_sched_fdwait_forget(t);
+            return FALSE;
+        }
+    } while ((ev = ev->ev_next) != t->events);
+
+    /* the scheduler unblocks signals any waiting thread accepts */
+    for (sig = 1; sig < PTH_NSIG; sig++)
+        if (!sigismember(&(t->mctx.sigs), sig))
+            pth_iowait_sigs[sig]++;
+    t->iowait = TRUE;
+    pth_iowait_num++;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+/* take the events of a waiting thread out of the fd index and put it back
+   into the waiting queue if it was parked (before suspending or
+   cancelling it) */
+intern void pth_sched_iowait_unpark(pth_t t)
+{
+#if defined(HAVE_EPOLL_CREATE)
+    int parked;
+
+    parked = t->iowait;
+    pth_sched_fdwait_forget(t);
+    if (parked)
+        pth_pqueue_insert(&pth_WQ, t->prio, t);
+#endif
+    return;
+}
+
+/* check whether a thread is parked in the fd index (the flag is set
+   by pth_sched_iowait_park and cleared whenever it is unparked) */
+intern int pth_sched_iowait_contains(pth_t t)
+{
+#if defined(HAVE_EPOLL_CREATE)
+    if (pth_iowait_num > 0)
+        return t->iowait;
+#endif
+    return FALSE;
+}
+
 /* initialize the scheduler ingredients */
 intern int pth_scheduler_init(void)
 {
@@ -58,6 +413,12 @@ intern int pth_scheduler_init(void)
     if (pth_fdmode(pth_sigpipe[1], PTH_FDMODE_NONBLOCK) == PTH_FDMODE_ERROR)
         return pth_error(FALSE, errno);
 
+#if defined(HAVE_EPOLL_CREATE)
+    /* wait through epoll(7) if possible, else select(2) is used */
+    pth_sched_epoll_open();
+#endif
+    pth_iowait_num = 0;
+
     /* initialize the essential threads */
     pth_sched   = NULL;
     pth_current = NULL;
@@ -84,6 +445,16 @@ intern void pth_scheduler_drop(void)
 {
     pth_t t;
 
+#if defined(HAVE_EPOLL_CREATE)
+    /* clear the fd index and get a fresh epoll instance
+       (a forked child must not share it with its parent) */
+    pth_sched_fdwait_drop();
+    if (pth_epfd != -1) {
+        close(pth_epfd);
+        pth_sched_epoll_open();
+    }
+#endif
+
     /* clear the new queue */
     while ((t = pth_pqueue_delmax(&pth_NQ)) != NULL)
         pth_tcb_free(t);
@@ -117,6 +488,13 @@ intern void pth_scheduler_kill(void)
     /* drop all threads */
     pth_scheduler_drop();
 
+#if defined(HAVE_EPOLL_CREATE)
+    /* remove the epoll instance */
+    if (pth_epfd != -1)
+        close(pth_epfd);
+    pth_epfd = -1;
+#endif
+
     /* remove the internal signal pipe */
     close(pth_sigpipe[0]);
     close(pth_sigpipe[1]);
@@ -343,9 +721,14 @@ intern void *pth_scheduler(void *dummy)
          * move it to waiting queue now
          */
         if (pth_current != NULL && pth_current->state == PTH_STATE_WAITING) {
-            pth_debug2("pth_scheduler: moving thread \"%s\" to waiting queue",
-                       pth_current->name);
-            pth_pqueue_insert(&pth_WQ, pth_current->prio, pth_current);
+            if (pth_sched_iowait_park(pth_current))
+                pth_debug2("pth_scheduler: parking thread \"%s\" in fd index",
+                           pth_current->name);
+            else {
+                pth_debug2("pth_scheduler: moving thread \"%s\" to waiting queue",
+                           pth_current->name);
+                pth_pqueue_insert(&pth_WQ, pth_current->prio, pth_current);
+            }
             pth_current = NULL;
         }
 
@@ -405,6 +788,8 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
     int rc;
     int sig;
     int n;
+    int woken;
+    int timeout;
 
     pth_debug2("pth_sched_eventmanager: enter in %s mode",
                dopoll ? "polling" : "waiting");
@@ -455,16 +840,23 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
 
                 /* Filedescriptor I/O */
                 if (ev->ev_type == PTH_EVENT_FD) {
-                    /* filedescriptors are checked later all at once.
-                       Here we only assemble them in the fd sets */
-                    if (ev->ev_goal & PTH_UNTIL_FD_READABLE)
-                        FD_SET(ev->ev_args.FD.fd, &rfds);
-                    if (ev->ev_goal & PTH_UNTIL_FD_WRITEABLE)
-                        FD_SET(ev->ev_args.FD.fd, &wfds);
-                    if (ev->ev_goal & PTH_UNTIL_FD_EXCEPTION)
-                        FD_SET(ev->ev_args.FD.fd, &efds);
-                    if (fdmax < ev->ev_args.FD.fd)
-                        fdmax = ev->ev_args.FD.fd;
+                    /* filedescriptors in the fd index are reported by
+                       epoll_wait(2), the others are checked later all at
+                       once. Here we only assemble them in the fd sets */
+                    if (pth_sched_fdwait_watch(t, ev)) {
+                        if (ev->ev_status != PTH_STATUS_PENDING)
+                            any_occurred = TRUE;
+                    }
+                    else {
+                        if (ev->ev_goal & PTH_UNTIL_FD_READABLE)
+                            FD_SET(ev->ev_args.FD.fd, &rfds);
+                        if (ev->ev_goal & PTH_UNTIL_FD_WRITEABLE)
+                            FD_SET(ev->ev_args.FD.fd, &wfds);
+                        if (ev->ev_goal & PTH_UNTIL_FD_EXCEPTION)
+                            FD_SET(ev->ev_args.FD.fd, &efds);
+                        if (fdmax < ev->ev_args.FD.fd)
+                            fdmax = ev->ev_args.FD.fd;
+                    }
                 }
                 /* Filedescriptor Set Select I/O */
                 else if (ev->ev_type == PTH_EVENT_SELECT) {
@@ -577,6 +969,14 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
     if (any_occurred)
         dopoll = TRUE;
 
+#if defined(HAVE_EPOLL_CREATE)
+    /* parked threads are not visited above, so determine
+       the signals they do not block from their summary */
+    for (sig = 1; sig < PTH_NSIG; sig++)
+        if (pth_iowait_sigs[sig] > 0)
+            sigdelset(&pth_sigblock, sig);
+#endif
+
     /* now decide how to poll for fd I/O and timers */
     if (dopoll) {
         /* do a polling with immediate timeout,
@@ -597,11 +997,23 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
         pdelay = NULL;
     }
 
-    /* clear pipe and let select() wait for the read-part of the pipe */
+    /* clear pipe and let select() wait for the read-part of the pipe.
+       Without fd sets to check we wait in epoll_wait(2) alone (the epoll
+       set watches the pipe), else select() also waits for the epoll
+       instance to become readable. */
     while (pth_sc(read)(pth_sigpipe[0], minibuf, sizeof(minibuf)) > 0) ;
-    FD_SET(pth_sigpipe[0], &rfds);
-    if (fdmax < pth_sigpipe[0])
-        fdmax = pth_sigpipe[0];
+#if defined(HAVE_EPOLL_CREATE)
+    if (pth_epfd != -1 && fdmax != -1) {
+        FD_SET(pth_epfd, &rfds);
+        if (fdmax < pth_epfd)
+            fdmax = pth_epfd;
+    }
+#endif
+    if (fdmax != -1 || pth_epfd == -1) {
+        FD_SET(pth_sigpipe[0], &rfds);
+        if (fdmax < pth_sigpipe[0])
+            fdmax = pth_sigpipe[0];
+    }
 
     /* replace signal actions for signals we've to catch for events */
     for (sig = 1; sig < PTH_NSIG; sig++) {
@@ -621,9 +1033,22 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
     /* now do the polling for filedescriptor I/O and timers
        WHEN THE SCHEDULER SLEEPS AT ALL, THEN HERE!! */
     rc = -1;
+#if defined(HAVE_EPOLL_CREATE)
+    if (fdmax == -1) {
+        if (pdelay == NULL)
+            timeout = -1;
+        else
+            timeout = (int)(pdelay->tv_sec*1000 + (pdelay->tv_usec+999)/1000);
+        if (!(dopoll && pth_fdwait_num == 0))
+            while ((rc = epoll_wait(pth_epfd, pth_epoll_ev, PTH_EPOLL_BATCH, timeout)) < 0
+                   && errno == EINTR) ;
+    }
+    else
+#endif
     if (!(dopoll && fdmax == -1))
         while ((rc = pth_sc(select)(fdmax+1, &rfds, &wfds, &efds, pdelay)) < 0
                && errno == EINTR) ;
+    woken = (rc > 0);
 
     /* restore signal mask and actions and handle signals */
     pth_sc(sigprocmask)(SIG_SETMASK, &oss, NULL);
@@ -652,6 +1077,22 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
         rc--;
     }
 
+#if defined(HAVE_EPOLL_CREATE)
+    /* hand out the filedescriptors reported through epoll(7) */
+    if (fdmax == -1 && rc > 0) {
+        pth_sched_fdwait_dispatch(rc);
+        rc = 0;
+    }
+    else if (fdmax != -1 && rc > 0 && FD_ISSET(pth_epfd, &rfds)) {
+        FD_CLR(pth_epfd, &rfds);
+        rc--;
+        while ((n = epoll_wait(pth_epfd, pth_epoll_ev, PTH_EPOLL_BATCH, 0)) < 0
+               && errno == EINTR) ;
+        if (n > 0)
+            pth_sched_fdwait_dispatch(n);
+    }
+#endif
+
     /* if an error occurred, avoid confusion in the cleanup loop */
     if (rc <= 0) {
         FD_ZERO(&rfds);
@@ -678,8 +1119,8 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
                  * Late handling for still not occured events
                  */
                 if (ev->ev_status == PTH_STATUS_PENDING) {
-                    /* Filedescriptor I/O */
-                    if (ev->ev_type == PTH_EVENT_FD) {
+                    /* Filedescriptor I/O (unless served by the fd index) */
+                    if (ev->ev_type == PTH_EVENT_FD && ev->ev_fdtid == NULL) {
                         if (   (   ev->ev_goal & PTH_UNTIL_FD_READABLE
                                 && FD_ISSET(ev->ev_args.FD.fd, &rfds))
                             || (   ev->ev_goal & PTH_UNTIL_FD_WRITEABLE
@@ -822,6 +1263,9 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
          */
         if (any_occurred) {
             pth_pqueue_delete(&pth_WQ, tlast);
+#if defined(HAVE_EPOLL_CREATE)
+            pth_sched_fdwait_forget(tlast);
+#endif
             tlast->state = PTH_STATE_READY;
             pth_pqueue_insert(&pth_RQ, tlast->prio+1, tlast);
             pth_debug2("pth_sched_eventmanager: thread \"%s\" moved from waiting "
@@ -829,6 +1273,11 @@ intern void pth_sched_eventmanager(pth_time_t *now, int dopoll)
         }
     }
 
+    /* a wakeup which readied nobody (a stale one-shot registration) must
+       not leave the scheduler without a thread to run */
+    if (!dopoll && woken && pth_pqueue_elements(&pth_RQ) == 0)
+        loop_repeat = TRUE;
+
     /* perhaps we have to internally loop... */
     if (loop_repeat) {
         pth_time_set(now, PTH_TIME_NOW);
@@ -516,8 +516,19 @@ int poll(struct pollfd *pfd, nfds_t nfd, int timeout)
     pth_implicit_init();
     return pth_poll(pfd, nfd, timeout);
 }
-/* NOTICE: internally fully emulated, so still no
-   internal exit point pth_sc_poll necessary! */
+intern int pth_sc_poll(struct pollfd *pfd, nfds_t nfd, int timeout)
+{
+    /* internal exit point for Pth */
+    if (pth_syscall_fct_tab[PTH_SCF_poll].addr != NULL)
+        return ((int (*)(struct pollfd *, nfds_t, int))
+               pth_syscall_fct_tab[PTH_SCF_poll].addr)
+               (pfd, nfd, timeout);
+#if defined(HAVE_SYSCALL) && defined(SYS_poll)
+    else return (int)syscall(SYS_poll, pfd, nfd, timeout);
+#else
+    else PTH_SYSCALL_ERROR(-1, ENOSYS, "poll");
+#endif
+}
 
 /* ==== Pth hard syscall wrapper for read(2) ==== */
 ssize_t read(int, void *, size_t);
@@ -50,6 +50,7 @@ struct pth_st {
 
     /* event handling */
     pth_event_t    events;               /* events the tread is waiting for             */
+    int            iowait;               /* parked in the fd index instead of the WQ    */
 
     /* per-thread signal handling */
     sigset_t       sigpending;           /* set    of pending signals                   */
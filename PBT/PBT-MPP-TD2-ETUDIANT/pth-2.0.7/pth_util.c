@@ -91,16 +91,63 @@ intern char *pth_util_cpystrn(char *dst, const char *src, size_t dst_size)
     return d;
 }
 
-/* check whether a file-descriptor is valid */
+/* check whether a file-descriptor is valid
+   (without epoll(7) the scheduler has to fit it into an fd_set) */
 intern int pth_util_fd_valid(int fd)
 {
-    if (fd < 0 || fd >= FD_SETSIZE)
+    if (fd < 0 || (fd >= FD_SETSIZE && pth_epfd == -1))
         return FALSE;
     if (fcntl(fd, F_GETFL) == -1 && errno == EBADF)
         return FALSE;
     return TRUE;
 }
 
+/* check a single file-descriptor for readiness without blocking,
+   like select(2) with a zero timeout but without the FD_SETSIZE limit */
+intern int pth_util_fd_poll(int fd, int goal)
+{
+#if !(PTH_FAKE_POLL)
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd      = fd;
+    pfd.events  = 0;
+    pfd.revents = 0;
+    if (goal & PTH_UNTIL_FD_READABLE)
+        pfd.events |= POLLIN;
+    if (goal & PTH_UNTIL_FD_WRITEABLE)
+        pfd.events |= POLLOUT;
+    if (goal & PTH_UNTIL_FD_EXCEPTION)
+        pfd.events |= POLLPRI;
+    while ((n = pth_sc(poll)(&pfd, 1, 0)) < 0
+           && errno == EINTR) ;
+    if (n > 0 && (pfd.revents & POLLNVAL))
+        return pth_error(-1, EBADF);
+    return n;
+#else
+    struct timeval delay;
+    fd_set rfds;
+    fd_set wfds;
+    fd_set efds;
+    int n;
+
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&efds);
+    if (goal & PTH_UNTIL_FD_READABLE)
+        FD_SET(fd, &rfds);
+    if (goal & PTH_UNTIL_FD_WRITEABLE)
+        FD_SET(fd, &wfds);
+    if (goal & PTH_UNTIL_FD_EXCEPTION)
+        FD_SET(fd, &efds);
+    delay.tv_sec  = 0;
+    delay.tv_usec = 0;
+    while ((n = pth_sc(select)(fd+1, &rfds, &wfds, &efds, &delay)) < 0
+           && errno == EINTR) ;
+    return n;
+#endif
+}
+
 /* merge input fd set into output fds */
 intern void pth_util_fds_merge(int nfd,
                                fd_set *ifds1, fd_set *ofds1,
@@ -0,0 +1,162 @@
+/*
+**  GNU Pth - The GNU Portable Threads
+**  Copyright (c) 1999-2006 Ralf S. Engelschall <rse@engelschall.com>
+**
+**  This file is part of GNU Pth, a non-preemptive thread scheduling
+**  library which can be found at http://www.gnu.org/software/pth/.
+**
+**  This library is free software; you can redistribute it and/or
+**  modify it under the terms of the GNU Lesser General Public
+**  License as published by the Free Software Foundation; either
+**  version 2.1 of the License, or (at your option) any later version.
+**
+**  This library is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+**  Lesser General Public License for more details.
+**
+**  You should have received a copy of the GNU Lesser General Public
+**  License along with this library; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+**  USA, or contact Ralf S. Engelschall <rse@engelschall.com>.
+**
+**  test_epoll.c: Pth test program (epoll backend)
+*/
+                             /* ``There are two ways of constructing a
+                                  software design. One way is to make it
+                                  so simple that there are obviously no
+                                  deficiencies.''
+                                                 -- C.A.R. Hoare  */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/resource.h>
+
+#include "pth.h"
+
+#define READERS 300
+#define FDBASE  1100   /* above FD_SETSIZE, out of reach of select(2) */
+
+static int fds[READERS][2];
+static char got[READERS];
+static int failed = 0;
+
+#define check(cond, msg) \
+    do { if (!(cond)) { fprintf(stderr, "FAILED: %s\n", msg); failed++; } } while (0)
+
+/* read one byte out of its pipe */
+static void *reader(void *_arg)
+{
+    long i = (long)_arg;
+    char c;
+
+    if (pth_read(fds[i][0], &c, 1) == 1)
+        got[i] = c;
+    return NULL;
+}
+
+/* block on a filedescriptor until it is readable (or hung up) */
+static void *blocker(void *_arg)
+{
+    char c;
+
+    pth_read((int)(long)_arg, &c, 1);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct rlimit rl;
+    struct pollfd pfd;
+    pth_t t[READERS];
+    pth_t tb;
+    void *rv;
+    char c;
+    long n;
+    int i;
+
+    /* make room for the high filedescriptors */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        exit(1);
+    if (rl.rlim_cur < FDBASE+2*READERS) {
+        if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < FDBASE+2*READERS) {
+            fprintf(stderr, "test_epoll: not enough filedescriptors, skipped\n");
+            exit(0);
+        }
+        rl.rlim_cur = FDBASE+2*READERS;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            exit(1);
+    }
+
+    pth_init();
+
+    fprintf(stderr, "This is TEST_EPOLL, a Pth test using many filedescriptors.\n");
+    fprintf(stderr, "\n");
+
+    for (i = 0; i < READERS; i++) {
+        if (pipe(fds[i]) == -1
+            || dup2(fds[i][0], FDBASE+2*i) == -1
+            || dup2(fds[i][1], FDBASE+2*i+1) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        close(fds[i][0]);
+        close(fds[i][1]);
+        fds[i][0] = FDBASE+2*i;
+        fds[i][1] = FDBASE+2*i+1;
+    }
+
+    /* many readers on filedescriptors above FD_SETSIZE */
+    fprintf(stderr, "spawning %d readers\n", READERS);
+    for (i = 0; i < READERS; i++)
+        t[i] = pth_spawn(PTH_ATTR_DEFAULT, reader, (void *)(long)i);
+    pth_nap(pth_time(0, 50000));
+    n = pth_ctrl(PTH_CTRL_GETTHREADS_WAITING);
+    check(n == READERS, "readers are not all waiting");
+    for (i = READERS-1; i >= 0; i--) {
+        c = 'a' + i % 26;
+        write(fds[i][1], &c, 1);
+    }
+    for (i = 0; i < READERS; i++)
+        pth_join(t[i], NULL);
+    for (i = 0; i < READERS; i++)
+        check(got[i] == 'a' + i % 26, "reader got a wrong byte");
+
+    /* pth_poll(3) timeout and readiness */
+    fprintf(stderr, "pth_poll timeout and readiness\n");
+    pfd.fd = fds[0][0];
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    check(pth_poll(&pfd, 1, 100) == 0, "pth_poll did not time out");
+    write(fds[0][1], "x", 1);
+    check(pth_poll(&pfd, 1, 1000) == 1 && (pfd.revents & POLLIN),
+          "pth_poll did not report readiness");
+
+    /* cancelling a thread parked in the fd index */
+    fprintf(stderr, "cancelling a waiting reader\n");
+    tb = pth_spawn(PTH_ATTR_DEFAULT, blocker, (void *)(long)fds[1][0]);
+    pth_nap(pth_time(0, 20000));
+    check(pth_cancel(tb), "pth_cancel failed");
+    rv = NULL;
+    pth_join(tb, &rv);
+    check(rv == PTH_CANCELED, "reader was not cancelled");
+
+    /* a hangup wakes up the reader */
+    fprintf(stderr, "hanging up a waiting reader\n");
+    tb = pth_spawn(PTH_ATTR_DEFAULT, blocker, (void *)(long)fds[2][0]);
+    pth_nap(pth_time(0, 20000));
+    close(fds[2][1]);
+    check(pth_join(tb, NULL), "reader did not wake up on hangup");
+
+    n = pth_ctrl(PTH_CTRL_GETTHREADS_WAITING);
+    check(n == 0, "threads are still waiting");
+
+    pth_kill();
+    if (failed > 0) {
+        fprintf(stderr, "\n%d check(s) failed\n", failed);
+        exit(1);
+    }
+    fprintf(stderr, "\nOK - all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Scheduler benchmark, built once per thread library: make bench, then
+   bench/run.sh for every library and number of VPs.  Each scenario runs
+   -r times, the median is printed as one CSV line:
+   impl,vps,scenario,ops,seconds,ops_per_sec,ns_per_op  */
+
+// mthread gets its VPs from MTHREAD_VP, which run.sh sets. The pthreads are
+// pinned on the first VPS CPUs. GNU Pth always runs on one.
+
+#if defined(BENCH_MTHREAD)
+#include "mthread.h"
+#define BENCH_IMPL "mthread"
+
+typedef mthread_t bench_thread_t;
+typedef mthread_mutex_t bench_mutex_t;
+typedef mthread_cond_t bench_cond_t;
+typedef mthread_sem_t bench_sem_t;
+
+static void *bench_nothing(void *arg)
+{
+  return arg;
+}
+
+static void bench_init(int vps)
+{
+  mthread_t th;
+
+  // Makes the main thread an mthread one
+  mthread_create(&th, NULL, bench_nothing, NULL);
+  mthread_join(th, NULL);
+}
+
+#define bench_create(th, fn, arg) mthread_create(th, NULL, fn, arg)
+#define bench_join(th) mthread_join(th, NULL)
+#define bench_yield() mthread_yield()
+#define bench_mutex_init(m) mthread_mutex_init(m, NULL)
+#define bench_mutex_lock(m) mthread_mutex_lock(m)
+#define bench_mutex_unlock(m) mthread_mutex_unlock(m)
+#define bench_mutex_destroy(m) mthread_mutex_destroy(m)
+#define bench_cond_init(c) mthread_cond_init(c, NULL)
+#define bench_cond_wait(c, m) mthread_cond_wait(c, m)
+#define bench_cond_signal(c) mthread_cond_signal(c)
+#define bench_cond_destroy(c) mthread_cond_destroy(c)
+#define bench_sem_wait(s) mthread_sem_wait(s)
+#define bench_sem_post(s) mthread_sem_post(s)
+
+// mthread semaphores start at their maximum
+static void bench_sem_init(bench_sem_t *s, unsigned int value, unsigned int max)
+{
+  mthread_sem_init(s, max);
+  while (max-- > value)
+    mthread_sem_trywait(s);
+}
+
+static void bench_sem_destroy(bench_sem_t *s)
+{
+  int value;
+  mthread_sem_getvalue(s, &value);
+  while (value++ < (int)s->max)
+    mthread_sem_post(s);
+  mthread_sem_destroy(s);
+}
+
+#elif defined(BENCH_PTHREAD)
+#include <pthread.h>
+#include <semaphore.h>
+#define BENCH_IMPL "pthread"
+
+typedef pthread_t bench_thread_t;
+typedef pthread_mutex_t bench_mutex_t;
+typedef pthread_cond_t bench_cond_t;
+typedef sem_t bench_sem_t;
+
+static void bench_init(int vps)
+{
+  cpu_set_t set;
+  long nb_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int i;
+
+  CPU_ZERO(&set);
+  for (i = 0; i < vps && i < nb_cpu; i++)
+    CPU_SET(i, &set);
+  sched_setaffinity(0, sizeof(set), &set);
+}
+
+#define bench_create(th, fn, arg) pthread_create(th, NULL, fn, arg)
+#define bench_join(th) pthread_join(th, NULL)
+#define bench_yield() sched_yield()
+#define bench_mutex_init(m) pthread_mutex_init(m, NULL)
+#define bench_mutex_lock(m) pthread_mutex_lock(m)
+#define bench_mutex_unlock(m) pthread_mutex_unlock(m)
+#define bench_mutex_destroy(m) pthread_mutex_destroy(m)
+#define bench_cond_init(c) pthread_cond_init(c, NULL)
+#define bench_cond_wait(c, m) pthread_cond_wait(c, m)
+#define bench_cond_signal(c) pthread_cond_signal(c)
+#define bench_cond_destroy(c) pthread_cond_destroy(c)
+#define bench_sem_init(s, value, max) sem_init(s, 0, value)
+#define bench_sem_wait(s) sem_wait(s)
+#define bench_sem_post(s) sem_post(s)
+#define bench_sem_destroy(s) sem_destroy(s)
+
+#elif defined(BENCH_PTH)
+#include <pth.h>
+#define BENCH_IMPL "pth"
+
+typedef pth_t bench_thread_t;
+typedef pth_mutex_t bench_mutex_t;
+typedef pth_cond_t bench_cond_t;
+
+static void bench_init(int vps)
+{
+  pth_init();
+}
+
+#define bench_create(th, fn, arg) (*(th) = pth_spawn(PTH_ATTR_DEFAULT, fn, arg))
+#define bench_join(th) pth_join(th, NULL)
+#define bench_yield() pth_yield(NULL)
+#define bench_mutex_init(m) pth_mutex_init(m)
+#define bench_mutex_lock(m) pth_mutex_acquire(m, FALSE, NULL)
+#define bench_mutex_unlock(m) pth_mutex_release(m)
+#define bench_mutex_destroy(m)
+#define bench_cond_init(c) pth_cond_init(c)
+#define bench_cond_wait(c, m) pth_cond_await(c, m, NULL)
+#define bench_cond_signal(c) pth_cond_notify(c, FALSE)
+#define bench_cond_destroy(c)
+
+// Pth has no semaphores: a counter under a mutex
+typedef struct
+{
+  pth_mutex_t lock;
+  pth_cond_t cond;
+  unsigned int value;
+} bench_sem_t;
+
+static void bench_sem_init(bench_sem_t *s, unsigned int value, unsigned int max)
+{
+  pth_mutex_init(&s->lock);
+  pth_cond_init(&s->cond);
+  s->value = value;
+}
+
+static void bench_sem_wait(bench_sem_t *s)
+{
+  pth_mutex_acquire(&s->lock, FALSE, NULL);
+  while (s->value == 0)
+    pth_cond_await(&s->cond, &s->lock, NULL);
+  s->value--;
+  pth_mutex_release(&s->lock);
+}
+
+static void bench_sem_post(bench_sem_t *s)
+{
+  pth_mutex_acquire(&s->lock, FALSE, NULL);
+  s->value++;
+  pth_cond_notify(&s->cond, FALSE);
+  pth_mutex_release(&s->lock);
+}
+
+#define bench_sem_destroy(s)
+
+#else
+#error "Build with one of BENCH_MTHREAD, BENCH_PTHREAD or BENCH_PTH"
+#endif
+
+#define BENCH_BATCH 32     /* threads alive at once in create_join */
+#define BENCH_FANOUT 64    /* children per round in fork_join */
+#define BENCH_CONTENDERS 4 /* threads in mutex_contended */
+#define BENCH_SLOTS 16     /* buffer of sem_prodcons */
+#define BENCH_MAX_REPEAT 64
+
+/* Scenarios: run about N operations, return how many were done.  */
+
+static void *bench_empty(void *arg)
+{
+  return arg;
+}
+
+static long bench_create_join(long n)
+{
+  bench_thread_t th[BENCH_BATCH];
+  long done;
+  int i;
+
+  for (done = 0; done + BENCH_BATCH <= n; done += BENCH_BATCH)
+  {
+    for (i = 0; i < BENCH_BATCH; i++)
+      bench_create(&th[i], bench_empty, NULL);
+    for (i = 0; i < BENCH_BATCH; i++)
+      bench_join(th[i]);
+  }
+  return done;
+}
+
+static volatile int turn;
+static long rounds;
+
+static void *bench_yield_player(void *arg)
+{
+  const int me = (int)(long)arg;
+  long i;
+
+  for (i = 0; i < rounds; i++)
+  {
+    while (turn != me)
+      bench_yield();
+    turn = 1 - me;
+  }
+  return NULL;
+}
+
+static long bench_yield_pingpong(long n)
+{
+  bench_thread_t th[2];
+
+  turn = 0;
+  rounds = n;
+  bench_create(&th[0], bench_yield_player, (void *)0L);
+  bench_create(&th[1], bench_yield_player, (void *)1L);
+  bench_join(th[0]);
+  bench_join(th[1]);
+  return n;
+}
+
+static bench_mutex_t mutex;
+static bench_cond_t cond;
+static volatile long counter;
+
+static long bench_mutex_uncontended(long n)
+{
+  long i;
+
+  bench_mutex_init(&mutex);
+  for (i = 0; i < n; i++)
+  {
+    bench_mutex_lock(&mutex);
+    counter++;
+    bench_mutex_unlock(&mutex);
+  }
+  bench_mutex_destroy(&mutex);
+  return n;
+}
+
+static void *bench_contender(void *arg)
+{
+  long i;
+
+  for (i = 0; i < rounds; i++)
+  {
+    bench_mutex_lock(&mutex);
+    counter++;
+    bench_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+static long bench_mutex_contended(long n)
+{
+  bench_thread_t th[BENCH_CONTENDERS];
+  int i;
+
+  bench_mutex_init(&mutex);
+  rounds = n / BENCH_CONTENDERS;
+  for (i = 0; i < BENCH_CONTENDERS; i++)
+    bench_create(&th[i], bench_contender, NULL);
+  for (i = 0; i < BENCH_CONTENDERS; i++)
+    bench_join(th[i]);
+  bench_mutex_destroy(&mutex);
+  return rounds * BENCH_CONTENDERS;
+}
+
+static void *bench_cond_player(void *arg)
+{
+  const int me = (int)(long)arg;
+  long i;
+
+  for (i = 0; i < rounds; i++)
+  {
+    bench_mutex_lock(&mutex);
+    while (turn != me)
+      bench_cond_wait(&cond, &mutex);
+    turn = 1 - me;
+    bench_cond_signal(&cond);
+    bench_mutex_unlock(&mutex);
+  }
+  return NULL;
+}
+
+static long bench_cond_pingpong(long n)
+{
+  bench_thread_t th[2];
+
+  bench_mutex_init(&mutex);
+  bench_cond_init(&cond);
+  turn = 0;
+  rounds = n;
+  bench_create(&th[0], bench_cond_player, (void *)0L);
+  bench_create(&th[1], bench_cond_player, (void *)1L);
+  bench_join(th[0]);
+  bench_join(th[1]);
+  bench_cond_destroy(&cond);
+  bench_mutex_destroy(&mutex);
+  return n;
+}
+
+static bench_sem_t empty;
+static bench_sem_t full;
+static long slots[BENCH_SLOTS];
+
+static void *bench_producer(void *arg)
+{
+  long i;
+
+  for (i = 0; i < rounds; i++)
+  {
+    bench_sem_wait(&empty);
+    slots[i % BENCH_SLOTS] = i;
+    bench_sem_post(&full);
+  }
+  return NULL;
+}
+
+static void *bench_consumer(void *arg)
+{
+  long i;
+
+  for (i = 0; i < rounds; i++)
+  {
+    bench_sem_wait(&full);
+    counter += slots[i % BENCH_SLOTS];
+    bench_sem_post(&empty);
+  }
+  return NULL;
+}
+
+static long bench_sem_prodcons(long n)
+{
+  bench_thread_t th[2];
+
+  bench_sem_init(&empty, BENCH_SLOTS, BENCH_SLOTS);
+  bench_sem_init(&full, 0, BENCH_SLOTS);
+  rounds = n;
+  bench_create(&th[0], bench_producer, NULL);
+  bench_create(&th[1], bench_consumer, NULL);
+  bench_join(th[0]);
+  bench_join(th[1]);
+  bench_sem_destroy(&full);
+  bench_sem_destroy(&empty);
+  return n;
+}
+
+static void *bench_child(void *arg)
+{
+  volatile long sum = 0;
+  long i;
+
+  for (i = 0; i < 1000; i++)
+    sum += i;
+  return NULL;
+}
+
+static long bench_fork_join(long n)
+{
+  bench_thread_t th[BENCH_FANOUT];
+  long done;
+  int i;
+
+  for (done = 0; done + BENCH_FANOUT <= n; done += BENCH_FANOUT)
+  {
+    for (i = 0; i < BENCH_FANOUT; i++)
+      bench_create(&th[i], bench_child, NULL);
+    for (i = 0; i < BENCH_FANOUT; i++)
+      bench_join(th[i]);
+  }
+  return done;
+}
+
+typedef struct
+{
+  const char *name;
+  long (*run)(long n);
+  long n; /* operations at scale 1 */
+} bench_scenario_t;
+
+static const bench_scenario_t scenarios[] = {
+    {"create_join", bench_create_join, 64 * 1024},
+    {"yield_pingpong", bench_yield_pingpong, 256 * 1024},
+    {"mutex_uncontended", bench_mutex_uncontended, 4 * 1024 * 1024},
+    {"mutex_contended", bench_mutex_contended, 1024 * 1024},
+    {"cond_pingpong", bench_cond_pingpong, 128 * 1024},
+    {"sem_prodcons", bench_sem_prodcons, 256 * 1024},
+    {"fork_join", bench_fork_join, 64 * 1024},
+};
+
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void bench_usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-v VPS] [-s SCALE] [-r REPEAT] [-o SCENARIO] [-H]\n", prog);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  double seconds[BENCH_MAX_REPEAT];
+  const char *only = NULL;
+  double scale = 1;
+  int repeat = 3;
+  int header = 0;
+  int vps = 1;
+  unsigned int s;
+  int opt;
+  int r;
+
+  while ((opt = getopt(argc, argv, "v:s:r:o:H")) != -1)
+  {
+    switch (opt)
+    {
+    case 'v':
+      vps = atoi(optarg);
+      break;
+    case 's':
+      scale = atof(optarg);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      break;
+    case 'o':
+      only = optarg;
+      break;
+    case 'H':
+      header = 1;
+      break;
+    default:
+      bench_usage(argv[0]);
+    }
+  }
+  if (vps < 1 || scale <= 0 || repeat < 1 || repeat > BENCH_MAX_REPEAT)
+    bench_usage(argv[0]);
+
+  bench_init(vps);
+  if (header)
+    printf("impl,vps,scenario,ops,seconds,ops_per_sec,ns_per_op\n");
+
+  for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++)
+  {
+    const bench_scenario_t *sc = &scenarios[s];
+    long n = (long)(sc->n * scale);
+    long ops = 0;
+    double median;
+
+    if (only != NULL && strcmp(only, sc->name) != 0)
+      continue;
+
+    for (r = 0; r < repeat; r++)
+    {
+      double start = bench_now();
+      ops = sc->run(n);
+      seconds[r] = bench_now() - start;
+    }
+    qsort(seconds, repeat, sizeof(double), bench_compare);
+    median = seconds[repeat / 2];
+
+    printf("%s,%d,%s,%ld,%.6f,%.0f,%.1f\n", BENCH_IMPL, vps, sc->name, ops, median,
+           ops / median, median * 1e9 / ops);
+    fflush(stdout);
+  }
+
+  return 0;
+}
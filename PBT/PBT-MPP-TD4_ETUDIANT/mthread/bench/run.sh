@@ -0,0 +1,18 @@
+#!/bin/sh
+# Run the scheduler benchmark against mthread, pthreads and GNU Pth, with
+# 1 to MAX_VP virtual processors (Pth only has one), CSV on stdout.
+# usage: bench/run.sh [MAX_VP] [SCALE] [REPEAT], after make bench
+
+cd "$(dirname "$0")" || exit 1
+MAX_VP=${1:-4}
+SCALE=${2:-1}
+REPEAT=${3:-3}
+
+echo "impl,vps,scenario,ops,seconds,ops_per_sec,ns_per_op"
+for vp in $(seq 1 "$MAX_VP"); do
+	MTHREAD_VP=$vp ./bench_mthread.out -v "$vp" -s "$SCALE" -r "$REPEAT"
+	./bench_pthread.out -v "$vp" -s "$SCALE" -r "$REPEAT"
+done
+if [ -x ./bench_pth.out ]; then
+	./bench_pth.out -v 1 -s "$SCALE" -r "$REPEAT"
+fi
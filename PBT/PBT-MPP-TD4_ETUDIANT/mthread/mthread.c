@@ -1,5 +1,9 @@
 #include "mthread_internal.h"
+#include <errno.h>
+#include <limits.h>
 #include <sched.h>
+#include <string.h>
+#include <time.h>
 
 #define TWO_LEVEL
 
@@ -13,11 +17,15 @@
 #define MTHREAD_LWP 1
 #endif
 
-#define MTHREAD_DEFAULT_STACK 128 * 1024 /*128 kO*/
 #define MTHREAD_MAX_VIRUTAL_PROCESSORS 256
 
 static mthread_virtual_processor_t virtual_processors[MTHREAD_MAX_VIRUTAL_PROCESSORS];
-static mthread_list_t joined_list;
+// Added: LWPs are started on demand, see mthread_lwp_demand
+static volatile int nb_lwp = 1;
+// Added: at most MTHREAD_LWP of them, or MTHREAD_VP from the environment
+static int max_lwp = MTHREAD_LWP;
+static void mthread_lwp_demand(mthread_virtual_processor_t *vp);
+static void mthread_lwp_ensure(int rank);
 
 static inline void mthread_list_init(mthread_list_t *list)
 {
@@ -30,6 +38,20 @@ static inline void mthread_init_thread(struct mthread_s *thread)
   thread->next = NULL;
   thread->status = RUNNING;
   thread->res = NULL;
+  thread->detached = MTHREAD_JOINABLE;
+  thread->not_migrable = 0;
+  thread->shared_stack = 0;
+  thread->lockprof_nheld = 0;
+  thread->wait_guard = 0;
+  thread->wait_lock = NULL;
+  thread->cancel_pending = 0;
+  thread->cancel_state = MTHREAD_CANCEL_ENABLE;
+  thread->deadline = 0;
+  thread->wait_deadline = 0;
+  thread->timer_index = MTHREAD_TIMER_NONE;
+  thread->cleanup = NULL;
+  thread->replay_id = 0;
+  thread->replay_runs = 0;
 }
 
 void mthread_insert_first(struct mthread_s *item, mthread_list_t *list)
@@ -46,6 +68,7 @@ void mthread_insert_first(struct mthread_s *item, mthread_list_t *list)
     item->next = list->first;
     list->first = item;
   }
+  list->count++;
   mthread_spinlock_unlock(&(list->lock));
 }
 
@@ -64,9 +87,42 @@ void mthread_insert_last(struct mthread_s *item, mthread_list_t *list)
     list->last->next = item;
     list->last = item;
   }
+  list->count++;
   mthread_spinlock_unlock(&(list->lock));
 }
 
+// Added: remove ITEM wherever it is in LIST, return 1 if it was found
+int mthread_remove(struct mthread_s *item, mthread_list_t *list)
+{
+  volatile struct mthread_s *prev = NULL;
+  volatile struct mthread_s *cur;
+  int found = 0;
+  mthread_spinlock_lock(&(list->lock));
+  for (cur = list->first; cur != NULL; prev = cur, cur = cur->next)
+  {
+    if (cur == item)
+    {
+      if (prev == NULL)
+      {
+        list->first = cur->next;
+      }
+      else
+      {
+        prev->next = cur->next;
+      }
+      if (list->last == cur)
+      {
+        list->last = prev;
+      }
+      list->count--;
+      found = 1;
+      break;
+    }
+  }
+  mthread_spinlock_unlock(&(list->lock));
+  return found;
+}
+
 struct mthread_s *mthread_remove_first(mthread_list_t *list)
 {
   struct mthread_s *res = NULL;
@@ -79,6 +135,7 @@ struct mthread_s *mthread_remove_first(mthread_list_t *list)
     {
       list->last = NULL;
     }
+    list->count--;
   }
   mthread_spinlock_unlock(&(list->lock));
   return res;
@@ -116,50 +173,97 @@ mthread_mctx_swap(struct mthread_s *cur_mctx, struct mthread_s *new_mctx)
   return 0;
 }
 
+// Added: the first level of scheduler domain VP and VICTIM share
+static inline int mthread_domain_level(mthread_virtual_processor_t *vp, mthread_virtual_processor_t *victim)
+{
+  int level;
+  for (level = 0; level < MTHREAD_DOMAIN_MACHINE; level++)
+  {
+    if (vp->domain[level] >= 0 && vp->domain[level] == victim->domain[level])
+    {
+      return level;
+    }
+  }
+  return MTHREAD_DOMAIN_MACHINE;
+}
+
 static struct mthread_s *mthread_work_take(mthread_virtual_processor_t *vp)
 {
   int i;
+  int level;
+  int threshold;
+  mthread_virtual_processor_t *victim;
   struct mthread_s *tmp = NULL;
-  for (i = 0; i < MTHREAD_LWP; i++)
+  // Added: a replayed VP only takes the threads its log names
+  if (mthread_replay_mode == MTHREAD_REPLAY_REPLAYING && __mthread_replay_following(vp))
+  {
+    sched_yield();
+    return NULL;
+  }
+  // Added: the closest domains first, the farther ones once they failed
+  for (level = vp->steal_first; level <= vp->steal_level; level++)
   {
-    tmp = NULL;
-    if (vp != &(virtual_processors[i]))
+    // Added: no closer VP to leave a light imbalance to when the VP only
+    // knows the machine
+    threshold = vp->steal_first == MTHREAD_DOMAIN_MACHINE ? 1 : mthread_domain_threshold[level];
+    for (i = 0; i < nb_lwp; i++)
     {
-      if (virtual_processors[i].ready_list.first != NULL)
+      tmp = NULL;
+      victim = &(virtual_processors[i]);
+      if (vp != victim && victim->ready_list.count >= threshold &&
+          mthread_domain_level(vp, victim) == level)
       {
-        tmp = mthread_remove_first(&(virtual_processors[i].ready_list));
+        tmp = mthread_remove_first(&(victim->ready_list));
+        // Added: put back the threads bound to their VP
+        if (tmp != NULL && tmp->not_migrable)
+        {
+          mthread_insert_first(tmp, &(victim->ready_list));
+          tmp = NULL;
+        }
+      }
+      if (tmp != NULL)
+      {
+        MTHREAD_STAT_INC(vp, steals);
+        if (victim->node != vp->node)
+        {
+          MTHREAD_STAT_INC(vp, remote_steals);
+        }
+        if (mthread_replay_mode == MTHREAD_REPLAY_RECORDING)
+        {
+          __mthread_replay_steal(vp, tmp, i);
+        }
+        mthread_log("LOAD BALANCE", "Work %p from %d to %d (level %d)\n", tmp, i, vp->rank, level);
+        vp->steal_level = vp->steal_first;
+        vp->steal_failures = 0;
+        return tmp;
       }
     }
-    if (tmp != NULL)
-    {
-      mthread_log("LOAD BALANCE", "Work %p from %d to %d\n", tmp, i, vp->rank);
-      return tmp;
-    }
+  }
+  MTHREAD_STAT_INC(vp, failed_steals);
+  if (vp->steal_level < MTHREAD_DOMAIN_MACHINE && ++vp->steal_failures >= mthread_domain_escalate)
+  {
+    vp->steal_level++;
+    vp->steal_failures = 0;
   }
   sched_yield();
   return tmp;
 }
 
-void __mthread_yield(mthread_virtual_processor_t *vp)
+/* Switch from the current thread of VP to NEXT, NULL meaning the idle task.
+   NEXT must already be out of every ready list. */
+static void __mthread_switch(mthread_virtual_processor_t *vp, struct mthread_s *next)
 {
-  struct mthread_s *next;
   struct mthread_s *current;
 
   current = (struct mthread_s *)vp->current;
-  next = mthread_remove_first(&(vp->ready_list));
-  mthread_log("THREAD YIELD", "Yielding current %p to next %p\n", current, next);
-
-#ifdef TWO_LEVEL
-  if (next == NULL)
-  {
-    next = mthread_work_take(vp);
-  }
-#endif
 
   if (vp->resched != NULL)
   {
-    mthread_log("SCHEDULER", "Insert %p in ready list of %d\n", vp->resched, vp->rank);
-    mthread_insert_last((struct mthread_s *)vp->resched, &(vp->ready_list));
+    // Added: a thread bound to another VP while it waited here goes there
+    struct mthread_s *resched = (struct mthread_s *)vp->resched;
+    mthread_virtual_processor_t *home = resched->not_migrable ? resched->vp : vp;
+    mthread_log("SCHEDULER", "Insert %p in ready list of %d\n", resched, home->rank);
+    mthread_insert_last(resched, &(home->ready_list));
     vp->resched = NULL;
   }
 
@@ -167,7 +271,12 @@ void __mthread_yield(mthread_virtual_processor_t *vp)
   {
     if ((current->status != BLOCKED) && (current->status != ZOMBIE))
     {
-      if (current->status == RUNNING)
+      if (current->status == RUNNING && current->not_migrable && current->vp != vp)
+      {
+        // Added: migrated while running, queued there once switched out
+        vp->migrant = current;
+      }
+      else if (current->status == RUNNING)
       {
         vp->resched = current;
       }
@@ -183,69 +292,254 @@ void __mthread_yield(mthread_virtual_processor_t *vp)
     }
   }
 
+  // Added: logged, or taken from the log, see mthread_replay.c
+  if (mthread_replay_mode != MTHREAD_REPLAY_OFF)
+  {
+    next = __mthread_replay_switch(vp, current, next);
+  }
+
   if (next != NULL)
   { /* always true at this point - except for idle thread */
     if (vp->current != next)
     {
       mthread_log("SCHEDULER", "Swap from %p to %p\n", current, next);
+      MTHREAD_STAT_INC(vp, switches);
       vp->current = next;
-      mthread_mctx_swap(current, next);
+      // Added: the frames of a shared stack thread may have to be copied back
+      if (next->shared_stack && vp->shared_owner != next)
+      {
+        __mthread_shared_swap(vp, current, next);
+      }
+      else
+      {
+        mthread_mctx_swap(current, next);
+      }
     }
   }
 
-  vp = mthread_get_vp();
+  __mthread_post_switch(mthread_get_vp());
+}
 
+/* Work left by the previous context of VP, done once it is switched out. */
+void __mthread_post_switch(mthread_virtual_processor_t *vp)
+{
   if (vp->p != NULL)
   {
     mthread_spinlock_unlock(vp->p);
     vp->p = NULL;
   }
+
+  if (vp->migrant != NULL)
+  {
+    struct mthread_s *migrant = (struct mthread_s *)vp->migrant;
+    vp->migrant = NULL;
+    mthread_insert_last(migrant, &(migrant->vp->ready_list));
+  }
+
+  // Added: the exiting thread is now off its stack, it can be joined or reused
+  if (vp->zombie != NULL)
+  {
+    struct mthread_s *zombie = (struct mthread_s *)vp->zombie;
+    vp->zombie = NULL;
+    // Races with mthread_detach: whoever sees the other's mark frees it
+    if (!__sync_bool_compare_and_swap(&zombie->detached, MTHREAD_JOINABLE, MTHREAD_EXITED))
+    {
+      mthread_tcb_free(vp, zombie);
+    }
+    else
+    {
+      zombie->status = ZOMBIE;
+    }
+  }
+
+  // Added: interrupt the waits that reached their deadline
+  if (mthread_timer_next != ULONG_MAX)
+  {
+    __mthread_timer_poll();
+  }
+
+  // Added: the memory of a thread may follow it to another NUMA node, moved
+  // by the thread itself once the lock left above is released
+  if (mthread_numa_migrate && vp->current->mem_node >= 0)
+  {
+    __mthread_numa_settle(vp, (struct mthread_s *)vp->current);
+  }
 }
 
-static void mthread_idle_task(void *arg)
+void __mthread_yield(mthread_virtual_processor_t *vp)
 {
-  mthread_virtual_processor_t *vp;
-  long j;
-  int done = 0;
-  vp = (mthread_virtual_processor_t *)arg;
+  struct mthread_s *next;
 
-  vp->state = 1;
-  while (done == 0)
+  next = mthread_remove_first(&(vp->ready_list));
+  mthread_log("THREAD YIELD", "Yielding current %p to next %p\n", vp->current, next);
+
+#ifdef TWO_LEVEL
+  if (next == NULL)
   {
-    done = 1;
-    sched_yield();
-    for (j = 0; j < MTHREAD_LWP; j++)
+    next = mthread_work_take(vp);
+  }
+#endif
+
+  __mthread_switch(vp, next);
+}
+
+/* Switch directly to TARGET if it is waiting in a ready list, otherwise
+   (running elsewhere, blocked or ended) behave as __mthread_yield. */
+void __mthread_yield_to(mthread_virtual_processor_t *vp, struct mthread_s *target)
+{
+  int found = 0;
+  int i;
+
+  if (target == vp->current)
+    return;
+
+  // The previous thread of a ping-pong has not reached the ready list yet
+  if (vp->resched == target)
+  {
+    vp->resched = NULL;
+    found = 1;
+  }
+
+  if (!found)
+  {
+    found = mthread_remove(target, &(vp->ready_list));
+  }
+
+#ifdef TWO_LEVEL
+  for (i = 0; i < nb_lwp && !found; i++)
+  {
+    if (vp != &(virtual_processors[i]) && !target->not_migrable)
     {
-      if (virtual_processors[j].state == 0)
-      {
-        done = 0;
-      }
+      found = mthread_remove(target, &(virtual_processors[i].ready_list));
     }
   }
+#endif
+
+  if (!found)
+  {
+    mthread_log("THREAD YIELD", "Target %p not ready, plain yield\n", target);
+    __mthread_yield(vp);
+    return;
+  }
+
+  mthread_log("THREAD YIELD", "Yielding current %p to target %p\n", vp->current, target);
+  __mthread_switch(vp, target);
+}
+
+/* Make TH runnable again on the current virtual processor, or on its own
+   if it is not migrable. The caller must own the lock of the queue TH was
+   blocked on. */
+void __mthread_wakeup(struct mthread_s *th)
+{
+  __mthread_wakeup_on(th, mthread_get_vp());
+}
+
+/* Same, on VP unless TH is bound to its own. */
+void __mthread_wakeup_on(struct mthread_s *th, mthread_virtual_processor_t *vp)
+{
+  if (th->not_migrable)
+  {
+    vp = th->vp;
+  }
+  if (mthread_replay_mode != MTHREAD_REPLAY_OFF)
+  {
+    vp = __mthread_replay_wakeup(th, vp);
+  }
+  MTHREAD_STAT_INC(vp, wakeups[th->wait_kind]);
+  th->status = RUNNING;
+  mthread_insert_last(th, &(vp->ready_list));
+  mthread_lwp_demand(vp);
+}
+
+/* Switch out of the calling thread for good. It is only marked ZOMBIE once
+   another context runs on the virtual processor, so that a joiner never
+   recycles a stack that is still in use. */
+static void __mthread_exit_current(mthread_virtual_processor_t *vp)
+{
+  struct mthread_s *mctx = (struct mthread_s *)vp->current;
+  // Added: key destructors may block, the VP may change
+  __mthread_key_exit(mctx);
+  vp = mthread_get_vp();
+  // Added: its frames on the shared stack are dead, no need to save them
+  if (vp->shared_owner == mctx)
+  {
+    vp->shared_owner = NULL;
+  }
+  if (mthread_replay_mode != MTHREAD_REPLAY_OFF)
+  {
+    __mthread_replay_unregister(mctx);
+  }
+  mctx->status = BLOCKED;
+  vp->zombie = mctx;
+  __mthread_yield(vp);
+}
+
+static void mthread_idle_task(void *arg)
+{
+  mthread_virtual_processor_t *vp;
+  vp = (mthread_virtual_processor_t *)arg;
+
+  // Added: no barrier, the other VPs may not even be started yet
+  vp->state = 1;
   mthread_log("SCHEDULER", "Virtual processor %d started\n", vp->rank);
   while (1)
   {
+    // Added: account the rounds where the idle task found nothing to run
+    unsigned long switches = vp->stats.switches;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     __mthread_yield(vp);
+    vp = mthread_get_vp();
+    if (vp->stats.switches == switches)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      MTHREAD_STAT_ADD(vp, idle_ns, (end.tv_sec - start.tv_sec) * 1000000000UL + end.tv_nsec - start.tv_nsec);
+    }
   }
   not_implemented();
 }
 
 #ifdef TWO_LEVEL
-static pthread_key_t lwp_key;
+// Added: per LWP, NULL before the library is initialized. Initial-exec so
+// that reading it never allocates, mthread_malloc needs it. The accessors
+// are never inlined: a thread may resume on another LWP after a switch, and
+// the compiler would keep the address of the first LWP's variable.
+static __thread mthread_virtual_processor_t *lwp_vp __attribute__((tls_model("initial-exec"))) = NULL;
 #endif
 
-mthread_virtual_processor_t *mthread_get_vp()
+__attribute__((noinline)) mthread_virtual_processor_t *mthread_get_vp()
 {
 #ifdef TWO_LEVEL
-  return pthread_getspecific(lwp_key);
+  return lwp_vp;
 #else
   return &(virtual_processors[0]);
 #endif
 }
 
+/* Make the calling LWP run VP (NULL detaches it from any VP). */
+__attribute__((noinline)) void mthread_set_vp(mthread_virtual_processor_t *vp)
+{
+#ifdef TWO_LEVEL
+  lwp_vp = vp;
+#endif
+}
+
+mthread_virtual_processor_t *mthread_get_vp_by_rank(int rank)
+{
+  return &(virtual_processors[rank]);
+}
+
+int mthread_get_nb_vp()
+{
+  return nb_lwp;
+}
+
 int mthread_get_vp_rank()
 {
-  return mthread_get_vp()->rank;
+  // Added: objects such as channels may be initialized before the first
+  // mthread_create, when no virtual processor exists yet
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  return vp != NULL ? vp->rank : -1;
 }
 
 static inline void mthread_init_vp(mthread_virtual_processor_t *vp, struct mthread_s *idle,
@@ -255,8 +549,21 @@ static inline void mthread_init_vp(mthread_virtual_processor_t *vp, struct mthre
   vp->idle = idle;
   mthread_list_init(&(vp->ready_list));
   vp->rank = rank;
+  vp->node = -1;
+  memset(vp->domain, -1, sizeof(vp->domain));
+  vp->steal_first = 0;
+  vp->steal_level = 0;
+  vp->steal_failures = 0;
   vp->resched = NULL;
+  vp->migrant = NULL;
   vp->p = NULL;
+  vp->zombie = NULL;
+  vp->tcb_cache = NULL;
+  vp->tcb_cache_count = 0;
+  vp->lockprof = mthread_lockprof_vp_new();
+  vp->replay = mthread_replay_vp_new(rank);
+  vp->shared_stack = NULL;
+  vp->shared_owner = NULL;
 }
 
 static void *mthread_main(void *arg)
@@ -273,25 +580,34 @@ static inline void mthread_init_lib(long i)
 
   stack = (char *)safe_malloc(MTHREAD_DEFAULT_STACK);
   mctx = (struct mthread_s *)safe_malloc(sizeof(struct mthread_s));
+  memset(mctx->specific, 0, sizeof(mctx->specific));
   mthread_init_thread(mctx);
-
-  mthread_list_init(&(joined_list));
+  mctx->mem_node = -1;
 
   if (i == 0)
   {
     current = (struct mthread_s *)safe_malloc(sizeof(struct mthread_s));
+    memset(current->specific, 0, sizeof(current->specific));
     mthread_init_thread(current);
     current->__start_routine = mthread_main;
     current->stack = NULL;
-#ifdef TWO_LEVEL
-    pthread_key_create(&lwp_key, NULL);
-#endif
+    current->mem_node = -1;
+    // Added: the main thread is the first one of a replay log
+    __mthread_replay_register(current);
   }
-#ifdef TWO_LEVEL
-  pthread_setspecific(lwp_key, &(virtual_processors[i]));
-#endif
+  mthread_set_vp(&(virtual_processors[i]));
 
-  mthread_init_vp(&(virtual_processors[i]), mctx, mctx, i);
+  // Added: the other VPs were initialized by mthread_lwp_demand
+  if (i == 0)
+  {
+    mthread_init_vp(&(virtual_processors[i]), mctx, mctx, i);
+  }
+  else
+  {
+    virtual_processors[i].idle = mctx;
+  }
+  mthread_numa_lwp_init(&(virtual_processors[i]));
+  mthread_domain_lwp_init(&(virtual_processors[i]));
   mthread_mctx_set(mctx, mthread_idle_task, stack, MTHREAD_DEFAULT_STACK, &(virtual_processors[i]));
   if (i != 0)
   {
@@ -311,7 +627,74 @@ static void *mthread_lwp_start(void *arg)
   return NULL;
 }
 
-static void mthread_start_thread(void *arg)
+// Whether LWP number I is needed, up to max_lwp: the ready list of VP holds
+// at least as many threads as there are LWPs running, or a thread is bound
+// to the VP of rank RANK
+static inline int mthread_lwp_needed(long i, mthread_virtual_processor_t *vp, int rank)
+{
+  if (i >= max_lwp)
+    return 0;
+  return i <= rank || (vp != NULL && vp->ready_list.count >= i);
+}
+
+/* Start one more LWP if needed for VP or for the VP of rank RANK.  */
+static void mthread_lwp_spawn(mthread_virtual_processor_t *vp, int rank)
+{
+#ifdef TWO_LEVEL
+  static mthread_tst_t lwp_lock = 0;
+  pthread_t pid;
+  long i;
+
+  if (!mthread_lwp_needed(nb_lwp, vp, rank))
+    return;
+
+  mthread_spinlock_lock(&lwp_lock);
+  i = nb_lwp;
+  if (!mthread_lwp_needed(i, vp, rank))
+  {
+    mthread_spinlock_unlock(&lwp_lock);
+    return;
+  }
+  // Ready before it becomes visible to the work stealing loops
+  mthread_init_vp(&(virtual_processors[i]), NULL, NULL, i);
+  nb_lwp = i + 1;
+  mthread_spinlock_unlock(&lwp_lock);
+
+  mthread_log("GENERAL", "Starting virtual processor %ld\n", i);
+  pthread_create(&pid, NULL, mthread_lwp_start, (void *)i);
+  pthread_detach(pid);
+#endif
+}
+
+/* Start one more LWP when the ready list of VP holds at least as many
+   threads as there are LWPs running, up to max_lwp.  */
+static void mthread_lwp_demand(mthread_virtual_processor_t *vp)
+{
+  mthread_lwp_spawn(vp, MTHREAD_VP_ANY);
+}
+
+/* Start the LWPs up to the one of the VP of rank RANK.  */
+static void mthread_lwp_ensure(int rank)
+{
+  while (nb_lwp <= rank && nb_lwp < max_lwp)
+    mthread_lwp_spawn(NULL, rank);
+}
+
+// Put the members of a complete gang first in line on their VPs, together
+static void mthread_gang_start(mthread_gang_t *gang, mthread_waitq_t *members)
+{
+  struct mthread_s *th;
+
+  if (members->first == NULL)
+    return;
+
+  mthread_lwp_ensure(gang->size - 1);
+  mthread_log("GANG", "Starting %u threads\n", gang->size);
+  while ((th = mthread_waitq_pop(members)) != NULL)
+    mthread_insert_first(th, &(th->vp->ready_list));
+}
+
+void mthread_start_thread(void *arg)
 {
   struct mthread_s *mctx;
   mthread_virtual_processor_t *vp;
@@ -320,57 +703,47 @@ static void mthread_start_thread(void *arg)
   vp = mthread_get_vp();
   __mthread_yield(vp);
   mctx->res = mctx->__start_routine(mctx->arg);
-  mctx->status = ZOMBIE;
-  mthread_log("THREAD END", "Thread %p ended (%d)\n", arg, vp->rank);
   vp = mthread_get_vp();
-  __mthread_yield(vp);
+  mthread_log("THREAD END", "Thread %p ended (%d)\n", arg, vp->rank);
+  __mthread_exit_current(vp);
 }
 
 /* Function for handling threads.  */
 
 static inline void __mthread_lib_init()
 {
+  char *env;
+
   mthread_log_init();
 #ifdef TWO_LEVEL
-  do
+  env = getenv("MTHREAD_VP");
+  if (env != NULL && atoi(env) > 0)
   {
-    long i;
-    for (i = 0; i < MTHREAD_LWP; i++)
-    {
-      virtual_processors[i].state = 0;
-    }
-  } while (0);
+    max_lwp = atoi(env) < MTHREAD_MAX_LWP ? atoi(env) : MTHREAD_MAX_LWP;
+  }
 #endif
+  mthread_numa_init();
+  mthread_domain_init();
+  mthread_stats_init();
+  mthread_lockprof_init();
+  mthread_replay_init();
+  // Added: the other LWPs are started lazily by mthread_lwp_demand
   mthread_init_lib(0);
   virtual_processors[0].state = 1;
-#ifdef TWO_LEVEL
-  do
-  {
-    long i;
-    long j;
-    int done = 0;
-    for (i = 1; i < MTHREAD_LWP; i++)
-    {
-      pthread_t pid;
-      pthread_create(&pid, NULL, mthread_lwp_start, (void *)i);
-    }
-    while (done == 0)
-    {
-      done = 1;
-      sched_yield();
-      for (j = 0; j < MTHREAD_LWP; j++)
-      {
-        if (virtual_processors[j].state == 0)
-        {
-          done = 0;
-        }
-      }
-    }
-  } while (0);
-#endif
   mthread_log("GENERAL", "MThread library started\n");
 }
 
+/* Start the library if needed, making the caller its main thread.  */
+void mthread_ensure_init()
+{
+  static int is_init = 0;
+  if (is_init == 0)
+  {
+    __mthread_lib_init();
+    is_init = 1;
+  }
+}
+
 /* Create a thread with given attributes ATTR (or default attributes
    if ATTR is NULL), and call function START_ROUTINE with given
    arguments ARG.  */
@@ -379,47 +752,69 @@ int mthread_create(mthread_t *__threadp,
                    void *(*__start_routine)(void *), void *__arg)
 {
   mthread_virtual_processor_t *vp;
-  static int is_init = 0;
-  if (is_init == 0)
-  {
-    __mthread_lib_init();
-    is_init = 1;
-  }
+  mthread_ensure_init();
 
   vp = mthread_get_vp();
 
-  if (__attr == NULL)
-  {
-    struct mthread_s *mctx;
-    char *stack;
+  struct mthread_s *mctx;
+  mthread_waitq_t gang_start;
 
-    mctx = mthread_remove_first(&(joined_list));
-    if (mctx == NULL)
-    {
-      mctx = (struct mthread_s *)safe_malloc(sizeof(struct mthread_s));
-    }
-    if (mctx->stack == NULL)
-    {
-      stack = (char *)safe_malloc(MTHREAD_DEFAULT_STACK);
-    }
-    else
-    {
-      stack = mctx->stack;
-    }
+  // Added: a shared stack thread stays on the VP of its creator, and a gang
+  // member goes where its gang puts it
+  if (__attr != NULL &&
+      (__attr->shared_stack != 0) + (__attr->vp != MTHREAD_VP_ANY) + (__attr->gang != NULL) > 1)
+  {
+    return EINVAL;
+  }
 
+  if (__attr == NULL || !__attr->shared_stack)
+  {
+    // Added: its stack on the node of the VP it is bound to, if any
+    mctx = mthread_tcb_alloc(vp, __attr != NULL && __attr->vp != MTHREAD_VP_ANY ? mthread_numa_vp_node(__attr->vp) : -1);
     mthread_init_thread(mctx);
-    mthread_log("THREAD INIT", "Create thread %p\n", mctx);
-    mctx->arg = __arg;
-    mctx->__start_routine = __start_routine;
-    mthread_mctx_set(mctx, mthread_start_thread, stack, MTHREAD_DEFAULT_STACK, mctx);
-    mthread_insert_last(mctx, &(vp->ready_list));
-    *__threadp = mctx;
+    mthread_mctx_set(mctx, mthread_start_thread, mctx->stack, MTHREAD_DEFAULT_STACK, mctx);
   }
   else
   {
-    not_implemented();
+    // Added: bound to the shared stack of this VP
+    mctx = mthread_tcb_alloc_shared();
+    mthread_init_thread(mctx);
+    mctx->shared_stack = 1;
+    mctx->not_migrable = 1;
+    mthread_shared_prepare(vp, mctx);
+  }
+
+  __mthread_replay_register(mctx);
+  mthread_log("THREAD INIT", "Create thread %p%s\n", mctx, mctx->shared_stack ? " on the shared stack" : "");
+  mctx->arg = __arg;
+  mctx->__start_routine = __start_routine;
+  *__threadp = mctx;
+
+  // Added: gang members wait for the last one, see mthread_gang.c
+  if (__attr != NULL && __attr->gang != NULL)
+  {
+    if (__mthread_gang_add(__attr->gang, mctx, &gang_start) < 0)
+    {
+      __mthread_replay_unregister(mctx);
+      mthread_tcb_free(vp, mctx);
+      return EINVAL;
+    }
+    mthread_gang_start(__attr->gang, &gang_start);
+    return 0;
+  }
+
+  // Added: bound to the VP asked for
+  if (__attr != NULL && __attr->vp != MTHREAD_VP_ANY)
+  {
+    mthread_lwp_ensure(__attr->vp);
+    mctx->not_migrable = 1;
+    mctx->vp = &(virtual_processors[__attr->vp]);
+    vp = mctx->vp;
   }
 
+  mthread_insert_last(mctx, &(vp->ready_list));
+  mthread_lwp_demand(vp);
+
   return 0;
 }
 
@@ -429,7 +824,7 @@ mthread_self(void)
 {
   mthread_virtual_processor_t *vp;
   vp = mthread_get_vp();
-  return (mthread_t)vp->current;
+  return vp != NULL ? (mthread_t)vp->current : NULL;
 }
 
 /* Compare two thread identifiers.  */
@@ -448,9 +843,11 @@ void mthread_exit(void *__retval)
 
   mctx->res = __retval;
 
-  mctx->status = ZOMBIE;
   mthread_log("THREAD END", "Thread %p exited\n", mctx);
-  __mthread_yield(vp);
+  // Added: cleanup handlers may block, the VP may change
+  __mthread_cleanup_run(mctx);
+  vp = mthread_get_vp();
+  __mthread_exit_current(vp);
 }
 
 /* Make calling thread wait for termination of the thread TH.  The
@@ -458,10 +855,18 @@ void mthread_exit(void *__retval)
    is not NULL.  */
 int mthread_join(mthread_t __th, void **__thread_return)
 {
+  int err;
+
   mthread_log("THREAD END", "Join thread %p\n", __th);
 
   while (__th->status != ZOMBIE)
   {
+    // Added: a cancellation point, bounded by the deadline of the caller
+    err = __mthread_wait_poll(mthread_self());
+    if (err != 0)
+    {
+      return __mthread_cancel_point(err);
+    }
     mthread_yield();
   }
 
@@ -471,11 +876,95 @@ int mthread_join(mthread_t __th, void **__thread_return)
     *__thread_return = (void *)__th->res;
   }
   mthread_log("THREAD END", "Thread %p joined\n", __th);
-  mthread_insert_last(__th, &(joined_list));
+  mthread_tcb_free(mthread_get_vp(), __th);
 
   return 0;
 }
 
+/* Indicate that the thread TH is never to be joined with MTHREAD_JOIN.  */
+int mthread_detach(mthread_t __th)
+{
+  mthread_log("THREAD END", "Detach thread %p\n", __th);
+
+  if (__th == NULL)
+  {
+    return EINVAL;
+  }
+
+  if (!__sync_bool_compare_and_swap(&__th->detached, MTHREAD_JOINABLE, MTHREAD_DETACHED))
+  {
+    if (__th->detached == MTHREAD_DETACHED)
+    {
+      return EINVAL;
+    }
+    // Already exited, wait for the last write of its VP before freeing it
+    while (__th->status != ZOMBIE)
+    {
+      mthread_yield();
+    }
+    mthread_tcb_free(mthread_get_vp(), __th);
+  }
+
+  return 0;
+}
+
+/* Move TH to the virtual processor of rank VP and keep it there, or let
+   it be stolen again if VP is MTHREAD_VP_ANY.  */
+int mthread_migrate(mthread_t __th, int __vp)
+{
+  mthread_virtual_processor_t *target;
+  mthread_virtual_processor_t *vp;
+  int i;
+
+  if (__th == NULL || __th->shared_stack || __vp < MTHREAD_VP_ANY || __vp >= mthread_get_max_vp())
+  {
+    return EINVAL;
+  }
+
+  if (__vp == MTHREAD_VP_ANY)
+  {
+    mthread_log("MIGRATE", "Thread %p may move again\n", __th);
+    __th->not_migrable = 0;
+    return 0;
+  }
+
+  mthread_lwp_ensure(__vp);
+  target = &(virtual_processors[__vp]);
+  __th->vp = target;
+  __sync_synchronize();
+  __th->not_migrable = 1;
+  mthread_log("MIGRATE", "Thread %p bound to %d\n", __th, __vp);
+
+  vp = mthread_get_vp();
+  if (__th == (mthread_t)vp->current)
+  {
+    // Switched out of this VP, then queued on the target one
+    if (vp != target)
+    {
+      __mthread_yield(vp);
+    }
+    return 0;
+  }
+
+  // Waiting in a ready list: move it now. Otherwise it is running or
+  // blocked, and goes to its VP at its next switch or wakeup
+  for (i = 0; i < nb_lwp; i++)
+  {
+    if (&(virtual_processors[i]) != target && mthread_remove(__th, &(virtual_processors[i].ready_list)))
+    {
+      mthread_insert_last(__th, &(target->ready_list));
+      break;
+    }
+  }
+  return 0;
+}
+
+int mthread_get_max_vp(void)
+{
+  mthread_ensure_init();
+  return max_lwp;
+}
+
 void mthread_yield()
 {
   mthread_virtual_processor_t *vp;
@@ -483,3 +972,16 @@ void mthread_yield()
   mthread_log("THREAD YIELD", "Thread %p yield\n", vp->current);
   __mthread_yield(vp);
 }
+
+int mthread_yield_to(mthread_t __th)
+{
+  mthread_virtual_processor_t *vp;
+  if (__th == NULL)
+  {
+    return EINVAL;
+  }
+  vp = mthread_get_vp();
+  mthread_log("THREAD YIELD", "Thread %p yield to %p\n", vp->current, __th);
+  __mthread_yield_to(vp, __th);
+  return 0;
+}
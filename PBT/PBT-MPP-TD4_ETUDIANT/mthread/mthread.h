@@ -1,6 +1,9 @@
 #ifndef __MTHREAD_MTHREAD_H__
 #define __MTHREAD_MTHREAD_H__
 
+#include <sys/types.h>
+#include <time.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -14,21 +17,58 @@ extern "C"
   struct mthread_s;
   typedef struct mthread_s *mthread_t;
 
-  struct mthread_attr_s;
+  // Added: threads blocked on a synchronization object, linked through their
+  // TCB and protected by the lock of the object: it needs no allocation
+  typedef struct mthread_waitq_s
+  {
+    struct mthread_s *first;
+    struct mthread_s *last;
+  } mthread_waitq_t;
+
+#define MTHREAD_WAITQ_INIT      \
+  {                             \
+    .first = NULL, .last = NULL \
+  }
+
+  // Added: threads started together on distinct virtual processors
+  struct mthread_gang_s
+  {
+    volatile mthread_tst_t lock;
+    unsigned int size;
+    unsigned int created;
+    mthread_waitq_t held; /* members waiting for the last one */
+  };
+  typedef struct mthread_gang_s mthread_gang_t;
+
+  // Added: definition for the thread attributes
+  struct mthread_attr_s
+  {
+    int shared_stack;
+    int vp;                      /* MTHREAD_VP_ANY or the rank to run on */
+    struct mthread_gang_s *gang; /* NULL if not in a gang */
+  };
   typedef struct mthread_attr_s mthread_attr_t;
 
+#define MTHREAD_VP_ANY -1
+
+  // Added: the state word is enough while nobody waits, the lock only
+  // protects the queue of waiters
   struct mthread_mutex_s
   {
-    volatile int nb_thread;
+    volatile int state;
     volatile mthread_tst_t lock;
-    mthread_list_t *list; /* lock management already handled */
+    mthread_waitq_t queue;
   };
   typedef struct mthread_mutex_s mthread_mutex_t;
 
+#define MTHREAD_MUTEX_FREE 0
+#define MTHREAD_MUTEX_LOCKED 1
+#define MTHREAD_MUTEX_CONTENDED 2 /* locked, threads may be waiting */
+
 // Added: simple mutex initializer
-#define MTHREAD_MUTEX_INITIALIZER           \
-  {                                         \
-    .nb_thread = 0, .lock = 0, .list = NULL \
+#define MTHREAD_MUTEX_INITIALIZER                      \
+  {                                                    \
+    .state = 0, .lock = 0, .queue = MTHREAD_WAITQ_INIT \
   }
 
   struct mthread_mutexattr_s;
@@ -38,13 +78,13 @@ extern "C"
   {
     // Added: definition for a condition
     volatile mthread_tst_t lock;
-    mthread_list_t *thread_queue;
+    mthread_waitq_t queue;
   };
   typedef struct mthread_cond_s mthread_cond_t;
 
-#define MTHREAD_COND_INITIALIZER    \
-  {                                 \
-    .lock = 0, .thread_queue = NULL \
+#define MTHREAD_COND_INITIALIZER           \
+  {                                        \
+    .lock = 0, .queue = MTHREAD_WAITQ_INIT \
   }
 
   struct mthread_condattr_s;
@@ -52,24 +92,102 @@ extern "C"
 
   typedef unsigned int mthread_key_t;
 
-  struct mthread_once_s;
+#define MTHREAD_KEYS_MAX 64
+
+  // Added: an int, so that it fits in a pthread_once_t
+  struct mthread_once_s
+  {
+    volatile int state;
+  };
   typedef struct mthread_once_s mthread_once_t;
 
+#define MTHREAD_ONCE_INIT \
+  {                       \
+    .state = 0            \
+  }
+
   struct mthread_sem_s
   {
-    // Added: definition for the semaphore
+    // Added: definition for the semaphore, VALUE and WAITERS are atomic,
+    // the lock only protects the queue
     unsigned int max;
     volatile unsigned int value;
     volatile mthread_tst_t lock;
-    mthread_list_t *thread_queue;
+    volatile unsigned int waiters; /* threads in the slow path of wait */
+    mthread_waitq_t queue;
   };
   typedef struct mthread_sem_s mthread_sem_t;
 
-#define MTHREAD_SEM_INITIALIZER(VALUE)                                \
-  {                                                                   \
-    .max = (VALUE), .value = (VALUE), .lock = 0, .thread_queue = NULL \
+#define MTHREAD_SEM_INITIALIZER(VALUE)                                                     \
+  {                                                                                        \
+    .max = (VALUE), .value = (VALUE), .lock = 0, .waiters = 0, .queue = MTHREAD_WAITQ_INIT \
   }
 
+  struct mthread_chan_s
+  {
+    volatile mthread_tst_t lock;
+    unsigned int elem_size;
+    unsigned int capacity;
+    unsigned int head;
+    volatile unsigned int count;
+    volatile int closed;
+    char *buffer;
+    mthread_waitq_t send_queue; /* senders blocked on a full channel */
+    mthread_waitq_t recv_queue; /* receivers blocked on an empty channel */
+  };
+  typedef struct mthread_chan_s mthread_chan_t;
+
+  struct mthread_future_s;
+  typedef struct mthread_future_s *mthread_future_t;
+
+  // Added: a cleanup handler, on the stack of the thread that pushed it
+  struct mthread_cleanup_s
+  {
+    void (*routine)(void *);
+    void *arg;
+    struct mthread_cleanup_s *prev;
+  };
+
+#define MTHREAD_CANCELED ((void *)-1)
+#define MTHREAD_CANCEL_ENABLE 0
+#define MTHREAD_CANCEL_DISABLE 1
+
+  /* Primitives a thread can block on, used to classify statistics.  */
+  typedef enum
+  {
+    MTHREAD_WAIT_MUTEX,
+    MTHREAD_WAIT_SEM,
+    MTHREAD_WAIT_COND,
+    MTHREAD_WAIT_CHAN,
+    MTHREAD_WAIT_FUTURE,
+    MTHREAD_WAIT_PARK,
+    MTHREAD_WAIT_SYSCALL, /* in a blocking system call */
+    MTHREAD_NB_WAIT
+  } mthread_wait_kind_t;
+
+  /* Most LWPs, and so virtual processors, MTHREAD_VP can ask for.  */
+#define MTHREAD_MAX_LWP 64
+#define MTHREAD_STATS_MAX_VP MTHREAD_MAX_LWP
+
+  typedef struct
+  {
+    unsigned long switches;               /* context switches */
+    unsigned long steals;                 /* threads taken from another VP */
+    unsigned long remote_steals;          /* of them, from another NUMA node */
+    unsigned long failed_steals;          /* steal rounds that found nothing */
+    unsigned long idle_ns;                /* time spent idle, without work */
+    unsigned long blocks[MTHREAD_NB_WAIT]; /* threads that blocked here */
+    unsigned int ready;                   /* ready list length */
+  } mthread_vp_stats_t;
+
+  typedef struct
+  {
+    int nb_vp;
+    mthread_vp_stats_t vp[MTHREAD_STATS_MAX_VP];
+    mthread_vp_stats_t total;
+    unsigned long blocked[MTHREAD_NB_WAIT]; /* threads blocked right now */
+  } mthread_stats_t;
+
   /* Function for handling threads.  */
 
   /* Create a thread with given attributes ATTR (or default attributes
@@ -93,6 +211,100 @@ extern "C"
      is not NULL.  */
   extern int mthread_join(mthread_t __th, void **__thread_return);
 
+  /* Indicate that the thread TH is never to be joined with MTHREAD_JOIN.
+     The resources of TH will therefore be freed immediately when it
+     terminates, instead of waiting for another thread to perform
+     MTHREAD_JOIN on it.  */
+  extern int mthread_detach(mthread_t __th);
+
+  /* Ask TH to exit with MTHREAD_CANCELED as its result.  Cancellation is
+     deferred: TH runs its cleanup handlers and exits at its next
+     cancellation point, which is any wait of a condition, semaphore,
+     channel, future, park or join, any sleep or blocking call, and
+     mthread_testcancel.  A thread already waiting is woken up for it.
+     Mutexes are not cancellation points.  In C++, the frames left this way
+     are not unwound.  */
+  extern int mthread_cancel(mthread_t __th);
+
+  /* Exit here if the calling thread was canceled.  */
+  extern void mthread_testcancel(void);
+
+  /* Set whether the calling thread may be canceled, MTHREAD_CANCEL_ENABLE
+     or MTHREAD_CANCEL_DISABLE, and store the previous state in *OLDSTATE if
+     it is not NULL.  A cancellation asked while disabled is kept for the
+     first cancellation point after it is enabled again.  */
+  extern int mthread_setcancelstate(int __state, int *__oldstate);
+
+  /* Make the waits of the calling thread fail with ETIMEDOUT from ABSTIME
+     on, a CLOCK_REALTIME date, or never if ABSTIME is NULL.  This applies
+     to the same waits as cancellation, but sleeps and blocking calls.  */
+  extern int mthread_setdeadline(const struct timespec *__abstime);
+
+  /* Run ROUTINE(ARG) if the calling thread exits or is canceled before the
+     matching mthread_cleanup_pop, which runs it too if EXECUTE is not zero.
+     Both must be used in pairs in the same block, as with pthreads.  */
+#define mthread_cleanup_push(routine, arg)      \
+  {                                             \
+    struct mthread_cleanup_s __mthread_cleanup; \
+    __mthread_cleanup_push(&__mthread_cleanup, (routine), (arg));
+#define mthread_cleanup_pop(execute)                    \
+  __mthread_cleanup_pop(&__mthread_cleanup, (execute)); \
+  }
+
+  extern void __mthread_cleanup_push(struct mthread_cleanup_s *__cleanup,
+                                     void (*__routine)(void *), void *__arg);
+  extern void __mthread_cleanup_pop(struct mthread_cleanup_s *__cleanup, int __execute);
+
+  /* Move TH to the virtual processor of rank VP and keep it there, or let
+     it be stolen again if VP is MTHREAD_VP_ANY.  A running thread moves at
+     its next switch: the calling thread runs on VP when this returns.
+     EINVAL for a thread on a shared stack or an unknown VP.  */
+  extern int mthread_migrate(mthread_t __th, int __vp);
+
+  /* Number of virtual processors threads can run on.  */
+  extern int mthread_get_max_vp(void);
+
+  /* Functions for handling thread attributes.  */
+
+  /* Initialize ATTR with the default attributes.  */
+  extern int mthread_attr_init(mthread_attr_t *__attr);
+
+  /* Destroy ATTR.  */
+  extern int mthread_attr_destroy(mthread_attr_t *__attr);
+
+  /* Make the threads created with ATTR run on the stack shared by the
+     threads of their virtual processor, if SHARED is not zero.  Their
+     frames are copied to a private buffer of their size when another one
+     needs the stack, which saves memory at the cost of a copy on some
+     switches.  Such a thread stays on the VP it was created on, and blocks
+     that VP in a blocking system call.  ENOTSUP when unavailable on this
+     architecture.  */
+  extern int mthread_attr_setsharedstack(mthread_attr_t *__attr, int __shared);
+  extern int mthread_attr_getsharedstack(const mthread_attr_t *__attr, int *__shared);
+
+  /* Make the threads created with ATTR run on the virtual processor of
+     rank VP only, as mthread_migrate does, or anywhere if VP is
+     MTHREAD_VP_ANY.  */
+  extern int mthread_attr_setvp(mthread_attr_t *__attr, int __vp);
+  extern int mthread_attr_getvp(const mthread_attr_t *__attr, int *__vp);
+
+  /* Make the threads created with ATTR members of GANG, or of no gang if
+     GANG is NULL.  */
+  extern int mthread_attr_setgang(mthread_attr_t *__attr, mthread_gang_t *__gang);
+  extern int mthread_attr_getgang(const mthread_attr_t *__attr, mthread_gang_t **__gang);
+
+  /* Functions for gangs.  */
+
+  /* Initialize GANG for SIZE threads, no more than mthread_get_max_vp.
+     Its members are created with an attribute naming it: member K stays on
+     virtual processor K, and none of them runs before the last one is
+     created, when they are all put first in line on their VPs.  Threads
+     that spin on each other then really run side by side.  */
+  extern int mthread_gang_init(mthread_gang_t *__gang, unsigned int __size);
+
+  /* Destroy GANG, EBUSY while some of its members are still to come.  */
+  extern int mthread_gang_destroy(mthread_gang_t *__gang);
+
   /* Functions for mutex handling.  */
 
   /* Initialize MUTEX using attributes in *MUTEX_ATTR, or use the
@@ -133,14 +345,20 @@ extern "C"
   extern int mthread_cond_wait(mthread_cond_t *__cond,
                                mthread_mutex_t *__mutex);
 
+  /* Same as mthread_cond_wait, but fail with ETIMEDOUT once ABSTIME, a
+     CLOCK_REALTIME date, is passed.  MUTEX is locked again in any case.  */
+  extern int mthread_cond_timedwait(mthread_cond_t *__cond,
+                                    mthread_mutex_t *__mutex,
+                                    const struct timespec *__abstime);
+
   /* Functions for handling thread-specific data.  */
 
   /* Create a key value identifying a location in the thread-specific
      data area.  Each thread maintains a distinct thread-specific data
      area.  DESTR_FUNCTION, if non-NULL, is called with the value
-     associated to that key when the key is destroyed.
+     associated to that key when the thread exits.
      DESTR_FUNCTION is not called if the value associated is NULL when
-     the key is destroyed.  */
+     the thread exits.  At most MTHREAD_KEYS_MAX keys exist at once.  */
   extern int mthread_key_create(mthread_key_t *__key,
                                 void (*__destr_function)(void *));
 
@@ -176,8 +394,130 @@ extern "C"
 
   extern int mthread_sem_destroy(mthread_sem_t *sem); /* undo sem_init() */
 
+  /* Functions for handling channels.  */
+
+  /* Initialize CHAN as a ring buffer of CAPACITY items of ELEM_SIZE bytes.
+     A CAPACITY of 0 gives an unbuffered channel: every send waits for a
+     receiver.  */
+  extern int mthread_chan_init(mthread_chan_t *chan, unsigned int elem_size,
+                               unsigned int capacity);
+
+  /* Destroy CHAN, EBUSY if threads are still blocked on it.  */
+  extern int mthread_chan_destroy(mthread_chan_t *chan);
+
+  /* Close CHAN: blocked and future senders get EPIPE, receivers drain the
+     remaining items then get EPIPE.  */
+  extern int mthread_chan_close(mthread_chan_t *chan);
+
+  /* Send one item, waiting while the channel is full.  */
+  extern int mthread_chan_send(mthread_chan_t *chan, const void *item);
+
+  /* Receive one item, waiting while the channel is empty.  */
+  extern int mthread_chan_recv(mthread_chan_t *chan, void *item);
+
+  /* Same as above but return EBUSY instead of waiting.  */
+  extern int mthread_chan_trysend(mthread_chan_t *chan, const void *item);
+  extern int mthread_chan_tryrecv(mthread_chan_t *chan, void *item);
+
+  /* Send the N items of ITEMS under a single lock round-trip whenever
+     possible, waiting until all of them are accepted.  */
+  extern int mthread_chan_send_n(mthread_chan_t *chan, const void *items,
+                                 unsigned int n);
+
+  /* Wait for at least one item then receive up to N of them in ITEMS.
+     The number of items received is stored in *RECEIVED.  */
+  extern int mthread_chan_recv_n(mthread_chan_t *chan, void *items,
+                                 unsigned int n, unsigned int *received);
+
+  /* Functions for handling futures.  */
+
+  /* Run START_ROUTINE(ARG) in a new thread and return a future for its
+     result.  The thread needs no join, its control block goes back to the
+     pool as soon as it ends.  */
+  extern mthread_future_t mthread_async(void *(*__start_routine)(void *),
+                                        void *__arg);
+
+  /* Wait for FUTURE to complete and store its result in *RESULT, if RESULT
+     is not NULL.  */
+  extern int mthread_future_get(mthread_future_t future, void **result);
+
+  /* Wait for one of the N FUTURES to complete and store its position in
+     *INDEX.  */
+  extern int mthread_future_wait_any(mthread_future_t *futures, unsigned int n,
+                                     unsigned int *index);
+
+  /* Wait for all of the N FUTURES to complete.  */
+  extern int mthread_future_wait_all(mthread_future_t *futures, unsigned int n);
+
+  /* Release a completed FUTURE, EBUSY if it is still running.  */
+  extern int mthread_future_destroy(mthread_future_t future);
+
+  /* Functions for parking threads on an address.  */
+
+  /* Block the calling thread until another one unparks ADDR, unless *ADDR
+     no longer holds EXPECTED: EAGAIN is returned right away then.  The
+     check and the sleep are atomic with respect to the unpark functions,
+     which must be called after *ADDR is changed.  */
+  extern int mthread_park(const volatile int *addr, int expected);
+
+  /* Wake one, or all, of the threads parked on ADDR and return how many
+     were woken.  */
+  extern int mthread_unpark_one(const volatile int *addr);
+  extern int mthread_unpark_all(const volatile int *addr);
+
+  /* Functions for runtime statistics.  */
+
+  /* Take a snapshot of the scheduler counters of every virtual processor.
+     The counters are read without synchronisation and may be slightly
+     out of date.  */
+  extern int mthread_stats_get(mthread_stats_t *stats);
+
+  /* Print a snapshot on stderr.  This is done at exit when the MTHREAD_STATS
+     environment variable is set, and every MTHREAD_STATS_INTERVAL
+     milliseconds when that one is set.  */
+  extern void mthread_stats_dump(void);
+
+  /* Functions for blocking system calls.  */
+
+  /* Bracket a system call that may block the calling LWP.  The virtual
+     processor is handed to a spare LWP until mthread_blocking_end, so that
+     the other threads keep running.  No mthread function may be called
+     between the two.  */
+  extern void mthread_blocking_begin(void);
+  extern void mthread_blocking_end(void);
+
+  /* Same as the libc calls, inside a blocking bracket.  */
+  extern unsigned int mthread_sleep(unsigned int seconds);
+  extern int mthread_usleep(unsigned int usec);
+  extern int mthread_nanosleep(const struct timespec *req, struct timespec *rem);
+  extern ssize_t mthread_read(int fd, void *buf, size_t count);
+  extern ssize_t mthread_write(int fd, const void *buf, size_t count);
+
+  /* Functions for memory allocation.  */
+
+  /* Same as the libc calls.  Small blocks come from a cache of the virtual
+     processor, without locking, and go back to the cache of the one they
+     were allocated on when freed.  Building with make MALLOC_OVERRIDE=1
+     makes malloc and free these functions.  */
+  extern void *mthread_malloc(size_t size);
+  extern void *mthread_calloc(size_t n, size_t size);
+  extern void *mthread_realloc(void *ptr, size_t size);
+  extern void mthread_free(void *ptr);
+
   extern void mthread_yield();
 
+  /* Set when the lock profiler is on: the inline fast paths of mthread.hpp
+     then leave every acquisition to the C functions.  */
+  extern int mthread_lockprof_enabled;
+
+  /* Give the units of SEM to the threads waiting for them, after a post
+     found WAITERS set.  For the inline posts of mthread.hpp.  */
+  extern struct mthread_s *__mthread_sem_wake(mthread_sem_t *sem);
+
+  /* Switch directly to TH if it is ready to run, otherwise yield as
+     mthread_yield does.  */
+  extern int mthread_yield_to(mthread_t __th);
+
 #ifdef __cplusplus
 }
 #endif
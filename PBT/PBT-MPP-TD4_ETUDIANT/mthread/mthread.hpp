@@ -0,0 +1,384 @@
+#ifndef __MTHREAD_MTHREAD_HPP__
+#define __MTHREAD_MTHREAD_HPP__
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "mthread.h"
+
+/* C++ layer over mthread, header only, C++17.  Errors are thrown as
+   std::system_error, like the standard library does.  */
+
+// The uncontended paths of the mutex and the semaphore are inline: the same
+// compare-and-swap on the state word as the C functions. Everything else
+// goes to the C function, and so does everything while the lock profiler is
+// on, so that it sees every acquisition.
+//
+// Do not use std::condition_variable_any with these locks: it waits on a
+// pthread condition, which blocks the whole virtual processor.
+
+namespace mthread
+{
+  namespace detail
+  {
+    inline void check(int err, const char *what)
+    {
+      if (err != 0)
+        throw std::system_error(err, std::generic_category(), what);
+    }
+
+    inline bool cas(volatile int &word, int expected, int desired) noexcept
+    {
+      return __sync_bool_compare_and_swap(&word, expected, desired);
+    }
+  } // namespace detail
+
+  /* Threads.  */
+
+  class thread
+  {
+  public:
+    using id = mthread_t;
+    using native_handle_type = mthread_t;
+
+    thread() noexcept = default;
+
+    // The callable and its arguments are decay-copied into one allocation of
+    // their exact types, freed by the new thread once it is done with them
+    template <class F, class... Args,
+              class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, thread>>>
+    explicit thread(F &&f, Args &&...args)
+    {
+      using state_t = state<std::decay_t<F>, std::decay_t<Args>...>;
+      auto s = std::make_unique<state_t>(std::forward<F>(f), std::forward<Args>(args)...);
+      detail::check(mthread_create(&th_, nullptr, &state_t::run, s.get()), "mthread_create");
+      s.release();
+    }
+
+    ~thread()
+    {
+      if (joinable())
+        std::terminate();
+    }
+
+    thread(const thread &) = delete;
+    thread &operator=(const thread &) = delete;
+
+    thread(thread &&other) noexcept : th_(std::exchange(other.th_, nullptr)) {}
+
+    thread &operator=(thread &&other) noexcept
+    {
+      if (joinable())
+        std::terminate();
+      th_ = std::exchange(other.th_, nullptr);
+      return *this;
+    }
+
+    bool joinable() const noexcept { return th_ != nullptr; }
+    id get_id() const noexcept { return th_; }
+    native_handle_type native_handle() noexcept { return th_; }
+
+    void join()
+    {
+      if (!joinable())
+        detail::check(EINVAL, "mthread::thread::join");
+      detail::check(mthread_join(th_, nullptr), "mthread_join");
+      th_ = nullptr;
+    }
+
+    void detach()
+    {
+      if (!joinable())
+        detail::check(EINVAL, "mthread::thread::detach");
+      detail::check(mthread_detach(th_), "mthread_detach");
+      th_ = nullptr;
+    }
+
+    void swap(thread &other) noexcept { std::swap(th_, other.th_); }
+
+  private:
+    template <class F, class... Args>
+    struct state
+    {
+      template <class G, class... A>
+      explicit state(G &&g, A &&...a) : f(std::forward<G>(g)), args(std::forward<A>(a)...) {}
+
+      // An exception escaping the thread terminates the program, as with std::thread
+      static void *run(void *arg) noexcept
+      {
+        std::unique_ptr<state> s(static_cast<state *>(arg));
+        std::apply(std::move(s->f), std::move(s->args));
+        return nullptr;
+      }
+
+      F f;
+      std::tuple<Args...> args;
+    };
+
+    mthread_t th_ = nullptr;
+  };
+
+  namespace this_thread
+  {
+    inline thread::id get_id() noexcept { return mthread_self(); }
+    inline void yield() noexcept { mthread_yield(); }
+  } // namespace this_thread
+
+  /* Mutexes, Lockable: use them with std::lock_guard and std::unique_lock.  */
+
+  class mutex
+  {
+  public:
+    using native_handle_type = mthread_mutex_t *;
+
+    constexpr mutex() noexcept : m_{0, 0, {nullptr, nullptr}} {}
+
+    ~mutex()
+    {
+      [[maybe_unused]] int err = mthread_mutex_destroy(&m_);
+      assert(err == 0);
+    }
+
+    mutex(const mutex &) = delete;
+    mutex &operator=(const mutex &) = delete;
+
+    void lock()
+    {
+      if (!mthread_lockprof_enabled && detail::cas(m_.state, MTHREAD_MUTEX_FREE, MTHREAD_MUTEX_LOCKED))
+        return;
+      detail::check(mthread_mutex_lock(&m_), "mthread_mutex_lock");
+    }
+
+    bool try_lock()
+    {
+      if (!mthread_lockprof_enabled)
+        return detail::cas(m_.state, MTHREAD_MUTEX_FREE, MTHREAD_MUTEX_LOCKED);
+
+      int err = mthread_mutex_trylock(&m_);
+      if (err == EBUSY)
+        return false;
+      detail::check(err, "mthread_mutex_trylock");
+      return true;
+    }
+
+    void unlock()
+    {
+      // Nobody to hand the mutex to
+      if (!mthread_lockprof_enabled && detail::cas(m_.state, MTHREAD_MUTEX_LOCKED, MTHREAD_MUTEX_FREE))
+        return;
+      detail::check(mthread_mutex_unlock(&m_), "mthread_mutex_unlock");
+    }
+
+    native_handle_type native_handle() noexcept { return &m_; }
+
+  private:
+    mthread_mutex_t m_;
+  };
+
+  /* Condition variables.  */
+
+  class condition_variable
+  {
+  public:
+    using native_handle_type = mthread_cond_t *;
+
+    constexpr condition_variable() noexcept : c_{0, {nullptr, nullptr}} {}
+    ~condition_variable() { mthread_cond_destroy(&c_); }
+
+    condition_variable(const condition_variable &) = delete;
+    condition_variable &operator=(const condition_variable &) = delete;
+
+    // mthread_cond_signal fails when nobody waits, which is not an error here
+    void notify_one() noexcept { mthread_cond_signal(&c_); }
+    void notify_all() noexcept { mthread_cond_broadcast(&c_); }
+
+    void wait(std::unique_lock<mutex> &lock)
+    {
+      detail::check(mthread_cond_wait(&c_, lock.mutex()->native_handle()), "mthread_cond_wait");
+    }
+
+    template <class Predicate>
+    void wait(std::unique_lock<mutex> &lock, Predicate pred)
+    {
+      while (!pred())
+        wait(lock);
+    }
+
+    // mthread_cond_timedwait takes a date of the system clock
+    template <class Clock, class Duration>
+    std::cv_status wait_until(std::unique_lock<mutex> &lock,
+                              const std::chrono::time_point<Clock, Duration> &abs_time)
+    {
+      auto date = std::chrono::system_clock::now() +
+                  std::chrono::duration_cast<std::chrono::system_clock::duration>(abs_time - Clock::now());
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(date.time_since_epoch()).count();
+      struct timespec ts = {static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000)};
+      int err = mthread_cond_timedwait(&c_, lock.mutex()->native_handle(), &ts);
+      if (err == ETIMEDOUT)
+        return std::cv_status::timeout;
+      detail::check(err, "mthread_cond_timedwait");
+      return std::cv_status::no_timeout;
+    }
+
+    template <class Clock, class Duration, class Predicate>
+    bool wait_until(std::unique_lock<mutex> &lock,
+                    const std::chrono::time_point<Clock, Duration> &abs_time, Predicate pred)
+    {
+      while (!pred())
+        if (wait_until(lock, abs_time) == std::cv_status::timeout)
+          return pred();
+      return true;
+    }
+
+    template <class Rep, class Period>
+    std::cv_status wait_for(std::unique_lock<mutex> &lock, const std::chrono::duration<Rep, Period> &rel_time)
+    {
+      return wait_until(lock, std::chrono::steady_clock::now() + rel_time);
+    }
+
+    template <class Rep, class Period, class Predicate>
+    bool wait_for(std::unique_lock<mutex> &lock, const std::chrono::duration<Rep, Period> &rel_time,
+                  Predicate pred)
+    {
+      return wait_until(lock, std::chrono::steady_clock::now() + rel_time, pred);
+    }
+
+    native_handle_type native_handle() noexcept { return &c_; }
+
+  private:
+    mthread_cond_t c_;
+  };
+
+  // Waits with any BasicLockable, the internal mutex closes the window
+  // between releasing it and sleeping
+  class condition_variable_any
+  {
+  public:
+    condition_variable_any() = default;
+
+    condition_variable_any(const condition_variable_any &) = delete;
+    condition_variable_any &operator=(const condition_variable_any &) = delete;
+
+    void notify_one()
+    {
+      std::lock_guard<mutex> guard(m_);
+      cv_.notify_one();
+    }
+
+    void notify_all()
+    {
+      std::lock_guard<mutex> guard(m_);
+      cv_.notify_all();
+    }
+
+    template <class Lock>
+    void wait(Lock &lock)
+    {
+      std::unique_lock<mutex> internal(m_);
+      lock.unlock();
+      cv_.wait(internal);
+      internal.unlock();
+      lock.lock();
+    }
+
+    template <class Lock, class Predicate>
+    void wait(Lock &lock, Predicate pred)
+    {
+      while (!pred())
+        wait(lock);
+    }
+
+  private:
+    mutex m_;
+    condition_variable cv_;
+  };
+
+  /* Counting semaphores, no higher than MAX.  */
+
+  class semaphore
+  {
+  public:
+    using native_handle_type = mthread_sem_t *;
+
+    // Unlike mthread_sem_init, the count may start below its maximum
+    explicit semaphore(unsigned int desired, unsigned int max = INT_MAX) noexcept
+        : s_{max, desired, 0, 0, {nullptr, nullptr}} {}
+
+    // Units may still be taken, as with std::counting_semaphore, but nobody
+    // may wait on it
+    ~semaphore()
+    {
+      [[maybe_unused]] int err = mthread_sem_destroy(&s_);
+      assert(err == 0 || (err == EBUSY && s_.waiters == 0));
+    }
+
+    semaphore(const semaphore &) = delete;
+    semaphore &operator=(const semaphore &) = delete;
+
+    void acquire()
+    {
+      if (!mthread_lockprof_enabled)
+      {
+        unsigned int value = s_.value;
+        while (value > 0)
+        {
+          unsigned int seen = __sync_val_compare_and_swap(&s_.value, value, value - 1);
+          if (seen == value)
+            return;
+          value = seen;
+        }
+      }
+      detail::check(mthread_sem_wait(&s_), "mthread_sem_wait");
+    }
+
+    bool try_acquire()
+    {
+      int err = mthread_sem_trywait(&s_);
+      if (err == EBUSY)
+        return false;
+      detail::check(err, "mthread_sem_trywait");
+      return true;
+    }
+
+    // Gives the units back first, then hands them to the waiters if any,
+    // as mthread_sem_post does
+    void release(unsigned int update = 1)
+    {
+      if (mthread_lockprof_enabled)
+      {
+        for (; update > 0; update--)
+          detail::check(mthread_sem_post(&s_), "mthread_sem_post");
+        return;
+      }
+
+      unsigned int value = s_.value;
+      while (value < s_.max)
+      {
+        unsigned int next = s_.max - value < update ? s_.max : value + update;
+        unsigned int seen = __sync_val_compare_and_swap(&s_.value, value, next);
+        if (seen == value)
+          break;
+        value = seen;
+      }
+      if (__atomic_load_n(&s_.waiters, __ATOMIC_SEQ_CST) != 0)
+        __mthread_sem_wake(&s_);
+    }
+
+    native_handle_type native_handle() noexcept { return &s_; }
+
+  private:
+    mthread_sem_t s_;
+  };
+} // namespace mthread
+
+#endif
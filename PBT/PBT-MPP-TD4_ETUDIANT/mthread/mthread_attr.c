@@ -0,0 +1,82 @@
+#include <errno.h>
+
+#include "mthread_internal.h"
+
+/* Functions for handling thread attributes.  */
+
+int mthread_attr_init(mthread_attr_t *__attr)
+{
+  if (__attr == NULL)
+    return EINVAL;
+
+  __attr->shared_stack = 0;
+  __attr->vp = MTHREAD_VP_ANY;
+  __attr->gang = NULL;
+  return 0;
+}
+
+int mthread_attr_destroy(mthread_attr_t *__attr)
+{
+  if (__attr == NULL)
+    return EINVAL;
+  return 0;
+}
+
+int mthread_attr_setsharedstack(mthread_attr_t *__attr, int __shared)
+{
+  if (__attr == NULL)
+    return EINVAL;
+
+#ifdef MTHREAD_SHARED_STACKS
+  __attr->shared_stack = __shared != 0;
+  return 0;
+#else
+  // The stack pointer of a saved context is read from its registers
+  return __shared ? ENOTSUP : 0;
+#endif
+}
+
+int mthread_attr_getsharedstack(const mthread_attr_t *__attr, int *__shared)
+{
+  if (__attr == NULL || __shared == NULL)
+    return EINVAL;
+
+  *__shared = __attr->shared_stack;
+  return 0;
+}
+
+int mthread_attr_setvp(mthread_attr_t *__attr, int __vp)
+{
+  if (__attr == NULL || __vp < MTHREAD_VP_ANY || __vp >= mthread_get_max_vp())
+    return EINVAL;
+
+  __attr->vp = __vp;
+  return 0;
+}
+
+int mthread_attr_getvp(const mthread_attr_t *__attr, int *__vp)
+{
+  if (__attr == NULL || __vp == NULL)
+    return EINVAL;
+
+  *__vp = __attr->vp;
+  return 0;
+}
+
+int mthread_attr_setgang(mthread_attr_t *__attr, mthread_gang_t *__gang)
+{
+  if (__attr == NULL)
+    return EINVAL;
+
+  __attr->gang = __gang;
+  return 0;
+}
+
+int mthread_attr_getgang(const mthread_attr_t *__attr, mthread_gang_t **__gang)
+{
+  if (__attr == NULL || __gang == NULL)
+    return EINVAL;
+
+  *__gang = __attr->gang;
+  return 0;
+}
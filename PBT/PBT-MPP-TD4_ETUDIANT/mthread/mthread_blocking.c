@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mthread_internal.h"
+#include <pthread.h>
+
+/* Functions for blocking system calls.  */
+
+// A thread about to block in the kernel hands its virtual processor to a
+// spare LWP, which resumes the VP's idle task and keeps running the ready
+// list. Meanwhile the blocking LWP only runs the calling thread, attached to
+// a private shadow VP. On return the thread switches to the LWP's home
+// context, which puts it back in the ready list of its VP; the LWP then
+// becomes a spare itself. Spares are created on demand, and the ones created
+// here exit after staying unused for MTHREAD_SPARE_TIMEOUT seconds.
+
+#define MTHREAD_SPARE_TIMEOUT 2
+#define MTHREAD_HOME_STACK 64 * 1024
+
+typedef struct mthread_lwp_home_s
+{
+  ucontext_t ctx; /* where the LWP waits for a VP to run */
+  int has_ctx;
+  void *stack; /* only for LWPs not started as spares */
+  mthread_virtual_processor_t *assigned;
+  mthread_virtual_processor_t *origin;
+  struct mthread_s *parked;
+  mthread_virtual_processor_t shadow;
+  pthread_cond_t cond;
+  struct mthread_lwp_home_s *next;
+} mthread_lwp_home_t;
+
+static pthread_once_t home_once = PTHREAD_ONCE_INIT;
+static pthread_key_t home_key;
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER;
+static mthread_lwp_home_t *spares = NULL;
+
+static void mthread_home_key_init()
+{
+  pthread_key_create(&home_key, NULL);
+}
+
+static mthread_lwp_home_t *mthread_home_new()
+{
+  mthread_lwp_home_t *home = safe_malloc(sizeof(mthread_lwp_home_t));
+  memset(home, 0, sizeof(mthread_lwp_home_t));
+  home->shadow.ready_list = (mthread_list_t)MTHREAD_LIST_INIT;
+  home->shadow.rank = -1;
+  pthread_cond_init(&home->cond, NULL);
+  return home;
+}
+
+static mthread_lwp_home_t *mthread_home_get()
+{
+  mthread_lwp_home_t *home;
+
+  pthread_once(&home_once, mthread_home_key_init);
+  home = pthread_getspecific(home_key);
+  if (home == NULL)
+  {
+    home = mthread_home_new();
+    pthread_setspecific(home_key, home);
+  }
+  return home;
+}
+
+// Requeue the thread parked by mthread_blocking_end, then run the VPs handed
+// to this LWP. Returns once a retiring spare timed out.
+static void mthread_spare_run(mthread_lwp_home_t *home, int retire)
+{
+  struct timespec deadline;
+  mthread_virtual_processor_t *vp;
+
+  while (1)
+  {
+    if (home->parked != NULL)
+    {
+      // Added: unless it was bound to another VP meanwhile
+      mthread_log("BLOCKING", "Thread %p back from VP %d\n", home->parked, home->origin->rank);
+      __mthread_wakeup_on(home->parked, home->origin);
+      home->parked = NULL;
+    }
+
+    pthread_mutex_lock(&spare_lock);
+    if (home->assigned == NULL)
+    {
+      home->next = spares;
+      spares = home;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += MTHREAD_SPARE_TIMEOUT;
+      while (home->assigned == NULL)
+      {
+        if (!retire)
+          pthread_cond_wait(&home->cond, &spare_lock);
+        else if (pthread_cond_timedwait(&home->cond, &spare_lock, &deadline) == ETIMEDOUT)
+          break;
+      }
+    }
+    if (home->assigned == NULL)
+    {
+      // Timed out while still in the pool: leave it
+      mthread_lwp_home_t **h;
+      for (h = &spares; *h != home; h = &((*h)->next))
+        ;
+      *h = home->next;
+      pthread_mutex_unlock(&spare_lock);
+      return;
+    }
+    vp = home->assigned;
+    home->assigned = NULL;
+    pthread_mutex_unlock(&spare_lock);
+
+    // Run VP from its idle task, mthread_blocking_end comes back here
+    mthread_log("BLOCKING", "Spare LWP takes over VP %d\n", vp->rank);
+    mthread_set_vp(vp);
+    home->has_ctx = 1;
+    swapcontext(&home->ctx, &(vp->idle->uc));
+  }
+}
+
+static void *mthread_spare_start(void *arg)
+{
+  mthread_lwp_home_t *home = (mthread_lwp_home_t *)arg;
+
+  pthread_once(&home_once, mthread_home_key_init);
+  pthread_setspecific(home_key, home);
+  mthread_spare_run(home, 1);
+
+  mthread_log("BLOCKING", "Spare LWP retired\n");
+  pthread_setspecific(home_key, NULL);
+  pthread_cond_destroy(&home->cond);
+  mthread_free(home);
+  return NULL;
+}
+
+// Entry of the home context of LWPs that were not created as spares
+static void mthread_home_start(void *arg)
+{
+  mthread_spare_run((mthread_lwp_home_t *)arg, 0);
+  // Only retiring spares return, the home context has nowhere to go back to
+  abort();
+}
+
+// Give VP to an unused spare LWP, creating one if needed
+static int mthread_spare_give(mthread_virtual_processor_t *vp)
+{
+  mthread_lwp_home_t *spare;
+  pthread_attr_t attr;
+  pthread_t pid;
+  int err;
+
+  pthread_mutex_lock(&spare_lock);
+  spare = spares;
+  if (spare != NULL)
+  {
+    spares = spare->next;
+    spare->assigned = vp;
+    pthread_cond_signal(&spare->cond);
+    pthread_mutex_unlock(&spare_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&spare_lock);
+
+  spare = mthread_home_new();
+  spare->assigned = vp;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create(&pid, &attr, mthread_spare_start, spare);
+  pthread_attr_destroy(&attr);
+  if (err != 0)
+  {
+    pthread_cond_destroy(&spare->cond);
+    mthread_free(spare);
+    return err;
+  }
+  mthread_log("BLOCKING", "New spare LWP for VP %d\n", vp->rank);
+  return 0;
+}
+
+void mthread_blocking_begin(void)
+{
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  mthread_lwp_home_t *home;
+  struct mthread_s *self;
+
+  // Not started yet, or already blocking: nothing to hand over
+  if (vp == NULL || vp->rank < 0)
+    return;
+
+  self = (struct mthread_s *)vp->current;
+
+  // Its frames are on the shared stack, which the VP would keep using
+  if (self->shared_stack)
+    return;
+
+  home = mthread_home_get();
+
+  // The VP must look idle before a spare resumes it
+  vp->current = vp->idle;
+  home->shadow.current = self;
+  home->origin = vp;
+  mthread_set_vp(&home->shadow);
+
+  if (mthread_spare_give(vp) != 0)
+  {
+    // No spare: block the VP as if nothing happened
+    mthread_set_vp(vp);
+    vp->current = self;
+    return;
+  }
+
+  __mthread_block_stat(vp, self, MTHREAD_WAIT_SYSCALL);
+  mthread_log("BLOCKING", "Thread %p left VP %d\n", self, vp->rank);
+}
+
+void mthread_blocking_end(void)
+{
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  mthread_lwp_home_t *home;
+  struct mthread_s *self;
+  int err = errno; /* errno is per LWP, and we may come back on another one */
+
+  if (vp == NULL || vp->rank >= 0)
+    return;
+
+  self = (struct mthread_s *)vp->current;
+  home = mthread_home_get();
+  home->parked = self;
+  mthread_set_vp(NULL);
+
+  if (!home->has_ctx)
+  {
+    // The native stack of this LWP is in use by mthread contexts
+    home->stack = safe_malloc(MTHREAD_HOME_STACK);
+    getcontext(&home->ctx);
+    home->ctx.uc_link = NULL;
+    home->ctx.uc_stack.ss_sp = home->stack;
+    home->ctx.uc_stack.ss_size = MTHREAD_HOME_STACK;
+    home->ctx.uc_stack.ss_flags = 0;
+    makecontext(&home->ctx, (void (*)(void))mthread_home_start, 1, home);
+    home->has_ctx = 1;
+  }
+
+  // Resumed by a VP that found us in its ready list
+  swapcontext(&(self->uc), &home->ctx);
+  __mthread_post_switch(mthread_get_vp());
+  errno = err;
+}
+
+// Added: cancellation points, checked before and after the call since the
+// LWP cannot be woken up meanwhile
+unsigned int mthread_sleep(unsigned int seconds)
+{
+  unsigned int res;
+  mthread_testcancel();
+  mthread_blocking_begin();
+  res = sleep(seconds);
+  mthread_blocking_end();
+  mthread_testcancel();
+  return res;
+}
+
+int mthread_usleep(unsigned int usec)
+{
+  int res;
+  mthread_testcancel();
+  mthread_blocking_begin();
+  res = usleep(usec);
+  mthread_blocking_end();
+  mthread_testcancel();
+  return res;
+}
+
+int mthread_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+  int res;
+  mthread_testcancel();
+  mthread_blocking_begin();
+  res = nanosleep(req, rem);
+  mthread_blocking_end();
+  mthread_testcancel();
+  return res;
+}
+
+// Added: only before, not to lose what was transferred
+ssize_t mthread_read(int fd, void *buf, size_t count)
+{
+  ssize_t res;
+  mthread_testcancel();
+  mthread_blocking_begin();
+  res = read(fd, buf, count);
+  mthread_blocking_end();
+  return res;
+}
+
+ssize_t mthread_write(int fd, const void *buf, size_t count)
+{
+  ssize_t res;
+  mthread_testcancel();
+  mthread_blocking_begin();
+  res = write(fd, buf, count);
+  mthread_blocking_end();
+  return res;
+}
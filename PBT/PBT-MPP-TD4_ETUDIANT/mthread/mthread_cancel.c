@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "mthread_internal.h"
+
+/* Functions for cancellation and deadlines.  */
+
+// Both end a wait early, by interrupting it. A thread about to wait on a
+// synchronization object records the lock and the queue of that object with
+// __mthread_wait_begin, under the lock. The interrupter takes the lock in
+// turn, takes the thread out of the queue if it is still there and wakes it
+// up with wait_error set. Meanwhile it holds the wait_guard of the thread,
+// which __mthread_wait_end takes before returning: the object cannot go
+// away under the interrupter. Nobody takes a guard with the lock of an
+// object held.
+//
+// Deadlines are kept in a heap ordered by expiry, polled after each switch
+// while it is not empty. The poller releases the heap before interrupting,
+// since waiters arm their timer with the lock of their object held: the
+// timer is marked as firing until the poller is done with the thread.
+
+static mthread_tst_t timer_lock = 0;
+static struct mthread_s **timers = NULL;
+static int nb_timers = 0;
+static int timers_size = 0;
+volatile unsigned long mthread_timer_next = ULONG_MAX; /* earliest deadline */
+
+static inline unsigned long mthread_cancel_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* Monotonic date of ABSTIME, a CLOCK_REALTIME date.  */
+unsigned long __mthread_deadline(const struct timespec *abstime)
+{
+  unsigned long now = mthread_cancel_now();
+  struct timespec real;
+  long delta;
+
+  clock_gettime(CLOCK_REALTIME, &real);
+  // Far enough to never expire, and no overflow
+  if (abstime->tv_sec - real.tv_sec > 1000000000L)
+    return ULONG_MAX - 1;
+  delta = (abstime->tv_sec - real.tv_sec) * 1000000000L + (abstime->tv_nsec - real.tv_nsec);
+  return delta > 0 ? now + delta : now;
+}
+
+static inline void mthread_timer_place(int i, struct mthread_s *th)
+{
+  timers[i] = th;
+  th->timer_index = i;
+}
+
+static void mthread_timer_up(int i)
+{
+  struct mthread_s *th = timers[i];
+
+  while (i > 0 && timers[(i - 1) / 2]->wait_deadline > th->wait_deadline)
+  {
+    mthread_timer_place(i, timers[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  mthread_timer_place(i, th);
+}
+
+static void mthread_timer_down(int i)
+{
+  struct mthread_s *th = timers[i];
+  int child;
+
+  while ((child = 2 * i + 1) < nb_timers)
+  {
+    if (child + 1 < nb_timers && timers[child + 1]->wait_deadline < timers[child]->wait_deadline)
+      child++;
+    if (timers[child]->wait_deadline >= th->wait_deadline)
+      break;
+    mthread_timer_place(i, timers[child]);
+    i = child;
+  }
+  mthread_timer_place(i, th);
+}
+
+// Take the timer at I out of the heap, timer_lock held
+static void mthread_timer_remove(int i)
+{
+  struct mthread_s *last = timers[--nb_timers];
+
+  timers[i]->timer_index = MTHREAD_TIMER_NONE;
+  if (i < nb_timers)
+  {
+    mthread_timer_place(i, last);
+    mthread_timer_down(i);
+    mthread_timer_up(last->timer_index);
+  }
+  mthread_timer_next = nb_timers > 0 ? timers[0]->wait_deadline : ULONG_MAX;
+}
+
+static void mthread_timer_arm(struct mthread_s *th)
+{
+  mthread_spinlock_lock(&timer_lock);
+  if (nb_timers == timers_size)
+  {
+    timers_size = timers_size ? 2 * timers_size : 64;
+    timers = realloc(timers, timers_size * sizeof(struct mthread_s *));
+    if (timers == NULL)
+    {
+      perror("realloc for the timers");
+      exit(ENOMEM);
+    }
+  }
+  mthread_timer_place(nb_timers, th);
+  nb_timers++;
+  mthread_timer_up(nb_timers - 1);
+  mthread_timer_next = timers[0]->wait_deadline;
+  mthread_spinlock_unlock(&timer_lock);
+}
+
+static void mthread_timer_disarm(struct mthread_s *th)
+{
+  mthread_spinlock_lock(&timer_lock);
+  if (th->timer_index >= 0)
+    mthread_timer_remove(th->timer_index);
+  mthread_spinlock_unlock(&timer_lock);
+
+  // Expired meanwhile: the poller may still be using TH
+  while (th->timer_index == MTHREAD_TIMER_FIRING)
+    ;
+}
+
+// Take TH out of the wait it is in, if any, and make that wait return ERR
+static void __mthread_interrupt(struct mthread_s *th, int err)
+{
+  mthread_tst_t *lock;
+  int unlinked = 0;
+
+  mthread_spinlock_lock(&th->wait_guard);
+  lock = th->wait_lock;
+  if (lock != NULL)
+  {
+    mthread_spinlock_lock(lock);
+    // TH sleeps if it is still queued, so its state cannot change meanwhile
+    if (err != ECANCELED || th->cancel_state == MTHREAD_CANCEL_ENABLE)
+    {
+      if (th->wait_queue != NULL)
+        unlinked = mthread_waitq_remove(th->wait_queue, th);
+      else if (th->wait_fired != NULL)
+        unlinked = __sync_bool_compare_and_swap(th->wait_fired, 0, MTHREAD_WAIT_INTERRUPTED);
+    }
+    if (unlinked)
+    {
+      mthread_log("CANCEL", "Thread %p interrupted (%d)\n", th, err);
+      th->wait_error = err;
+      __mthread_wakeup(th);
+    }
+    mthread_spinlock_unlock(lock);
+  }
+  mthread_spinlock_unlock(&th->wait_guard);
+}
+
+/* Interrupt the waits whose deadline is passed.  Called after a switch,
+   without any lock held.  */
+void __mthread_timer_poll()
+{
+  unsigned long now = mthread_cancel_now();
+  struct mthread_s *th;
+
+  // One poller at a time, the other VPs have better things to do
+  if (now < mthread_timer_next || mthread_test_and_set(&timer_lock))
+    return;
+
+  while (nb_timers > 0 && timers[0]->wait_deadline <= now)
+  {
+    th = timers[0];
+    mthread_timer_remove(0);
+    th->timer_index = MTHREAD_TIMER_FIRING;
+    mthread_spinlock_unlock(&timer_lock);
+
+    __mthread_interrupt(th, ETIMEDOUT);
+    __atomic_store_n(&th->timer_index, MTHREAD_TIMER_NONE, __ATOMIC_RELEASE);
+
+    mthread_spinlock_lock(&timer_lock);
+  }
+  mthread_spinlock_unlock(&timer_lock);
+}
+
+/* SELF, the calling thread, is about to wait in QUEUE, under LOCK which it
+   holds, until DEADLINE if not 0 or its own deadline.  Returns 0, or
+   ECANCELED or ETIMEDOUT if it must not wait.  In any case, the caller
+   releases LOCK, waits or not, then calls __mthread_wait_end.  */
+int __mthread_wait_begin(struct mthread_s *self, mthread_tst_t *lock, mthread_waitq_t *queue,
+                         unsigned long deadline)
+{
+  self->wait_queue = queue;
+  self->wait_fired = NULL;
+  self->wait_error = 0;
+  self->wait_deadline = 0;
+  self->wait_lock = lock;
+  // Either mthread_cancel sees wait_lock, or we see cancel_pending
+  __sync_synchronize();
+
+  if (self->cancel_pending && self->cancel_state == MTHREAD_CANCEL_ENABLE)
+  {
+    self->wait_error = ECANCELED;
+    return ECANCELED;
+  }
+
+  if (self->deadline != 0 && (deadline == 0 || self->deadline < deadline))
+    deadline = self->deadline;
+  if (deadline != 0)
+  {
+    if (mthread_cancel_now() >= deadline)
+    {
+      self->wait_error = ETIMEDOUT;
+      return ETIMEDOUT;
+    }
+    self->wait_deadline = deadline;
+    mthread_timer_arm(self);
+  }
+  return 0;
+}
+
+/* End the wait started by __mthread_wait_begin and return why it ended:
+   0 if SELF was woken up as usual.  */
+int __mthread_wait_end(struct mthread_s *self)
+{
+  if (self->wait_deadline != 0)
+    mthread_timer_disarm(self);
+
+  // An interrupter may still hold the object
+  mthread_spinlock_lock(&self->wait_guard);
+  self->wait_lock = NULL;
+  mthread_spinlock_unlock(&self->wait_guard);
+
+  return self->wait_error;
+}
+
+/* For the cancellation points that do not sleep in a queue: ECANCELED,
+   ETIMEDOUT or 0, as __mthread_wait_end.  */
+int __mthread_wait_poll(struct mthread_s *self)
+{
+  if (self == NULL)
+    return 0;
+  if (self->cancel_pending && self->cancel_state == MTHREAD_CANCEL_ENABLE)
+    return ECANCELED;
+  if (self->deadline != 0 && mthread_cancel_now() >= self->deadline)
+    return ETIMEDOUT;
+  return 0;
+}
+
+/* Exit if ERR, the end of a wait, is a cancellation, or return it.  */
+int __mthread_cancel_point(int err)
+{
+  if (err == ECANCELED)
+  {
+    mthread_log("CANCEL", "Thread %p canceled\n", mthread_self());
+    // The cleanup handlers may wait too
+    mthread_self()->cancel_state = MTHREAD_CANCEL_DISABLE;
+    mthread_exit(MTHREAD_CANCELED);
+  }
+  return err;
+}
+
+int mthread_cancel(mthread_t __th)
+{
+  mthread_log("CANCEL", "Cancel thread %p\n", __th);
+
+  if (__th == NULL)
+  {
+    return EINVAL;
+  }
+
+  __th->cancel_pending = 1;
+  __sync_synchronize();
+  __mthread_interrupt(__th, ECANCELED);
+  return 0;
+}
+
+void mthread_testcancel(void)
+{
+  mthread_t self = mthread_self();
+
+  if (self != NULL && self->cancel_pending && self->cancel_state == MTHREAD_CANCEL_ENABLE)
+  {
+    __mthread_cancel_point(ECANCELED);
+  }
+}
+
+int mthread_setcancelstate(int __state, int *__oldstate)
+{
+  mthread_t self;
+
+  if (__state != MTHREAD_CANCEL_ENABLE && __state != MTHREAD_CANCEL_DISABLE)
+  {
+    return EINVAL;
+  }
+
+  mthread_ensure_init();
+  self = mthread_self();
+  if (__oldstate != NULL)
+  {
+    *__oldstate = self->cancel_state;
+  }
+  self->cancel_state = __state;
+  return 0;
+}
+
+int mthread_setdeadline(const struct timespec *__abstime)
+{
+  mthread_t self;
+
+  if (__abstime != NULL && (__abstime->tv_nsec < 0 || __abstime->tv_nsec >= 1000000000L))
+  {
+    return EINVAL;
+  }
+
+  mthread_ensure_init();
+  self = mthread_self();
+  self->deadline = __abstime != NULL ? __mthread_deadline(__abstime) : 0;
+  mthread_log("CANCEL", "Thread %p deadline %lu\n", self, self->deadline);
+  return 0;
+}
+
+/* Functions for cleanup handlers.  */
+
+void __mthread_cleanup_push(struct mthread_cleanup_s *__cleanup, void (*__routine)(void *), void *__arg)
+{
+  mthread_t self;
+
+  mthread_ensure_init();
+  self = mthread_self();
+  __cleanup->routine = __routine;
+  __cleanup->arg = __arg;
+  __cleanup->prev = self->cleanup;
+  self->cleanup = __cleanup;
+}
+
+void __mthread_cleanup_pop(struct mthread_cleanup_s *__cleanup, int __execute)
+{
+  mthread_self()->cleanup = __cleanup->prev;
+  if (__execute)
+  {
+    __cleanup->routine(__cleanup->arg);
+  }
+}
+
+/* Run the handlers TH left, it is exiting.  */
+void __mthread_cleanup_run(struct mthread_s *th)
+{
+  struct mthread_cleanup_s *cleanup;
+
+  while ((cleanup = th->cleanup) != NULL)
+  {
+    th->cleanup = cleanup->prev;
+    cleanup->routine(cleanup->arg);
+  }
+}
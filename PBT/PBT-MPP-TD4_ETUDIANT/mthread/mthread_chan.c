@@ -0,0 +1,365 @@
+#include <errno.h>
+#include <string.h>
+
+#include "mthread_internal.h"
+
+/* Functions for handling channels.  */
+
+// The ring buffer and both wait queues are protected by chan->lock. A thread
+// blocking on the channel keeps the lock until it is switched out (vp->p), so
+// a waker holding the lock always finds fully parked threads in the queues.
+// A blocked thread describes its pending transfer with wait_buf/wait_n, which
+// lets the other side copy items directly from or into its buffer, or from
+// or into a copy for a shared stack thread, see mthread_shared.c. A sender
+// that fed a waiting receiver switches to it with mthread_yield_to. A
+// thread canceled or timed out is taken out of its queue with its transfer
+// unfinished, by whoever interrupts it, see mthread_cancel.c.
+
+static inline unsigned int __mthread_chan_min(unsigned int a, unsigned int b)
+{
+  return a < b ? a : b;
+}
+
+// Copy up to N items from SRC at the tail of the ring, return the number copied
+static unsigned int __mthread_chan_push(mthread_chan_t *chan, const char *src, unsigned int n)
+{
+  unsigned int k = __mthread_chan_min(n, chan->capacity - chan->count);
+  unsigned int tail = (chan->head + chan->count) % (chan->capacity ? chan->capacity : 1);
+  unsigned int first = __mthread_chan_min(k, chan->capacity - tail);
+
+  if (k == 0)
+    return 0;
+
+  memcpy(chan->buffer + (size_t)tail * chan->elem_size, src, (size_t)first * chan->elem_size);
+  memcpy(chan->buffer, src + (size_t)first * chan->elem_size, (size_t)(k - first) * chan->elem_size);
+  chan->count += k;
+  return k;
+}
+
+// Copy up to N items from the head of the ring into DST, return the number copied
+static unsigned int __mthread_chan_pop(mthread_chan_t *chan, char *dst, unsigned int n)
+{
+  unsigned int k = __mthread_chan_min(n, chan->count);
+  unsigned int first = __mthread_chan_min(k, chan->capacity - chan->head);
+
+  if (k == 0)
+    return 0;
+
+  memcpy(dst, chan->buffer + (size_t)chan->head * chan->elem_size, (size_t)first * chan->elem_size);
+  memcpy(dst + (size_t)first * chan->elem_size, chan->buffer, (size_t)(k - first) * chan->elem_size);
+  chan->head = (chan->head + k) % chan->capacity;
+  chan->count -= k;
+  return k;
+}
+
+// Park the current thread on QUEUE. Must be called with chan->lock held, the
+// lock is released once the thread is switched out and taken back on return.
+// Returns ECANCELED or ETIMEDOUT if it was not woken up by the other side.
+static int __mthread_chan_block(mthread_chan_t *chan, mthread_waitq_t *queue, void *buf, unsigned int n)
+{
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  mthread_t self = (mthread_t)vp->current;
+  size_t size = (size_t)n * chan->elem_size;
+  void *bounce = NULL;
+  int err;
+
+  // The frames of a shared stack thread are copied out while it sleeps, the
+  // other side must not touch them: it works on a copy on the heap instead
+  if (self->shared_stack)
+  {
+    bounce = safe_malloc(size);
+    if (queue == &chan->send_queue)
+      memcpy(bounce, buf, size);
+  }
+
+  self->wait_buf = bounce != NULL ? bounce : buf;
+  self->wait_n = n;
+  if (__mthread_wait_begin(self, &chan->lock, queue, 0) == 0)
+  {
+    mthread_waitq_push(queue, self);
+    self->status = BLOCKED;
+    __mthread_block_stat(vp, self, MTHREAD_WAIT_CHAN);
+    vp->p = &chan->lock;
+    __mthread_yield(vp);
+  }
+  else
+  {
+    mthread_spinlock_unlock(&chan->lock);
+  }
+  err = __mthread_wait_end(self);
+
+  mthread_spinlock_lock(&chan->lock);
+  if (bounce != NULL)
+  {
+    if (queue == &chan->recv_queue)
+      memcpy(buf, bounce, (size_t)(n - self->wait_n) * chan->elem_size);
+    mthread_free(bounce);
+  }
+  return err;
+}
+
+static int __mthread_chan_send(mthread_chan_t *chan, const char *src, unsigned int n, int block)
+{
+  struct mthread_s *th;
+  struct mthread_s *handoff = NULL;
+  unsigned int k;
+  int err;
+
+  mthread_spinlock_lock(&chan->lock);
+
+  if (chan->closed)
+  {
+    mthread_spinlock_unlock(&chan->lock);
+    return EPIPE;
+  }
+
+  while (n > 0)
+  {
+    // Receivers only wait on an empty ring: give them the items directly
+    th = mthread_waitq_pop(&chan->recv_queue);
+    if (th != NULL)
+    {
+      k = __mthread_chan_min(n, th->wait_n);
+      memcpy(th->wait_buf, src, (size_t)k * chan->elem_size);
+      th->wait_n -= k;
+      src += (size_t)k * chan->elem_size;
+      n -= k;
+      __mthread_wakeup(th);
+      handoff = th;
+      continue;
+    }
+
+    k = __mthread_chan_push(chan, src, n);
+    src += (size_t)k * chan->elem_size;
+    n -= k;
+    if (n == 0)
+      break;
+
+    if (!block)
+    {
+      mthread_spinlock_unlock(&chan->lock);
+      return EBUSY;
+    }
+
+    // Full: receivers will pull the remaining items straight from src
+    handoff = NULL;
+    err = __mthread_chan_block(chan, &chan->send_queue, (void *)src, n);
+    if (err != 0 || mthread_self()->wait_n != 0)
+    {
+      mthread_spinlock_unlock(&chan->lock);
+      return __mthread_cancel_point(err != 0 ? err : EPIPE);
+    }
+    n = 0;
+  }
+
+  mthread_spinlock_unlock(&chan->lock);
+
+  // Let the receiver we just fed run right away
+  if (handoff != NULL)
+    mthread_yield_to(handoff);
+
+  return 0;
+}
+
+static int __mthread_chan_recv(mthread_chan_t *chan, char *dst, unsigned int n, unsigned int *received, int block)
+{
+  struct mthread_s *th;
+  unsigned int got = 0;
+  unsigned int k;
+  int err;
+
+  mthread_spinlock_lock(&chan->lock);
+
+  for (;;)
+  {
+    got += __mthread_chan_pop(chan, dst + (size_t)got * chan->elem_size, n - got);
+
+    // Refill the ring (or dst for unbuffered channels) from blocked senders
+    th = chan->send_queue.first;
+    if (th == NULL)
+      break;
+
+    if (chan->capacity == 0)
+    {
+      k = __mthread_chan_min(n - got, th->wait_n);
+      memcpy(dst + (size_t)got * chan->elem_size, th->wait_buf, (size_t)k * chan->elem_size);
+      got += k;
+    }
+    else
+    {
+      k = __mthread_chan_push(chan, th->wait_buf, th->wait_n);
+    }
+    if (k == 0)
+      break;
+
+    th->wait_buf = (char *)th->wait_buf + (size_t)k * chan->elem_size;
+    th->wait_n -= k;
+    if (th->wait_n == 0)
+    {
+      mthread_waitq_pop(&chan->send_queue);
+      __mthread_wakeup(th);
+    }
+  }
+
+  if (got == 0)
+  {
+    if (chan->closed)
+    {
+      mthread_spinlock_unlock(&chan->lock);
+      return EPIPE;
+    }
+
+    if (!block)
+    {
+      mthread_spinlock_unlock(&chan->lock);
+      return EBUSY;
+    }
+
+    // Empty: the next sender copies directly into dst and wakes us up
+    err = __mthread_chan_block(chan, &chan->recv_queue, dst, n);
+    got = n - mthread_self()->wait_n;
+    if (err != 0 || got == 0)
+    {
+      mthread_spinlock_unlock(&chan->lock);
+      return __mthread_cancel_point(err != 0 ? err : EPIPE);
+    }
+  }
+
+  mthread_spinlock_unlock(&chan->lock);
+
+  if (received != NULL)
+    *received = got;
+  return 0;
+}
+
+int mthread_chan_init(mthread_chan_t *chan, unsigned int elem_size, unsigned int capacity)
+{
+  mthread_log("CHAN INIT", "Initializing\n");
+
+  if (chan == NULL || elem_size == 0)
+  {
+    mthread_log("CHAN INIT", "Returning EINVAL\n");
+    return EINVAL;
+  }
+
+  chan->lock = 0;
+  chan->elem_size = elem_size;
+  chan->capacity = capacity;
+  chan->head = 0;
+  chan->count = 0;
+  chan->closed = 0;
+  chan->buffer = capacity ? safe_malloc((size_t)capacity * elem_size) : NULL;
+
+  chan->send_queue = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+  chan->recv_queue = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+
+  mthread_log("CHAN INIT", "Initialized\n");
+  return 0;
+}
+
+int mthread_chan_destroy(mthread_chan_t *chan)
+{
+  mthread_log("CHAN DESTROY", "Destroying\n");
+
+  if (chan == NULL)
+  {
+    mthread_log("CHAN DESTROY", "Chan was NULL\n");
+    return EINVAL;
+  }
+
+  mthread_spinlock_lock(&chan->lock);
+
+  if (chan->send_queue.first != NULL || chan->recv_queue.first != NULL)
+  {
+    mthread_spinlock_unlock(&chan->lock);
+    mthread_log("CHAN DESTROY", "Returning EBUSY\n");
+    return EBUSY;
+  }
+
+  mthread_free(chan->buffer);
+  chan->buffer = NULL;
+
+  mthread_spinlock_unlock(&chan->lock);
+
+  mthread_log("CHAN DESTROY", "Destroyed\n");
+  return 0;
+}
+
+int mthread_chan_close(mthread_chan_t *chan)
+{
+  struct mthread_s *th;
+
+  mthread_log("CHAN CLOSE", "Closing\n");
+
+  if (chan == NULL)
+  {
+    mthread_log("CHAN CLOSE", "Chan was NULL\n");
+    return EINVAL;
+  }
+
+  mthread_spinlock_lock(&chan->lock);
+
+  chan->closed = 1;
+  // Waiters see their wait_n untouched and return EPIPE
+  while ((th = mthread_waitq_pop(&chan->recv_queue)) != NULL)
+    __mthread_wakeup(th);
+  while ((th = mthread_waitq_pop(&chan->send_queue)) != NULL)
+    __mthread_wakeup(th);
+
+  mthread_spinlock_unlock(&chan->lock);
+
+  mthread_log("CHAN CLOSE", "Closed\n");
+  return 0;
+}
+
+int mthread_chan_send(mthread_chan_t *chan, const void *item)
+{
+  return mthread_chan_send_n(chan, item, 1);
+}
+
+int mthread_chan_recv(mthread_chan_t *chan, void *item)
+{
+  return mthread_chan_recv_n(chan, item, 1, NULL);
+}
+
+int mthread_chan_trysend(mthread_chan_t *chan, const void *item)
+{
+  if (chan == NULL || item == NULL)
+    return EINVAL;
+
+  return __mthread_chan_send(chan, item, 1, 0);
+}
+
+int mthread_chan_tryrecv(mthread_chan_t *chan, void *item)
+{
+  if (chan == NULL || item == NULL)
+    return EINVAL;
+
+  return __mthread_chan_recv(chan, item, 1, NULL, 0);
+}
+
+int mthread_chan_send_n(mthread_chan_t *chan, const void *items, unsigned int n)
+{
+  mthread_log("CHAN SEND", "Sending %u items\n", n);
+
+  if (chan == NULL || items == NULL)
+  {
+    mthread_log("CHAN SEND", "Arg was NULL\n");
+    return EINVAL;
+  }
+
+  return __mthread_chan_send(chan, items, n, 1);
+}
+
+int mthread_chan_recv_n(mthread_chan_t *chan, void *items, unsigned int n, unsigned int *received)
+{
+  mthread_log("CHAN RECV", "Receiving up to %u items\n", n);
+
+  if (chan == NULL || items == NULL || n == 0)
+  {
+    mthread_log("CHAN RECV", "Returning EINVAL\n");
+    return EINVAL;
+  }
+
+  return __mthread_chan_recv(chan, items, n, received, 1);
+}
@@ -4,26 +4,6 @@
 
 /* Functions for handling conditional variables.  */
 
-int __mthread_cond_unchecked_ensure_thread_queue_init(mthread_cond_t *cond)
-{
-  if (cond->thread_queue != NULL || cond->lock != 0)
-    return EINVAL;
-
-  mthread_log("COND ENSURE THREAD", "Initializing\n");
-
-  cond->thread_queue = malloc(sizeof(mthread_list_t));
-  if (cond->thread_queue == NULL)
-  {
-    perror("malloc for cond internal thread queue");
-    exit(errno);
-  }
-
-  *(cond->thread_queue) = (mthread_list_t)MTHREAD_LIST_INIT;
-
-  mthread_log("COND ENSURE THREAD", "Initialized\n");
-  return 0;
-}
-
 /* Initialize condition variable COND using attributes ATTR, or use
      the default values if later is NULL.  */
 int mthread_cond_init(mthread_cond_t *cond, const mthread_condattr_t *cond_attr)
@@ -37,62 +17,100 @@ int mthread_cond_init(mthread_cond_t *cond, const mthread_condattr_t *cond_attr)
   }
 
   cond->lock = 0;
-
-  __mthread_cond_unchecked_ensure_thread_queue_init(cond);
+  cond->queue = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
 
   mthread_log("COND INIT", "Initialized\n");
   return 0;
 }
 
-/* Wait for condition variable COND to be signaled or broadcast.
-     MUTEX is assumed to be locked before.  */
-int mthread_cond_wait(mthread_cond_t *cond, mthread_mutex_t *mutex)
+// Added: also woken up once DEADLINE is passed, if not 0, or when canceled
+static int __mthread_cond_wait(mthread_cond_t *cond, mthread_mutex_t *mutex, unsigned long deadline)
 {
-  mthread_log("COND WAIT", "Waiting\n");
-  if (cond == NULL || mutex == NULL)
-  {
-    mthread_log("COND WAIT", "Arg was NULL\n");
-    return EINVAL;
-  }
-
-  __mthread_cond_unchecked_ensure_thread_queue_init(cond);
-
   mthread_spinlock_lock(&cond->lock);
 
   mthread_virtual_processor_t *vp = mthread_get_vp();
 
   // Added: saving the previous state, to ensure the rollback is possible if necessary
-  volatile struct mthread_s *prev_last = cond->thread_queue->last;
   mthread_tst_t *prev_lock = vp->p;
 
-  // Added: blocking the current thread
   mthread_t self = mthread_self();
+  if (__mthread_wait_begin(self, &cond->lock, &cond->queue, deadline) != 0)
+  {
+    // Already canceled or timed out, the mutex stays locked
+    mthread_spinlock_unlock(&cond->lock);
+    return __mthread_cancel_point(__mthread_wait_end(self));
+  }
+
+  // Added: blocking the current thread
   self->status = BLOCKED;
   vp->p = &cond->lock;
+  __mthread_block_stat(vp, self, MTHREAD_WAIT_COND);
 
   // Added: inserting the current thread at the end of the waiting list for the cond
-  mthread_insert_last(self, cond->thread_queue);
+  mthread_waitq_push(&cond->queue, self);
 
   // Added: unlocking the mutex and, in case there was an error, rollback the changes
-  int err = mthread_mutex_unlock(mutex);
+  struct mthread_s *woken;
+  int err = __mthread_mutex_unlock(mutex, &woken);
   if (err != 0)
   {
     self->status = RUNNING;
-    cond->thread_queue->last = prev_last;
-    prev_last->next = NULL;
+    mthread_waitq_remove(&cond->queue, self);
     vp->p = prev_lock;
     mthread_spinlock_unlock(&cond->lock);
+    __mthread_wait_end(self);
     mthread_log("COND WAIT", "Error unlocking mutex\n");
     return err;
   }
 
-  mthread_spinlock_unlock(&cond->lock);
-
-  mthread_yield();
+  // The cond lock is released once we are switched out, and we switch
+  // directly to the thread the mutex was handed to, if any
+  if (woken != NULL)
+  {
+    __mthread_yield_to(vp, woken);
+  }
+  else
+  {
+    mthread_yield();
+  }
+  err = __mthread_wait_end(self);
 
   // Added: relocking the mutex before exiting the function, returning the result
   mthread_log("COND WAIT", "Waited\n");
-  return mthread_mutex_lock(mutex);
+  if (err == 0)
+  {
+    return mthread_mutex_lock(mutex);
+  }
+  mthread_mutex_lock(mutex);
+  return __mthread_cancel_point(err);
+}
+
+/* Wait for condition variable COND to be signaled or broadcast.
+     MUTEX is assumed to be locked before.  */
+int mthread_cond_wait(mthread_cond_t *cond, mthread_mutex_t *mutex)
+{
+  mthread_log("COND WAIT", "Waiting\n");
+  if (cond == NULL || mutex == NULL)
+  {
+    mthread_log("COND WAIT", "Arg was NULL\n");
+    return EINVAL;
+  }
+
+  return __mthread_cond_wait(cond, mutex, 0);
+}
+
+/* Same as mthread_cond_wait, until ABSTIME at most.  */
+int mthread_cond_timedwait(mthread_cond_t *cond, mthread_mutex_t *mutex, const struct timespec *abstime)
+{
+  mthread_log("COND TIMEDWAIT", "Waiting\n");
+  if (cond == NULL || mutex == NULL || abstime == NULL ||
+      abstime->tv_nsec < 0 || abstime->tv_nsec >= 1000000000L)
+  {
+    mthread_log("COND TIMEDWAIT", "Returning EINVAL\n");
+    return EINVAL;
+  }
+
+  return __mthread_cond_wait(cond, mutex, __mthread_deadline(abstime));
 }
 
 /* Wake up one thread waiting for condition variable COND.  */
@@ -105,12 +123,10 @@ int mthread_cond_signal(mthread_cond_t *cond)
     return EINVAL;
   }
 
-  __mthread_cond_unchecked_ensure_thread_queue_init(cond);
-
   mthread_spinlock_lock(&cond->lock);
 
   // Added: get the first thread to wait, which is also the first we will signal
-  struct mthread_s *th = mthread_remove_first(cond->thread_queue);
+  struct mthread_s *th = mthread_waitq_pop(&cond->queue);
 
   // Added: ensure there is at least one waiting thread
   if (th == NULL)
@@ -120,12 +136,14 @@ int mthread_cond_signal(mthread_cond_t *cond)
     return EINVAL;
   }
 
-  mthread_virtual_processor_t *vp = mthread_get_vp();
-  th->status = RUNNING;
-  mthread_insert_last(th, &(vp->ready_list));
+  __mthread_wakeup(th);
 
   mthread_spinlock_unlock(&cond->lock);
 
+#ifdef MTHREAD_WAKE_HANDOFF
+  mthread_yield_to(th);
+#endif
+
   mthread_log("COND SIGNAL", "Signaled\n");
   return 0;
 }
@@ -140,17 +158,13 @@ int mthread_cond_broadcast(mthread_cond_t *cond)
     return EINVAL;
   }
 
-  __mthread_cond_unchecked_ensure_thread_queue_init(cond);
-
   mthread_spinlock_lock(&cond->lock);
 
   // Added: get all the threads, one after the other, and set them to running.
-  mthread_virtual_processor_t *vp = mthread_get_vp();
   struct mthread_s *th = NULL;
-  while ((th = mthread_remove_first(cond->thread_queue)) != NULL)
+  while ((th = mthread_waitq_pop(&cond->queue)) != NULL)
   {
-    th->status = RUNNING;
-    mthread_insert_last(th, &(vp->ready_list));
+    __mthread_wakeup(th);
   }
 
   mthread_spinlock_unlock(&cond->lock);
@@ -172,21 +186,13 @@ int mthread_cond_destroy(mthread_cond_t *cond)
 
   mthread_spinlock_lock(&cond->lock);
 
-  if (cond->thread_queue != NULL && cond->thread_queue->first != NULL)
+  if (cond->queue.first != NULL)
   {
     mthread_spinlock_unlock(&cond->lock);
     mthread_log("COND DESTROY", "Returning EBUSY\n");
     return EBUSY;
   }
 
-  // The queue is free but not it's members: they may be used elsewhere,
-  // for another conditions for example
-  if (cond->thread_queue != NULL)
-  {
-    free(cond->thread_queue);
-    cond->thread_queue = NULL;
-  }
-
   mthread_spinlock_unlock(&cond->lock);
 
   mthread_log("COND DESTROY", "Destroying\n");
@@ -16,7 +16,7 @@ void __not_implemented(const char *func, char *file, int line)
 void *safe_malloc(size_t size)
 {
   void *tmp;
-  tmp = malloc(size);
+  tmp = mthread_malloc(size);
   assert(tmp != NULL);
   return tmp;
 }
@@ -29,6 +29,9 @@ static FILE *mthread_output_log = NULL;
 
 int mthread_log_init()
 {
+#ifdef MTHREAD_NO_LOG
+  return 0;
+#endif
   // Added: static initialization for the logs
   if (mthread_output_log == NULL)
   {
@@ -41,6 +44,10 @@ int mthread_log_init()
 
 int mthread_log(char *part, const char *format, ...)
 {
+#ifdef MTHREAD_NO_LOG
+  // Added: the benchmark build measures the scheduler, not the log file
+  return 0;
+#endif
   // Added: ensure log initialization
   mthread_log_init();
   char msg[4096];
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mthread_internal.h"
+
+/* Functions for scheduler domains.  */
+
+// An idle VP steals from the VPs closest to it first: those sharing its
+// core, then its last level cache, then its NUMA node, then the rest of the
+// machine. The domain of a VP at each level is named by the first CPU of
+// that domain, read from sysfs once its LWP runs, or by its node. Only an
+// LWP bound to its CPU (MTHREAD_BIND) has a known core and cache, another
+// one may run anywhere: its VP starts from its node, or from the machine
+// when that is not known either. It only looks one level further after
+// MTHREAD_STEAL_ESCALATE rounds in a row found nothing, and comes back to
+// the closest level it knows once it found something. A victim must hold
+// at least the threshold of its level in its ready list, 1 by default and
+// 2 across nodes, so that a light imbalance is left to the VPs nearby:
+// MTHREAD_STEAL_THRESHOLDS=CORE,CACHE,NODE,MACHINE. A VP that only knows
+// the machine has nobody nearby, it steals from 1.
+
+int mthread_domain_threshold[MTHREAD_NB_DOMAINS] = {1, 1, 1, 2};
+int mthread_domain_escalate = 4;
+
+void mthread_domain_init()
+{
+  char *env;
+  int level;
+
+  env = getenv("MTHREAD_STEAL_THRESHOLDS");
+  for (level = 0; env != NULL && level < MTHREAD_NB_DOMAINS; level++)
+  {
+    if (atoi(env) > 0)
+      mthread_domain_threshold[level] = atoi(env);
+    env = strchr(env, ',');
+    if (env != NULL)
+      env++;
+  }
+
+  env = getenv("MTHREAD_STEAL_ESCALATE");
+  if (env != NULL && atoi(env) >= 0)
+    mthread_domain_escalate = atoi(env);
+
+  mthread_log("DOMAIN", "Thresholds %d,%d,%d,%d, escalate after %d failures\n", mthread_domain_threshold[0],
+              mthread_domain_threshold[1], mthread_domain_threshold[2], mthread_domain_threshold[3],
+              mthread_domain_escalate);
+}
+
+// First CPU of the list in the sysfs file PATH, -1 if there is none
+static int mthread_domain_first_cpu(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  int cpu = -1;
+
+  if (f == NULL)
+    return -1;
+  if (fscanf(f, "%d", &cpu) != 1)
+    cpu = -1;
+  fclose(f);
+  return cpu;
+}
+
+// First CPU sharing the last level cache of CPU
+static int mthread_domain_cache(int cpu)
+{
+  char path[96];
+  FILE *f;
+  int best = 0;
+  int level;
+  int index;
+  int first = -1;
+
+  for (index = 0; index < 10; index++)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+    f = fopen(path, "r");
+    if (f == NULL)
+      break;
+    if (fscanf(f, "%d", &level) == 1 && level > best)
+    {
+      snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+      best = level;
+      first = mthread_domain_first_cpu(path);
+    }
+    fclose(f);
+  }
+  return first;
+}
+
+/* Find out the domains of VP, from the calling LWP which runs it.  */
+void mthread_domain_lwp_init(mthread_virtual_processor_t *vp)
+{
+  char path[96];
+  int cpu = mthread_numa_bind ? sched_getcpu() : -1;
+  int level;
+
+  if (cpu >= 0)
+  {
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+    vp->domain[MTHREAD_DOMAIN_CORE] = mthread_domain_first_cpu(path);
+    vp->domain[MTHREAD_DOMAIN_CACHE] = mthread_domain_cache(cpu);
+  }
+  vp->domain[MTHREAD_DOMAIN_NODE] = vp->node;
+  vp->domain[MTHREAD_DOMAIN_MACHINE] = 0;
+  for (level = 0; vp->domain[level] < 0; level++)
+    ;
+  vp->steal_first = level;
+  vp->steal_level = level;
+  mthread_log("DOMAIN", "VP %d: core %d, cache %d, node %d\n", vp->rank, vp->domain[MTHREAD_DOMAIN_CORE],
+              vp->domain[MTHREAD_DOMAIN_CACHE], vp->domain[MTHREAD_DOMAIN_NODE]);
+}
@@ -0,0 +1,292 @@
+#include <errno.h>
+
+#include "mthread_internal.h"
+
+/* Functions for handling futures.  */
+
+// A thread waiting on several futures registers one waiter record per
+// future, all pointing to the same 'fired' word. The first completion to
+// claim that word wakes the thread, the other ones ignore the record.
+// The records live on the waiting thread's stack, or on the heap past
+// MTHREAD_FUTURE_STACK_WAITERS futures or for a shared stack thread, whose
+// frames move while it sleeps: it keeps its private wait_lock until
+// it is switched out, and a completer takes that lock before making it
+// runnable again, exactly like the mutex and channel queues.
+// Canceling the thread or its deadline claim the word too.
+#define MTHREAD_FUTURE_STACK_WAITERS 16
+
+struct mthread_future_waiter_s
+{
+  struct mthread_s *thread;
+  mthread_tst_t *wait_lock;
+  volatile unsigned int *fired; /* index + 1 of the future that fired */
+  unsigned int index;
+  struct mthread_future_waiter_s *next;
+};
+
+// What a waiting thread shares with the completers
+struct mthread_future_wait_s
+{
+  mthread_tst_t lock;
+  volatile unsigned int fired;
+  struct mthread_future_waiter_s waiters[];
+};
+
+struct mthread_future_s
+{
+  volatile mthread_tst_t lock;
+  volatile int done;
+  void *res;
+  void *(*__start_routine)(void *);
+  void *arg;
+  struct mthread_future_waiter_s *waiters;
+};
+
+static void __mthread_future_complete(mthread_future_t future, void *res)
+{
+  struct mthread_future_waiter_s *w;
+  struct mthread_future_waiter_s *wake = NULL;
+
+  mthread_spinlock_lock(&future->lock);
+  future->res = res;
+  future->done = 1;
+
+  // Claim the waiters under the lock, wake them once it is released
+  w = future->waiters;
+  future->waiters = NULL;
+  while (w != NULL)
+  {
+    struct mthread_future_waiter_s *next = w->next;
+    if (__sync_bool_compare_and_swap(w->fired, 0, w->index + 1))
+    {
+      w->next = wake;
+      wake = w;
+    }
+    w = next;
+  }
+  mthread_spinlock_unlock(&future->lock);
+
+  while (wake != NULL)
+  {
+    struct mthread_s *th = wake->thread;
+    mthread_tst_t *wait_lock = wake->wait_lock;
+
+    wake = wake->next;
+
+    // Wait for the thread to be switched out, its records may go away after
+    mthread_spinlock_lock(wait_lock);
+    mthread_spinlock_unlock(wait_lock);
+
+    mthread_log("FUTURE", "Waking %p\n", th);
+    __mthread_wakeup(th);
+  }
+}
+
+static void *__mthread_future_start(void *arg)
+{
+  mthread_future_t future = (mthread_future_t)arg;
+  mthread_detach(mthread_self());
+  __mthread_future_complete(future, future->__start_routine(future->arg));
+  return NULL;
+}
+
+static void __mthread_future_unregister(mthread_future_t future, struct mthread_future_waiter_s *waiter)
+{
+  struct mthread_future_waiter_s **w;
+
+  mthread_spinlock_lock(&future->lock);
+  for (w = &future->waiters; *w != NULL; w = &((*w)->next))
+  {
+    if (*w == waiter)
+    {
+      *w = waiter->next;
+      break;
+    }
+  }
+  mthread_spinlock_unlock(&future->lock);
+}
+
+mthread_future_t mthread_async(void *(*__start_routine)(void *), void *__arg)
+{
+  mthread_future_t future;
+  mthread_t th;
+
+  future = (mthread_future_t)safe_malloc(sizeof(struct mthread_future_s));
+  future->lock = 0;
+  future->done = 0;
+  future->res = NULL;
+  future->__start_routine = __start_routine;
+  future->arg = __arg;
+  future->waiters = NULL;
+
+  mthread_create(&th, NULL, __mthread_future_start, future);
+  mthread_log("FUTURE", "Future %p runs in thread %p\n", future, th);
+
+  return future;
+}
+
+int mthread_future_wait_any(mthread_future_t *futures, unsigned int n, unsigned int *index)
+{
+  struct mthread_future_waiter_s stack_waiters[MTHREAD_FUTURE_STACK_WAITERS];
+  struct mthread_future_wait_s stack_wait;
+  struct mthread_future_wait_s *wait = &stack_wait;
+  struct mthread_future_waiter_s *waiters = stack_waiters;
+  mthread_virtual_processor_t *vp;
+  mthread_t self;
+  unsigned int fired;
+  unsigned int registered;
+  unsigned int i;
+  int err = 0;
+
+  mthread_log("FUTURE WAIT", "Waiting for %u futures\n", n);
+
+  if (futures == NULL || n == 0)
+  {
+    mthread_log("FUTURE WAIT", "Returning EINVAL\n");
+    return EINVAL;
+  }
+
+  self = mthread_self();
+  if (n > MTHREAD_FUTURE_STACK_WAITERS || self->shared_stack)
+  {
+    wait = (struct mthread_future_wait_s *)safe_malloc(sizeof(struct mthread_future_wait_s) +
+                                                       n * sizeof(struct mthread_future_waiter_s));
+    waiters = wait->waiters;
+  }
+  wait->lock = 0;
+  wait->fired = 0;
+  mthread_spinlock_lock(&(wait->lock));
+
+  for (registered = 0; registered < n; registered++)
+  {
+    mthread_future_t future = futures[registered];
+
+    mthread_spinlock_lock(&future->lock);
+    if (future->done)
+    {
+      mthread_spinlock_unlock(&future->lock);
+      __sync_bool_compare_and_swap(&(wait->fired), 0, registered + 1);
+      break;
+    }
+    waiters[registered].thread = self;
+    waiters[registered].wait_lock = &(wait->lock);
+    waiters[registered].fired = &(wait->fired);
+    waiters[registered].index = registered;
+    waiters[registered].next = future->waiters;
+    future->waiters = &(waiters[registered]);
+    mthread_spinlock_unlock(&future->lock);
+  }
+
+  if (registered == n || wait->fired != registered + 1)
+  {
+    if (__mthread_wait_begin(self, &(wait->lock), NULL, 0) != 0 &&
+        __sync_bool_compare_and_swap(&(wait->fired), 0, MTHREAD_WAIT_INTERRUPTED))
+    {
+      mthread_spinlock_unlock(&(wait->lock));
+    }
+    else
+    {
+      // Nothing was done yet, or a completer claimed us first and will wake
+      // us: then we were not interrupted
+      self->wait_error = 0;
+      self->wait_fired = &(wait->fired);
+      vp = mthread_get_vp();
+      self->status = BLOCKED;
+      __mthread_block_stat(vp, self, MTHREAD_WAIT_FUTURE);
+      vp->p = &(wait->lock);
+      __mthread_yield(vp);
+    }
+    err = __mthread_wait_end(self);
+  }
+  else
+  {
+    mthread_spinlock_unlock(&(wait->lock));
+  }
+
+  for (i = 0; i < registered; i++)
+  {
+    __mthread_future_unregister(futures[i], &(waiters[i]));
+  }
+  fired = wait->fired;
+  if (wait != &stack_wait)
+  {
+    mthread_free(wait);
+  }
+
+  if (err != 0)
+  {
+    mthread_log("FUTURE WAIT", "Interrupted\n");
+    return __mthread_cancel_point(err);
+  }
+
+  if (index != NULL)
+  {
+    *index = fired - 1;
+  }
+
+  mthread_log("FUTURE WAIT", "Future %u completed\n", fired - 1);
+  return 0;
+}
+
+int mthread_future_wait_all(mthread_future_t *futures, unsigned int n)
+{
+  unsigned int i;
+
+  if (futures == NULL)
+    return EINVAL;
+
+  for (i = 0; i < n; i++)
+  {
+    if (!futures[i]->done)
+    {
+      int err = mthread_future_wait_any(&(futures[i]), 1, NULL);
+      if (err != 0)
+        return err;
+    }
+  }
+  return 0;
+}
+
+int mthread_future_get(mthread_future_t future, void **result)
+{
+  if (future == NULL)
+    return EINVAL;
+
+  if (!future->done)
+  {
+    int err = mthread_future_wait_any(&future, 1, NULL);
+    if (err != 0)
+      return err;
+  }
+
+  if (result != NULL)
+  {
+    *result = future->res;
+  }
+  return 0;
+}
+
+int mthread_future_destroy(mthread_future_t future)
+{
+  mthread_log("FUTURE DESTROY", "Destroying\n");
+
+  if (future == NULL)
+  {
+    mthread_log("FUTURE DESTROY", "Future was NULL\n");
+    return EINVAL;
+  }
+
+  mthread_spinlock_lock(&future->lock);
+  if (!future->done)
+  {
+    mthread_spinlock_unlock(&future->lock);
+    mthread_log("FUTURE DESTROY", "Returning EBUSY\n");
+    return EBUSY;
+  }
+  mthread_spinlock_unlock(&future->lock);
+
+  mthread_free(future);
+
+  mthread_log("FUTURE DESTROY", "Destroyed\n");
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <errno.h>
+
+#include "mthread_internal.h"
+
+/* Functions for gangs.  */
+
+// The members of a gang are bound to virtual processors 0 to SIZE - 1 in
+// the order they are created, and held back until the last one is: its
+// creator then puts them all first in the ready lists of their VPs, see
+// mthread_create.
+
+int mthread_gang_init(mthread_gang_t *__gang, unsigned int __size)
+{
+  mthread_log("GANG INIT", "Initializing\n");
+
+  if (__gang == NULL || __size == 0 || __size > (unsigned int)mthread_get_max_vp())
+  {
+    mthread_log("GANG INIT", "Returning EINVAL\n");
+    return EINVAL;
+  }
+
+  __gang->lock = 0;
+  __gang->size = __size;
+  __gang->created = 0;
+  __gang->held = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+
+  mthread_log("GANG INIT", "Initialized for %u threads\n", __size);
+  return 0;
+}
+
+int mthread_gang_destroy(mthread_gang_t *__gang)
+{
+  mthread_log("GANG DESTROY", "Destroying\n");
+
+  if (__gang == NULL)
+  {
+    mthread_log("GANG DESTROY", "Gang was NULL\n");
+    return EINVAL;
+  }
+
+  mthread_spinlock_lock(&__gang->lock);
+  if (__gang->held.first != NULL)
+  {
+    mthread_spinlock_unlock(&__gang->lock);
+    mthread_log("GANG DESTROY", "Returning EBUSY\n");
+    return EBUSY;
+  }
+  mthread_spinlock_unlock(&__gang->lock);
+
+  mthread_log("GANG DESTROY", "Destroyed\n");
+  return 0;
+}
+
+/* Bind TH, not started yet, to the VP of the next member of GANG and hold
+   it.  When it is the last member, the whole gang is moved to *START.
+   Returns the rank of TH in the gang, -1 if the gang is complete.  */
+int __mthread_gang_add(mthread_gang_t *gang, struct mthread_s *th, mthread_waitq_t *start)
+{
+  int rank;
+
+  *start = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+
+  mthread_spinlock_lock(&gang->lock);
+  if (gang->created == gang->size)
+  {
+    mthread_spinlock_unlock(&gang->lock);
+    return -1;
+  }
+  rank = gang->created++;
+  th->vp = mthread_get_vp_by_rank(rank);
+  th->not_migrable = 1;
+  mthread_waitq_push(&gang->held, th);
+  if (gang->created == gang->size)
+  {
+    *start = gang->held;
+    gang->held = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+  }
+  mthread_spinlock_unlock(&gang->lock);
+
+  mthread_log("GANG", "Thread %p is member %d\n", th, rank);
+  return rank;
+}
@@ -0,0 +1,1018 @@
+#ifdef MTHREAD_GOMP
+#include <errno.h>
+#include <limits.h>
+#include <omp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mthread_internal.h"
+
+/* libgomp ABI on mthread, see the Makefile for libmthread_gomp.so.
+   Link a program compiled with -fopenmp against lib/libmthread_gomp.so
+   instead of libgomp, or run it with LD_PRELOAD=lib/libmthread_gomp.so.  */
+
+// Every OpenMP thread of a team is an mthread thread, and so is every
+// deferred task: a nested parallel region or a task only costs a user-level
+// thread creation. A thread finds its team through an mthread key, and
+// blocks like on a future when it waits for tasks. Locks park on the word
+// of omp_lock_t, which is too small for an mthread_mutex_t. Not supported:
+// the unsigned long long loops, ordered, sections, cancellation, task
+// reductions, task dependences (such tasks run undeferred, in creation
+// order) and taskloop. Variables declared threadprivate are __thread ones,
+// which belong to the LWP.
+
+#define MTHREAD_GOMP_WS 8 /* worksharing constructs in flight per team, power of 2 */
+
+/* Loop schedules, the values of the sched argument of GOMP_loop_start.  */
+#define MTHREAD_GOMP_RUNTIME 0
+#define MTHREAD_GOMP_STATIC 1
+#define MTHREAD_GOMP_DYNAMIC 2
+#define MTHREAD_GOMP_GUIDED 3
+#define MTHREAD_GOMP_AUTO 4
+
+/* GOMP_task flags.  */
+#define MTHREAD_GOMP_TASK_FINAL 2
+#define MTHREAD_GOMP_TASK_DEPEND 8
+
+typedef struct
+{
+  mthread_tst_t lock;
+  unsigned long gen;   /* index + 1 of the construct using it */
+  volatile int active; /* threads that did not leave it yet */
+  int sched;
+  long chunk;
+  long start;
+  long incr;
+  long n;            /* iterations */
+  volatile long next; /* first iteration not handed out */
+  void *mem;          /* scratch memory of GOMP_loop_start, zeroed */
+  size_t mem_size;
+  void *copyprivate; /* data of GOMP_single_copy_end */
+} mthread_gomp_ws_t;
+
+// Unfinished tasks, and the threads waiting for them all to finish
+typedef struct
+{
+  mthread_tst_t lock;
+  volatile long count;
+  mthread_waitq_t waiters;
+} mthread_gomp_count_t;
+
+typedef struct mthread_gomp_taskgroup_s
+{
+  mthread_gomp_count_t tasks; /* created in the group or by its tasks */
+  struct mthread_gomp_taskgroup_s *prev;
+} mthread_gomp_taskgroup_t;
+
+typedef struct mthread_gomp_task_s
+{
+  struct mthread_gomp_task_s *parent;
+  mthread_gomp_count_t children;
+  mthread_gomp_taskgroup_t *group;
+} mthread_gomp_task_t;
+
+struct mthread_gomp_team_s;
+
+typedef struct
+{
+  struct mthread_gomp_team_s *team;
+  unsigned int num;
+  unsigned long ws_count; /* worksharing constructs encountered */
+  mthread_gomp_ws_t *ws;
+  unsigned long static_taken; /* chunks taken in the current static loop */
+  mthread_gomp_task_t *task;
+  mthread_gomp_task_t implicit;
+} mthread_gomp_thread_t;
+
+typedef struct mthread_gomp_team_s
+{
+  unsigned int nthreads;
+  unsigned int level;        /* enclosing parallel regions */
+  unsigned int active_level; /* enclosing regions with more than one thread */
+  void (*fn)(void *);
+  void *data;
+
+  mthread_mutex_t barrier_lock;
+  mthread_cond_t barrier_cond;
+  unsigned int barrier_count;
+  volatile unsigned long barrier_gen;
+  mthread_gomp_count_t pending; /* explicit tasks */
+
+  mthread_gomp_ws_t ws[MTHREAD_GOMP_WS];
+  mthread_t *workers;
+  mthread_gomp_thread_t threads[];
+} mthread_gomp_team_t;
+
+typedef struct
+{
+  mthread_gomp_task_t task;
+  mthread_gomp_thread_t ctx;
+  void (*fn)(void *);
+  void *arg;
+  char data[];
+} mthread_gomp_deferred_t;
+
+static mthread_once_t gomp_once = MTHREAD_ONCE_INIT;
+static mthread_key_t gomp_key;
+static unsigned int gomp_nthreads;
+static unsigned int gomp_max_active_levels = UINT_MAX;
+static int gomp_run_sched = MTHREAD_GOMP_DYNAMIC;
+static long gomp_run_chunk = 1;
+
+// Threads that never entered a parallel region belong to this team of one
+static struct
+{
+  mthread_gomp_team_t team;
+  mthread_gomp_thread_t thread;
+} gomp_initial;
+
+static mthread_mutex_t gomp_critical = MTHREAD_MUTEX_INITIALIZER;
+static mthread_mutex_t gomp_atomic = MTHREAD_MUTEX_INITIALIZER;
+static mthread_tst_t gomp_names_lock = 0;
+
+static void mthread_gomp_init(void)
+{
+  char *env;
+
+  mthread_key_create(&gomp_key, NULL);
+
+  gomp_nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  env = getenv("OMP_NUM_THREADS");
+  if (env != NULL && atoi(env) > 0)
+    gomp_nthreads = atoi(env);
+
+  env = getenv("OMP_MAX_ACTIVE_LEVELS");
+  if (env != NULL && atoi(env) >= 0)
+    gomp_max_active_levels = atoi(env);
+
+  env = getenv("OMP_SCHEDULE");
+  if (env != NULL)
+  {
+    char *comma = strchr(env, ',');
+    size_t len = comma != NULL ? (size_t)(comma - env) : strlen(env);
+
+    if (len == 6 && strncasecmp(env, "static", len) == 0)
+      gomp_run_sched = MTHREAD_GOMP_STATIC;
+    else if (len == 7 && strncasecmp(env, "dynamic", len) == 0)
+      gomp_run_sched = MTHREAD_GOMP_DYNAMIC;
+    else if (len == 6 && strncasecmp(env, "guided", len) == 0)
+      gomp_run_sched = MTHREAD_GOMP_GUIDED;
+    else if (len == 4 && strncasecmp(env, "auto", len) == 0)
+      gomp_run_sched = MTHREAD_GOMP_STATIC;
+    gomp_run_chunk = comma != NULL && atol(comma + 1) > 0 ? atol(comma + 1) : (gomp_run_sched == MTHREAD_GOMP_STATIC ? 0 : 1);
+  }
+
+  gomp_initial.team.nthreads = 1;
+  gomp_initial.team.barrier_lock = (mthread_mutex_t)MTHREAD_MUTEX_INITIALIZER;
+  gomp_initial.team.barrier_cond = (mthread_cond_t)MTHREAD_COND_INITIALIZER;
+  gomp_initial.thread.team = &gomp_initial.team;
+  gomp_initial.thread.task = &gomp_initial.thread.implicit;
+
+  mthread_log("GOMP", "%u threads per team, runtime schedule %d,%ld\n", gomp_nthreads, gomp_run_sched, gomp_run_chunk);
+}
+
+static mthread_gomp_thread_t *mthread_gomp_self(void)
+{
+  mthread_gomp_thread_t *ctx;
+
+  mthread_ensure_init();
+  mthread_once(&gomp_once, mthread_gomp_init);
+  ctx = mthread_getspecific(gomp_key);
+  return ctx != NULL ? ctx : &gomp_initial.thread;
+}
+
+/* Waiting for tasks.  */
+
+static void mthread_gomp_count_add(mthread_gomp_count_t *c)
+{
+  __sync_fetch_and_add(&c->count, 1);
+}
+
+static void mthread_gomp_count_done(mthread_gomp_count_t *c)
+{
+  mthread_waitq_t woken = MTHREAD_WAITQ_INIT;
+  struct mthread_s *th;
+
+  mthread_spinlock_lock(&c->lock);
+  if (__sync_sub_and_fetch(&c->count, 1) == 0)
+  {
+    woken = c->waiters;
+    c->waiters = (mthread_waitq_t)MTHREAD_WAITQ_INIT;
+  }
+  mthread_spinlock_unlock(&c->lock);
+
+  // C may be gone as soon as a waiter runs again
+  while ((th = mthread_waitq_pop(&woken)) != NULL)
+    __mthread_wakeup(th);
+}
+
+static void mthread_gomp_count_wait(mthread_gomp_count_t *c)
+{
+  mthread_virtual_processor_t *vp;
+  mthread_t self;
+
+  if (c->count == 0)
+  {
+    // Let a concurrent mthread_gomp_count_done release C
+    mthread_spinlock_lock(&c->lock);
+    mthread_spinlock_unlock(&c->lock);
+    return;
+  }
+
+  mthread_spinlock_lock(&c->lock);
+  if (c->count == 0)
+  {
+    mthread_spinlock_unlock(&c->lock);
+    return;
+  }
+  vp = mthread_get_vp();
+  self = mthread_self();
+  self->status = BLOCKED;
+  __mthread_block_stat(vp, self, MTHREAD_WAIT_FUTURE);
+  mthread_waitq_push(&c->waiters, self);
+  vp->p = &c->lock;
+  __mthread_yield(vp);
+}
+
+/* Barriers.  */
+
+static void mthread_gomp_barrier(mthread_gomp_team_t *team)
+{
+  unsigned long gen;
+
+  // The tasks of the team complete at its barriers
+  mthread_gomp_count_wait(&team->pending);
+
+  if (team->nthreads == 1)
+    return;
+
+  mthread_mutex_lock(&team->barrier_lock);
+  gen = team->barrier_gen;
+  team->barrier_count++;
+  if (team->barrier_count == team->nthreads)
+  {
+    team->barrier_count = 0;
+    team->barrier_gen++;
+    mthread_cond_broadcast(&team->barrier_cond);
+  }
+  else
+  {
+    while (gen == team->barrier_gen)
+      mthread_cond_wait(&team->barrier_cond, &team->barrier_lock);
+  }
+  mthread_mutex_unlock(&team->barrier_lock);
+}
+
+void GOMP_barrier(void)
+{
+  mthread_gomp_barrier(mthread_gomp_self()->team);
+}
+
+/* Parallel regions.  */
+
+static mthread_gomp_team_t *mthread_gomp_team_new(unsigned int nthreads)
+{
+  mthread_gomp_thread_t *parent = mthread_gomp_self();
+  mthread_gomp_team_t *team;
+  unsigned int i;
+
+  if (nthreads == 0)
+    nthreads = gomp_nthreads;
+  if (parent->team->active_level >= gomp_max_active_levels)
+    nthreads = 1;
+
+  team = safe_malloc(sizeof(mthread_gomp_team_t) + nthreads * sizeof(mthread_gomp_thread_t));
+  memset(team, 0, sizeof(mthread_gomp_team_t) + nthreads * sizeof(mthread_gomp_thread_t));
+  team->nthreads = nthreads;
+  team->level = parent->team->level + 1;
+  team->active_level = parent->team->active_level + (nthreads > 1);
+  team->barrier_lock = (mthread_mutex_t)MTHREAD_MUTEX_INITIALIZER;
+  team->barrier_cond = (mthread_cond_t)MTHREAD_COND_INITIALIZER;
+  team->workers = safe_malloc(nthreads * sizeof(mthread_t));
+
+  for (i = 0; i < nthreads; i++)
+  {
+    team->threads[i].team = team;
+    team->threads[i].num = i;
+    team->threads[i].task = &(team->threads[i].implicit);
+  }
+  return team;
+}
+
+static void *mthread_gomp_worker(void *arg)
+{
+  mthread_gomp_thread_t *ctx = (mthread_gomp_thread_t *)arg;
+
+  mthread_setspecific(gomp_key, ctx);
+  ctx->team->fn(ctx->team->data);
+  mthread_gomp_barrier(ctx->team);
+  return NULL;
+}
+
+// Run FN on every thread of TEAM, the caller being thread 0, then free it
+static void mthread_gomp_team_run(mthread_gomp_team_t *team, void (*fn)(void *), void *data)
+{
+  void *saved = mthread_getspecific(gomp_key);
+  unsigned int i;
+
+  mthread_log("GOMP", "Parallel region of %u threads, level %u\n", team->nthreads, team->level);
+  team->fn = fn;
+  team->data = data;
+  for (i = 1; i < team->nthreads; i++)
+  {
+    mthread_create(&(team->workers[i]), NULL, mthread_gomp_worker, &(team->threads[i]));
+  }
+
+  mthread_setspecific(gomp_key, &(team->threads[0]));
+  fn(data);
+  mthread_gomp_barrier(team);
+  mthread_setspecific(gomp_key, saved);
+
+  for (i = 1; i < team->nthreads; i++)
+  {
+    mthread_join(team->workers[i], NULL);
+  }
+  for (i = 0; i < MTHREAD_GOMP_WS; i++)
+  {
+    mthread_free(team->ws[i].mem);
+  }
+  mthread_mutex_destroy(&team->barrier_lock);
+  mthread_cond_destroy(&team->barrier_cond);
+  mthread_free(team->workers);
+  mthread_free(team);
+}
+
+void GOMP_parallel(void (*fn)(void *), void *data, unsigned num_threads, unsigned flags)
+{
+  mthread_gomp_team_run(mthread_gomp_team_new(num_threads), fn, data);
+}
+
+/* Worksharing constructs.  */
+
+// Return the work share of the next construct of the calling thread, locked,
+// FIRST telling whether the caller is the one that must initialize it
+static mthread_gomp_ws_t *mthread_gomp_ws_enter(mthread_gomp_thread_t *ctx, int *first)
+{
+  unsigned long k = ctx->ws_count++;
+  mthread_gomp_ws_t *ws = &(ctx->team->ws[k & (MTHREAD_GOMP_WS - 1)]);
+
+  while (1)
+  {
+    mthread_spinlock_lock(&ws->lock);
+    if (ws->gen == k + 1)
+    {
+      *first = 0;
+      break;
+    }
+    if (ws->active == 0)
+    {
+      ws->gen = k + 1;
+      ws->active = ctx->team->nthreads;
+      *first = 1;
+      break;
+    }
+    // Some thread is still in the construct that used it MTHREAD_GOMP_WS ago
+    mthread_spinlock_unlock(&ws->lock);
+    mthread_yield();
+  }
+
+  ctx->ws = ws;
+  ctx->static_taken = 0;
+  return ws;
+}
+
+static void mthread_gomp_ws_leave(mthread_gomp_thread_t *ctx)
+{
+  __sync_fetch_and_sub(&ctx->ws->active, 1);
+  ctx->ws = NULL;
+}
+
+bool GOMP_single_start(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  int first;
+
+  mthread_gomp_ws_enter(ctx, &first);
+  mthread_spinlock_unlock(&ctx->ws->lock);
+  mthread_gomp_ws_leave(ctx);
+  return first;
+}
+
+// NULL for the thread that runs the single construct, which stays in it
+// until GOMP_single_copy_end hands its data over to the others
+void *GOMP_single_copy_start(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  void *data;
+  int first;
+
+  mthread_gomp_ws_enter(ctx, &first);
+  mthread_spinlock_unlock(&ctx->ws->lock);
+  if (first)
+    return NULL;
+
+  mthread_gomp_barrier(ctx->team);
+  data = ctx->ws->copyprivate;
+  mthread_gomp_ws_leave(ctx);
+  return data;
+}
+
+void GOMP_single_copy_end(void *data)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+
+  ctx->ws->copyprivate = data;
+  mthread_gomp_barrier(ctx->team);
+  mthread_gomp_ws_leave(ctx);
+}
+
+/* Loops, iterations are numbered from 0 to n - 1 internally.  */
+
+static void mthread_gomp_loop_init(mthread_gomp_ws_t *ws, int sched, long start, long end, long incr, long chunk)
+{
+  if (sched == MTHREAD_GOMP_RUNTIME)
+  {
+    sched = gomp_run_sched;
+    chunk = gomp_run_chunk;
+  }
+  if (sched == MTHREAD_GOMP_AUTO)
+  {
+    sched = MTHREAD_GOMP_STATIC;
+    chunk = 0;
+  }
+  if (sched != MTHREAD_GOMP_STATIC && chunk < 1)
+    chunk = 1;
+
+  ws->sched = sched;
+  ws->chunk = chunk;
+  ws->start = start;
+  ws->incr = incr;
+  ws->next = 0;
+  if (incr > 0)
+    ws->n = start < end ? (end - start + incr - 1) / incr : 0;
+  else
+    ws->n = start > end ? (start - end - incr - 1) / -incr : 0;
+}
+
+static bool mthread_gomp_loop_next(mthread_gomp_thread_t *ctx, long *istart, long *iend)
+{
+  mthread_gomp_ws_t *ws = ctx->ws;
+  long nthreads = ctx->team->nthreads;
+  long i;
+  long j;
+
+  switch (ws->sched)
+  {
+  case MTHREAD_GOMP_STATIC:
+    if (ws->chunk == 0)
+    {
+      // One block per thread, the first n % nthreads ones get one more
+      long q = ws->n / nthreads;
+      long r = ws->n % nthreads;
+      if (ctx->static_taken > 0)
+        return false;
+      i = ctx->num * q + (ctx->num < r ? ctx->num : r);
+      j = i + q + (ctx->num < r);
+    }
+    else
+    {
+      i = (ctx->static_taken * nthreads + ctx->num) * ws->chunk;
+      j = i + ws->chunk;
+    }
+    ctx->static_taken++;
+    break;
+
+  case MTHREAD_GOMP_DYNAMIC:
+    if (ws->next >= ws->n)
+      return false;
+    i = __sync_fetch_and_add(&ws->next, ws->chunk);
+    j = i + ws->chunk;
+    break;
+
+  case MTHREAD_GOMP_GUIDED:
+    do
+    {
+      long q;
+      i = ws->next;
+      if (i >= ws->n)
+        return false;
+      q = (ws->n - i + nthreads - 1) / nthreads;
+      j = i + (q > ws->chunk ? q : ws->chunk);
+    } while (!__sync_bool_compare_and_swap(&ws->next, i, j < ws->n ? j : ws->n));
+    break;
+
+  default:
+    not_implemented();
+    return false;
+  }
+
+  if (i >= ws->n)
+    return false;
+  if (j > ws->n)
+    j = ws->n;
+  *istart = ws->start + i * ws->incr;
+  *iend = ws->start + j * ws->incr;
+  return true;
+}
+
+static bool mthread_gomp_loop_start(int sched, long start, long end, long incr, long chunk, long *istart, long *iend,
+                                    void **mem)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  mthread_gomp_ws_t *ws;
+  int first;
+
+  ws = mthread_gomp_ws_enter(ctx, &first);
+  if (first)
+  {
+    mthread_gomp_loop_init(ws, sched, start, end, incr, chunk);
+    // *MEM is the size the team shares, kept until the work share is reused
+    if (mem != NULL)
+    {
+      size_t size = (uintptr_t)*mem;
+      if (size > ws->mem_size)
+      {
+        mthread_free(ws->mem);
+        ws->mem = safe_malloc(size);
+        ws->mem_size = size;
+      }
+      memset(ws->mem, 0, size);
+    }
+  }
+  if (mem != NULL)
+    *mem = ws->mem;
+  mthread_spinlock_unlock(&ws->lock);
+
+  // Only the work share is wanted, the iterations come from *_next
+  if (istart == NULL)
+    return true;
+
+  return mthread_gomp_loop_next(ctx, istart, iend);
+}
+
+bool GOMP_loop_static_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+  return mthread_gomp_loop_start(MTHREAD_GOMP_STATIC, start, end, incr, chunk, istart, iend, NULL);
+}
+
+bool GOMP_loop_dynamic_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+  return mthread_gomp_loop_start(MTHREAD_GOMP_DYNAMIC, start, end, incr, chunk, istart, iend, NULL);
+}
+
+bool GOMP_loop_guided_start(long start, long end, long incr, long chunk, long *istart, long *iend)
+{
+  return mthread_gomp_loop_start(MTHREAD_GOMP_GUIDED, start, end, incr, chunk, istart, iend, NULL);
+}
+
+bool GOMP_loop_runtime_start(long start, long end, long incr, long *istart, long *iend)
+{
+  return mthread_gomp_loop_start(MTHREAD_GOMP_RUNTIME, start, end, incr, 0, istart, iend, NULL);
+}
+
+bool GOMP_loop_start(long start, long end, long incr, long sched, long chunk, long *istart, long *iend,
+                     uintptr_t *reductions, void **mem)
+{
+  // Task reductions are not supported
+  if (reductions != NULL)
+    not_implemented();
+  // Drop the monotonic modifier
+  return mthread_gomp_loop_start(sched & 0x7fffffff, start, end, incr, chunk, istart, iend, mem);
+}
+
+bool GOMP_loop_static_next(long *istart, long *iend)
+{
+  return mthread_gomp_loop_next(mthread_gomp_self(), istart, iend);
+}
+
+void GOMP_loop_end_nowait(void)
+{
+  mthread_gomp_ws_leave(mthread_gomp_self());
+}
+
+void GOMP_loop_end(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  mthread_gomp_ws_leave(ctx);
+  mthread_gomp_barrier(ctx->team);
+}
+
+// The schedule is kept in the work share, every *_next is the same function
+#define MTHREAD_GOMP_LOOP_ALIAS(name, target) \
+  __typeof__(target) name __attribute__((alias(#target)))
+
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_dynamic_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_guided_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_runtime_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_dynamic_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_guided_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_runtime_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_maybe_nonmonotonic_runtime_next, GOMP_loop_static_next);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_dynamic_start, GOMP_loop_dynamic_start);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_guided_start, GOMP_loop_guided_start);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_nonmonotonic_runtime_start, GOMP_loop_runtime_start);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_loop_maybe_nonmonotonic_runtime_start, GOMP_loop_runtime_start);
+
+// Combined parallel loops: the work share is ready before the threads start,
+// which go straight to GOMP_loop_*_next
+static void mthread_gomp_parallel_loop(void (*fn)(void *), void *data, unsigned num_threads, int sched,
+                                       long start, long end, long incr, long chunk)
+{
+  mthread_gomp_team_t *team = mthread_gomp_team_new(num_threads);
+  unsigned int i;
+
+  mthread_gomp_loop_init(&(team->ws[0]), sched, start, end, incr, chunk);
+  team->ws[0].gen = 1;
+  team->ws[0].active = team->nthreads;
+  for (i = 0; i < team->nthreads; i++)
+  {
+    team->threads[i].ws_count = 1;
+    team->threads[i].ws = &(team->ws[0]);
+  }
+  mthread_gomp_team_run(team, fn, data);
+}
+
+void GOMP_parallel_loop_static(void (*fn)(void *), void *data, unsigned num_threads, long start, long end,
+                               long incr, long chunk, unsigned flags)
+{
+  mthread_gomp_parallel_loop(fn, data, num_threads, MTHREAD_GOMP_STATIC, start, end, incr, chunk);
+}
+
+void GOMP_parallel_loop_dynamic(void (*fn)(void *), void *data, unsigned num_threads, long start, long end,
+                                long incr, long chunk, unsigned flags)
+{
+  mthread_gomp_parallel_loop(fn, data, num_threads, MTHREAD_GOMP_DYNAMIC, start, end, incr, chunk);
+}
+
+void GOMP_parallel_loop_guided(void (*fn)(void *), void *data, unsigned num_threads, long start, long end,
+                               long incr, long chunk, unsigned flags)
+{
+  mthread_gomp_parallel_loop(fn, data, num_threads, MTHREAD_GOMP_GUIDED, start, end, incr, chunk);
+}
+
+void GOMP_parallel_loop_runtime(void (*fn)(void *), void *data, unsigned num_threads, long start, long end,
+                                long incr, unsigned flags)
+{
+  mthread_gomp_parallel_loop(fn, data, num_threads, MTHREAD_GOMP_RUNTIME, start, end, incr, 0);
+}
+
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_parallel_loop_nonmonotonic_dynamic, GOMP_parallel_loop_dynamic);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_parallel_loop_nonmonotonic_guided, GOMP_parallel_loop_guided);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_parallel_loop_nonmonotonic_runtime, GOMP_parallel_loop_runtime);
+MTHREAD_GOMP_LOOP_ALIAS(GOMP_parallel_loop_maybe_nonmonotonic_runtime, GOMP_parallel_loop_runtime);
+
+/* Critical sections and atomics.  */
+
+void GOMP_critical_start(void)
+{
+  mthread_ensure_init();
+  mthread_mutex_lock(&gomp_critical);
+}
+
+void GOMP_critical_end(void)
+{
+  mthread_mutex_unlock(&gomp_critical);
+}
+
+// PPTR is a pointer sized variable shared by the sections of that name
+void GOMP_critical_name_start(void **pptr)
+{
+  mthread_mutex_t *mutex = *pptr;
+
+  mthread_ensure_init();
+  if (mutex == NULL)
+  {
+    mthread_spinlock_lock(&gomp_names_lock);
+    if (*pptr == NULL)
+    {
+      mutex = safe_malloc(sizeof(mthread_mutex_t));
+      *mutex = (mthread_mutex_t)MTHREAD_MUTEX_INITIALIZER;
+      __sync_synchronize();
+      *pptr = mutex;
+    }
+    mutex = *pptr;
+    mthread_spinlock_unlock(&gomp_names_lock);
+  }
+  mthread_mutex_lock(mutex);
+}
+
+void GOMP_critical_name_end(void **pptr)
+{
+  mthread_mutex_unlock((mthread_mutex_t *)*pptr);
+}
+
+void GOMP_atomic_start(void)
+{
+  mthread_ensure_init();
+  mthread_mutex_lock(&gomp_atomic);
+}
+
+void GOMP_atomic_end(void)
+{
+  mthread_mutex_unlock(&gomp_atomic);
+}
+
+/* Locks.  */
+
+// The word of a simple lock is 0 when free, 1 when held and 2 when held with
+// threads parked on it. A nestable lock adds its owner and depth.
+typedef struct
+{
+  volatile int word;
+  int depth;
+  mthread_t owner;
+} mthread_gomp_nest_lock_t;
+
+static int mthread_gomp_lock_try(volatile int *word)
+{
+  return __sync_bool_compare_and_swap(word, 0, 1);
+}
+
+static void mthread_gomp_lock_acquire(volatile int *word)
+{
+  if (mthread_gomp_lock_try(word))
+    return;
+  while (__sync_lock_test_and_set(word, 2) != 0)
+    __mthread_park(word, 2, 0);
+}
+
+static void mthread_gomp_lock_release(volatile int *word)
+{
+  if (__sync_fetch_and_sub(word, 1) != 1)
+  {
+    *word = 0;
+    mthread_unpark_one(word);
+  }
+}
+
+void omp_init_lock(omp_lock_t *lock)
+{
+  mthread_ensure_init();
+  *(volatile int *)lock = 0;
+}
+
+void omp_init_lock_with_hint(omp_lock_t *lock, omp_sync_hint_t hint)
+{
+  omp_init_lock(lock);
+}
+
+void omp_destroy_lock(omp_lock_t *lock)
+{
+}
+
+void omp_set_lock(omp_lock_t *lock)
+{
+  mthread_gomp_lock_acquire((volatile int *)lock);
+}
+
+void omp_unset_lock(omp_lock_t *lock)
+{
+  mthread_gomp_lock_release((volatile int *)lock);
+}
+
+int omp_test_lock(omp_lock_t *lock)
+{
+  return mthread_gomp_lock_try((volatile int *)lock);
+}
+
+void omp_init_nest_lock(omp_nest_lock_t *lock)
+{
+  mthread_gomp_nest_lock_t *l = (mthread_gomp_nest_lock_t *)lock;
+
+  mthread_ensure_init();
+  l->word = 0;
+  l->depth = 0;
+  l->owner = NULL;
+}
+
+void omp_init_nest_lock_with_hint(omp_nest_lock_t *lock, omp_sync_hint_t hint)
+{
+  omp_init_nest_lock(lock);
+}
+
+void omp_destroy_nest_lock(omp_nest_lock_t *lock)
+{
+}
+
+void omp_set_nest_lock(omp_nest_lock_t *lock)
+{
+  mthread_gomp_nest_lock_t *l = (mthread_gomp_nest_lock_t *)lock;
+  mthread_t self = mthread_self();
+
+  if (l->owner != self)
+  {
+    mthread_gomp_lock_acquire(&l->word);
+    l->owner = self;
+  }
+  l->depth++;
+}
+
+void omp_unset_nest_lock(omp_nest_lock_t *lock)
+{
+  mthread_gomp_nest_lock_t *l = (mthread_gomp_nest_lock_t *)lock;
+
+  if (--l->depth == 0)
+  {
+    l->owner = NULL;
+    mthread_gomp_lock_release(&l->word);
+  }
+}
+
+int omp_test_nest_lock(omp_nest_lock_t *lock)
+{
+  mthread_gomp_nest_lock_t *l = (mthread_gomp_nest_lock_t *)lock;
+  mthread_t self = mthread_self();
+
+  if (l->owner != self)
+  {
+    if (!mthread_gomp_lock_try(&l->word))
+      return 0;
+    l->owner = self;
+  }
+  return ++l->depth;
+}
+
+/* Tasks.  */
+
+static void *mthread_gomp_task_start(void *arg)
+{
+  mthread_gomp_deferred_t *d = (mthread_gomp_deferred_t *)arg;
+  mthread_gomp_team_t *team = d->ctx.team;
+
+  mthread_setspecific(gomp_key, &(d->ctx));
+  d->fn(d->arg);
+
+  // The children point to this task
+  mthread_gomp_count_wait(&d->task.children);
+
+  if (d->task.group != NULL)
+    mthread_gomp_count_done(&d->task.group->tasks);
+  mthread_gomp_count_done(&d->task.parent->children);
+  mthread_free(d);
+  mthread_gomp_count_done(&team->pending);
+  return NULL;
+}
+
+void GOMP_task(void (*fn)(void *), void *data, void (*cpyfn)(void *, void *), long arg_size, long arg_align,
+               bool if_clause, unsigned flags, void **depend, int priority, void *detach)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  mthread_gomp_deferred_t *d;
+  mthread_t th;
+
+  if (!if_clause || (flags & (MTHREAD_GOMP_TASK_FINAL | MTHREAD_GOMP_TASK_DEPEND)))
+  {
+    // Undeferred: run it now, with its own children
+    mthread_gomp_task_t task = {.parent = ctx->task, .children = {.waiters = MTHREAD_WAITQ_INIT}, .group = ctx->task->group};
+    mthread_gomp_task_t *saved = ctx->task;
+
+    ctx->task = &task;
+    if (cpyfn != NULL)
+    {
+      char buf[arg_size + arg_align - 1];
+      char *arg = (char *)(((uintptr_t)buf + arg_align - 1) & ~(uintptr_t)(arg_align - 1));
+      cpyfn(arg, data);
+      fn(arg);
+    }
+    else
+    {
+      fn(data);
+    }
+    mthread_gomp_count_wait(&task.children);
+    ctx->task = saved;
+    return;
+  }
+
+  d = safe_malloc(sizeof(mthread_gomp_deferred_t) + arg_size + arg_align - 1);
+  d->arg = (void *)(((uintptr_t)d->data + arg_align - 1) & ~(uintptr_t)(arg_align - 1));
+  if (cpyfn != NULL)
+    cpyfn(d->arg, data);
+  else
+    memcpy(d->arg, data, arg_size);
+  d->fn = fn;
+  d->task.parent = ctx->task;
+  d->task.children = (mthread_gomp_count_t){.waiters = MTHREAD_WAITQ_INIT};
+  d->task.group = ctx->task->group;
+  d->ctx = *ctx;
+  d->ctx.ws = NULL;
+  d->ctx.task = &(d->task);
+
+  mthread_gomp_count_add(&ctx->team->pending);
+  mthread_gomp_count_add(&ctx->task->children);
+  if (d->task.group != NULL)
+    mthread_gomp_count_add(&d->task.group->tasks);
+
+  mthread_create(&th, NULL, mthread_gomp_task_start, d);
+  mthread_detach(th);
+}
+
+void GOMP_taskwait(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+
+  mthread_gomp_count_wait(&ctx->task->children);
+}
+
+void GOMP_taskyield(void)
+{
+  mthread_yield();
+}
+
+void GOMP_taskgroup_start(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  mthread_gomp_taskgroup_t *group = safe_malloc(sizeof(mthread_gomp_taskgroup_t));
+
+  group->tasks = (mthread_gomp_count_t){.waiters = MTHREAD_WAITQ_INIT};
+  group->prev = ctx->task->group;
+  ctx->task->group = group;
+}
+
+void GOMP_taskgroup_end(void)
+{
+  mthread_gomp_thread_t *ctx = mthread_gomp_self();
+  mthread_gomp_taskgroup_t *group = ctx->task->group;
+
+  // The descendant tasks joined the group when they were created
+  mthread_gomp_count_wait(&group->tasks);
+  ctx->task->group = group->prev;
+  mthread_free(group);
+}
+
+/* OpenMP runtime library.  */
+
+int omp_get_thread_num(void)
+{
+  return mthread_gomp_self()->num;
+}
+
+int omp_get_num_threads(void)
+{
+  return mthread_gomp_self()->team->nthreads;
+}
+
+int omp_get_max_threads(void)
+{
+  mthread_gomp_self();
+  return gomp_nthreads;
+}
+
+// Applies to the whole program, not only to the calling task
+void omp_set_num_threads(int num_threads)
+{
+  mthread_gomp_self();
+  if (num_threads > 0)
+    gomp_nthreads = num_threads;
+}
+
+int omp_get_num_procs(void)
+{
+  return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int omp_in_parallel(void)
+{
+  return mthread_gomp_self()->team->active_level > 0;
+}
+
+void omp_set_max_active_levels(int max_levels)
+{
+  mthread_gomp_self();
+  if (max_levels >= 0)
+    gomp_max_active_levels = max_levels;
+}
+
+int omp_get_max_active_levels(void)
+{
+  mthread_gomp_self();
+  return gomp_max_active_levels > INT_MAX ? INT_MAX : (int)gomp_max_active_levels;
+}
+
+int omp_get_level(void)
+{
+  return mthread_gomp_self()->team->level;
+}
+
+int omp_get_active_level(void)
+{
+  return mthread_gomp_self()->team->active_level;
+}
+
+double omp_get_wtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double omp_get_wtick(void)
+{
+  struct timespec ts;
+  clock_getres(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+#endif
@@ -7,10 +7,62 @@ extern "C"
 
 #define TWO_LEVEL
 
+/* Switch directly to the thread woken by a mutex unlock, a semaphore post or
+   a condition signal instead of leaving it at the end of the ready list.
+   Channels always hand off to the receiver they feed. The tests_handoff
+   target of the Makefile builds the tests with it. */
+// #define MTHREAD_WAKE_HANDOFF
+
 #include <stdlib.h>
 #include <stdio.h>
+
+#ifdef MTHREAD_PTHREAD_SHIM
+/* Built into libmthread_pthread.so, which exports the pthread functions on
+   top of mthread: the library's own LWPs and locks must keep using the real
+   ones, looked up in mthread_pthread.c.  */
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#define pthread_create __mthread_real_pthread_create
+#define pthread_detach __mthread_real_pthread_detach
+#define pthread_key_create __mthread_real_pthread_key_create
+#define pthread_getspecific __mthread_real_pthread_getspecific
+#define pthread_setspecific __mthread_real_pthread_setspecific
+#define pthread_once __mthread_real_pthread_once
+#define pthread_mutex_lock __mthread_real_pthread_mutex_lock
+#define pthread_mutex_unlock __mthread_real_pthread_mutex_unlock
+#define pthread_cond_init __mthread_real_pthread_cond_init
+#define pthread_cond_destroy __mthread_real_pthread_cond_destroy
+#define pthread_cond_signal __mthread_real_pthread_cond_signal
+#define pthread_cond_wait __mthread_real_pthread_cond_wait
+#define pthread_cond_timedwait __mthread_real_pthread_cond_timedwait
+#define sched_yield __mthread_real_sched_yield
+#define sleep __mthread_real_sleep
+#define usleep __mthread_real_usleep
+#define nanosleep __mthread_real_nanosleep
+  extern int pthread_create(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+  extern int pthread_detach(pthread_t);
+  extern int pthread_key_create(pthread_key_t *, void (*)(void *));
+  extern void *pthread_getspecific(pthread_key_t);
+  extern int pthread_setspecific(pthread_key_t, const void *);
+  extern int pthread_once(pthread_once_t *, void (*)(void));
+  extern int pthread_mutex_lock(pthread_mutex_t *);
+  extern int pthread_mutex_unlock(pthread_mutex_t *);
+  extern int pthread_cond_init(pthread_cond_t *, const pthread_condattr_t *);
+  extern int pthread_cond_destroy(pthread_cond_t *);
+  extern int pthread_cond_signal(pthread_cond_t *);
+  extern int pthread_cond_wait(pthread_cond_t *, pthread_mutex_t *);
+  extern int pthread_cond_timedwait(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+  extern int sched_yield(void);
+  extern unsigned int sleep(unsigned int);
+  extern int usleep(useconds_t);
+  extern int nanosleep(const struct timespec *, struct timespec *);
+#endif
 // Added: _XOPEN_SOURCE must be defined to allow for ucontext since it is deprecated on macOS (something like 12 years old deprecation)
+#ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 1
+#endif
 #include <ucontext.h>
 
 #ifndef __GNUC__
@@ -19,23 +71,110 @@ extern "C"
 
 #include "mthread.h"
 
+#define MTHREAD_DEFAULT_STACK 128 * 1024 /*128 kO*/
+#define MTHREAD_NUMA_MAX_NODES 16
+
   // Added: uncommented typedef
   typedef struct mthread_list_s
   {
     volatile struct mthread_s *first;
     volatile struct mthread_s *last;
     mthread_tst_t lock;
+    volatile int count;
   } mthread_list_t;
 
+  // Counters of a virtual processor, with relaxed atomic increments so that
+  // snapshots from other LWPs stay cheap. The VP itself writes them all but
+  // wakeups[]: the waker counts them, from any LWP, on the VP whose ready
+  // list gets the woken thread
+  typedef struct
+  {
+    volatile unsigned long switches;
+    volatile unsigned long steals;
+    volatile unsigned long remote_steals;
+    volatile unsigned long failed_steals;
+    volatile unsigned long idle_ns;
+    volatile unsigned long blocks[MTHREAD_NB_WAIT];
+    volatile unsigned long wakeups[MTHREAD_NB_WAIT];
+  } __attribute__((aligned(64))) mthread_vp_counters_t;
+
+#define MTHREAD_STAT_ADD(vp, field, n) \
+  __atomic_fetch_add(&((vp)->stats.field), (n), __ATOMIC_RELAXED)
+#define MTHREAD_STAT_INC(vp, field) MTHREAD_STAT_ADD(vp, field, 1)
+
+  /* Lock profiler, enabled with MTHREAD_LOCKPROF=N (report the N most
+     contended locks at exit). Each VP records into its own table. */
+  struct mthread_lockprof_s;
+
+  /* Record and replay of the scheduling, enabled with MTHREAD_RECORD=PREFIX
+     or MTHREAD_REPLAY=PREFIX (one log per VP, PREFIX.RANK).  */
+  struct mthread_replay_s;
+#define MTHREAD_REPLAY_OFF 0
+#define MTHREAD_REPLAY_RECORDING 1
+#define MTHREAD_REPLAY_REPLAYING 2
+
+#if defined(i686_ARCH) || defined(x86_64_ARCH)
+  static inline unsigned long mthread_lockprof_now()
+  {
+    unsigned int lo, hi;
+    __asm__ __volatile__("rdtsc"
+                         : "=a"(lo), "=d"(hi));
+    return ((unsigned long)hi << 32) | lo;
+  }
+#else
+#include <time.h>
+  static inline unsigned long mthread_lockprof_now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  }
+#endif
+
+  /* Small block caches of a virtual processor, see mthread_malloc.c.  */
+#define MTHREAD_MALLOC_CLASSES 8 /* 16 bytes to 2 KB */
+  typedef struct
+  {
+    struct mthread_malloc_free_s *free[MTHREAD_MALLOC_CLASSES];            /* only touched by the VP */
+    struct mthread_malloc_free_s *volatile remote[MTHREAD_MALLOC_CLASSES]; /* freed by the other VPs */
+  } mthread_malloc_cache_t;
+
+  /* Levels of the scheduler domains, see mthread_domain.c.  */
+#define MTHREAD_DOMAIN_CORE 0
+#define MTHREAD_DOMAIN_CACHE 1
+#define MTHREAD_DOMAIN_NODE 2
+#define MTHREAD_DOMAIN_MACHINE 3
+#define MTHREAD_NB_DOMAINS 4
+
+#define MTHREAD_LOCKPROF_START() (mthread_lockprof_enabled ? mthread_lockprof_now() : 0)
+#define MTHREAD_LOCKPROF_HELD 4
+
   typedef struct
   {
     struct mthread_s *idle;
     volatile struct mthread_s *current;
     mthread_list_t ready_list;
     int rank;
+    int node; /* NUMA node of its LWP, -1 if not known */
+    int domain[MTHREAD_NB_DOMAINS]; /* at each level, -1 if not known */
+    int steal_first;                /* closest level whose domain is known */
+    int steal_level;                /* farthest domain it steals from now */
+    int steal_failures;             /* rounds in a row that found nothing there */
     volatile int state;
     volatile struct mthread_s *resched;
+    volatile struct mthread_s *migrant; /* bound to another VP, queued there after the switch */
     volatile mthread_tst_t *p;
+    volatile struct mthread_s *zombie; /* exited, still on its stack */
+    struct mthread_s *tcb_cache;       /* free TCBs, only touched by this VP */
+    int tcb_cache_count;
+    mthread_vp_counters_t stats;
+    struct mthread_lockprof_s *lockprof; /* NULL unless profiling */
+    struct mthread_replay_s *replay;     /* NULL unless recording or replaying */
+    char *shared_stack;                  /* NULL until a shared stack thread is created here */
+    struct mthread_s *shared_owner;      /* whose frames are on the shared stack */
+    struct mthread_s *shared_next;
+    ucontext_t shared_ctx; /* copies the frames around, see mthread_shared.c */
+    mthread_malloc_cache_t malloc_cache;
   } mthread_virtual_processor_t;
 
   typedef enum
@@ -52,17 +191,109 @@ extern "C"
     void *arg;
     void *(*__start_routine)(void *);
     volatile struct mthread_s *next;
+    struct mthread_s *wait_next; /* in the wait queue of a synchronization object */
+    const volatile int *park_addr; /* what it is parked on, see mthread_park.c */
     volatile mthread_status_t status;
     int not_migrable;
+    int shared_stack; /* runs on the shared stack of vp */
+    volatile int detached; /* MTHREAD_DETACHED: recycled on exit instead of joined */
+    mthread_wait_kind_t wait_kind;
     mthread_virtual_processor_t *vp;
-    void *stack;
+    void *stack; /* start of the block holding the stack and the TCB */
+    int mem_node;     /* NUMA node of that block, -1 if none or not ours */
+    int settle_node;  /* node it was last switched in on */
+    int settle_count; /* switches in a row there */
+    unsigned int replay_id;   /* creation order, names it in a replay log */
+    unsigned int replay_runs; /* times it was switched to, checked by replays */
+    void *saved; /* frames of a shared stack thread, while not on the stack */
+    size_t saved_size;
+    size_t saved_cap;
+    void *wait_buf;               /* channel transfer buffer while blocked */
+    volatile unsigned int wait_n; /* channel items left to transfer */
+    mthread_tst_t wait_guard;          /* held to interrupt it, see mthread_cancel.c */
+    mthread_tst_t *volatile wait_lock; /* lock of what it may wait on, NULL if nothing */
+    mthread_waitq_t *wait_queue;       /* where it waits under wait_lock */
+    volatile unsigned int *wait_fired; /* or the word claimed to wake it, see mthread_future.c */
+    volatile int wait_error;           /* ECANCELED or ETIMEDOUT if interrupted */
+    volatile int cancel_pending;
+    int cancel_state;
+    unsigned long deadline;      /* CLOCK_MONOTONIC ns, 0 if none */
+    unsigned long wait_deadline; /* of the current wait */
+    volatile int timer_index;    /* in the heap of deadlines, or MTHREAD_TIMER_* */
+    struct mthread_cleanup_s *cleanup; /* handlers, last pushed first */
+    struct
+    {
+      void *lock;
+      unsigned long since;
+    } lockprof_held[MTHREAD_LOCKPROF_HELD]; /* profiled locks owned, for hold times */
+    int lockprof_nheld;
+    struct
+    {
+      void *value;
+      unsigned int seq; /* value only valid if it matches the key's */
+    } specific[MTHREAD_KEYS_MAX];
   };
 
+// A stack and its TCB, mapped together above it
+#define MTHREAD_TCB_BLOCK (MTHREAD_DEFAULT_STACK + ((sizeof(struct mthread_s) + 4095) & ~4095UL))
+
+#define MTHREAD_JOINABLE 0
+#define MTHREAD_DETACHED 1
+#define MTHREAD_EXITED 2 /* joinable and ended */
+
+#define MTHREAD_TIMER_NONE -1
+#define MTHREAD_TIMER_FIRING -2 /* out of the heap, being interrupted */
+#define MTHREAD_WAIT_INTERRUPTED (~0U) /* in *wait_fired */
+
 #define MTHREAD_LIST_INIT                  \
   {                                        \
     .first = NULL, .last = NULL, .lock = 0 \
   }
 
+  /* Wait queues, only touched with the lock of their object held.  */
+  static inline void mthread_waitq_push(mthread_waitq_t *q, struct mthread_s *th)
+  {
+    th->wait_next = NULL;
+    if (q->last == NULL)
+      q->first = th;
+    else
+      q->last->wait_next = th;
+    q->last = th;
+  }
+
+  static inline struct mthread_s *mthread_waitq_pop(mthread_waitq_t *q)
+  {
+    struct mthread_s *th = q->first;
+    if (th != NULL)
+    {
+      q->first = th->wait_next;
+      if (q->first == NULL)
+        q->last = NULL;
+    }
+    return th;
+  }
+
+  /* Unlink TH, returns 0 if it was not queued.  */
+  static inline int mthread_waitq_remove(mthread_waitq_t *q, struct mthread_s *th)
+  {
+    struct mthread_s *prev = NULL;
+    struct mthread_s *cur = q->first;
+    while (cur != NULL && cur != th)
+    {
+      prev = cur;
+      cur = cur->wait_next;
+    }
+    if (cur == NULL)
+      return 0;
+    if (prev == NULL)
+      q->first = th->wait_next;
+    else
+      prev->wait_next = th->wait_next;
+    if (q->last == th)
+      q->last = prev;
+    return 1;
+  }
+
   extern int mthread_test_and_set(mthread_tst_t *atomic);
   extern void mthread_spinlock_lock(mthread_tst_t *atomic);
   extern void mthread_spinlock_unlock(mthread_tst_t *atomic);
@@ -76,9 +307,75 @@ extern "C"
   extern void mthread_insert_first(struct mthread_s *item, mthread_list_t *list);
   extern void mthread_insert_last(struct mthread_s *item, mthread_list_t *list);
   extern struct mthread_s *mthread_remove_first(mthread_list_t *list);
+  extern int mthread_remove(struct mthread_s *item, mthread_list_t *list);
+
+  extern struct mthread_s *mthread_tcb_alloc(mthread_virtual_processor_t *vp, int node);
+  extern struct mthread_s *mthread_tcb_alloc_shared();
+  extern void mthread_tcb_free(mthread_virtual_processor_t *vp, struct mthread_s *th);
+
+  /* Shared stacks need the stack pointer of a saved context.  */
+#if defined(i686_ARCH) || defined(x86_64_ARCH)
+#define MTHREAD_SHARED_STACKS
+#endif
+  extern void mthread_shared_prepare(mthread_virtual_processor_t *vp, struct mthread_s *th);
+  extern void __mthread_shared_swap(mthread_virtual_processor_t *vp, struct mthread_s *current,
+                                    struct mthread_s *next);
+  extern void mthread_start_thread(void *arg);
+  extern void mthread_numa_init();
+  extern void mthread_numa_lwp_init(mthread_virtual_processor_t *vp);
+  extern int mthread_numa_vp_node(int rank);
+  extern void *mthread_numa_alloc(size_t size, int node);
+  extern void mthread_numa_free(void *ptr, size_t size);
+  extern void __mthread_numa_settle(mthread_virtual_processor_t *vp, struct mthread_s *th);
+  extern int mthread_numa_migrate;
+  extern int mthread_numa_bind;
+  extern unsigned long __mthread_deadline(const struct timespec *abstime);
+  extern int __mthread_wait_begin(struct mthread_s *self, mthread_tst_t *lock, mthread_waitq_t *queue,
+                                  unsigned long deadline);
+  extern int __mthread_wait_end(struct mthread_s *self);
+  extern int __mthread_wait_poll(struct mthread_s *self);
+  extern int __mthread_cancel_point(int err);
+  extern void __mthread_cleanup_run(struct mthread_s *th);
+  extern void __mthread_timer_poll();
+  extern volatile unsigned long mthread_timer_next;
+  extern int __mthread_park(const volatile int *addr, int expected, int interruptible);
+  extern int __mthread_gang_add(mthread_gang_t *gang, struct mthread_s *th, mthread_waitq_t *start);
 
   extern void __mthread_yield(mthread_virtual_processor_t *vp);
+  extern void __mthread_yield_to(mthread_virtual_processor_t *vp, struct mthread_s *target);
+  extern void __mthread_wakeup(struct mthread_s *th);
+  extern void __mthread_wakeup_on(struct mthread_s *th, mthread_virtual_processor_t *vp);
+  extern int __mthread_mutex_unlock(mthread_mutex_t *mutex, struct mthread_s **woken);
+  extern void mthread_ensure_init();
+  extern void __mthread_key_exit(struct mthread_s *th);
+  extern void __mthread_post_switch(mthread_virtual_processor_t *vp);
   extern mthread_virtual_processor_t *mthread_get_vp();
+  extern void mthread_set_vp(mthread_virtual_processor_t *vp);
+  extern mthread_virtual_processor_t *mthread_get_vp_by_rank(int rank);
+  extern int mthread_get_nb_vp();
+  extern void mthread_stats_init();
+  extern void __mthread_block_stat(mthread_virtual_processor_t *vp, struct mthread_s *th,
+                                   mthread_wait_kind_t kind);
+  extern void mthread_lockprof_init();
+  extern struct mthread_lockprof_s *mthread_lockprof_vp_new();
+  extern void __mthread_lockprof_acquired(void *lock, mthread_wait_kind_t kind, void *site,
+                                          unsigned long start, int contended);
+  extern void __mthread_lockprof_released(void *lock);
+  extern int mthread_domain_threshold[MTHREAD_NB_DOMAINS];
+  extern int mthread_domain_escalate;
+  extern void mthread_domain_init();
+  extern void mthread_domain_lwp_init(mthread_virtual_processor_t *vp);
+  extern int mthread_replay_mode;
+  extern void mthread_replay_init();
+  extern struct mthread_replay_s *mthread_replay_vp_new(int rank);
+  extern void __mthread_replay_register(struct mthread_s *th);
+  extern void __mthread_replay_unregister(struct mthread_s *th);
+  extern struct mthread_s *__mthread_replay_switch(mthread_virtual_processor_t *vp, struct mthread_s *current,
+                                                   struct mthread_s *next);
+  extern mthread_virtual_processor_t *__mthread_replay_wakeup(struct mthread_s *th,
+                                                               mthread_virtual_processor_t *vp);
+  extern int __mthread_replay_following(mthread_virtual_processor_t *vp);
+  extern void __mthread_replay_steal(mthread_virtual_processor_t *vp, struct mthread_s *th, int from);
 #define not_implemented() __not_implemented(__FUNCTION__, __FILE__, __LINE__)
 
 #ifdef __cplusplus
@@ -1,28 +1,95 @@
+#include <errno.h>
+
 #include "mthread_internal.h"
 
 /* Functions for handling thread-specific data.  */
 
+// Added: each thread stores its values in its TCB. A key bumps its sequence
+// number every time it is created, so that values set for a deleted key are
+// never seen through a new key reusing the same slot.
+
+#define MTHREAD_DESTRUCTOR_ITERATIONS 4
+
+static struct
+{
+  volatile unsigned int seq;
+  volatile int used;
+  void (*destr)(void *);
+} keys[MTHREAD_KEYS_MAX];
+static mthread_tst_t keys_lock = 0;
+
 /* Create a key value identifying a location in the thread-specific
      data area.  Each thread maintains a distinct thread-specific data
      area.  DESTR_FUNCTION, if non-NULL, is called with the value
-     associated to that key when the key is destroyed.
+     associated to that key when the thread exits.
      DESTR_FUNCTION is not called if the value associated is NULL when
-     the key is destroyed.  */
+     the thread exits.  */
 int mthread_key_create(mthread_key_t *__key, void (*__destr_function)(void *))
 {
-    return pthread_key_create(__key, __destr_function);
+  mthread_key_t k;
+
+  mthread_log("KEY CREATE", "Creating\n");
+  if (__key == NULL)
+  {
+    return EINVAL;
+  }
+
+  mthread_spinlock_lock(&keys_lock);
+  for (k = 0; k < MTHREAD_KEYS_MAX; k++)
+  {
+    if (!keys[k].used)
+    {
+      keys[k].seq++;
+      keys[k].destr = __destr_function;
+      keys[k].used = 1;
+      break;
+    }
+  }
+  mthread_spinlock_unlock(&keys_lock);
+
+  if (k == MTHREAD_KEYS_MAX)
+  {
+    mthread_log("KEY CREATE", "No key left, returning EAGAIN\n");
+    return EAGAIN;
+  }
+
+  *__key = k;
+  mthread_log("KEY CREATE", "Created key %u\n", k);
+  return 0;
 }
 
 /* Destroy KEY.  */
 int mthread_key_delete(mthread_key_t __key)
 {
-    return pthread_key_delete(__key);
+  int err = 0;
+
+  mthread_log("KEY DELETE", "Deleting key %u\n", __key);
+  mthread_spinlock_lock(&keys_lock);
+  if (__key >= MTHREAD_KEYS_MAX || !keys[__key].used)
+  {
+    err = EINVAL;
+  }
+  else
+  {
+    keys[__key].used = 0;
+    keys[__key].destr = NULL;
+  }
+  mthread_spinlock_unlock(&keys_lock);
+  return err;
 }
 
 /* Store POINTER in the thread-specific data slot identified by KEY. */
 int mthread_setspecific(mthread_key_t __key, const void *__pointer)
 {
-  not_implemented();
+  mthread_t self = mthread_self();
+
+  if (__key >= MTHREAD_KEYS_MAX || !keys[__key].used || self == NULL)
+  {
+    return EINVAL;
+  }
+
+  self->specific[__key].value = (void *)__pointer;
+  self->specific[__key].seq = keys[__key].seq;
   return 0;
 }
 
@@ -30,6 +97,43 @@ int mthread_setspecific(mthread_key_t __key, const void *__pointer)
 void *
 mthread_getspecific(mthread_key_t __key)
 {
-  not_implemented();
-  return NULL;
+  mthread_t self = mthread_self();
+
+  if (__key >= MTHREAD_KEYS_MAX || self == NULL || self->specific[__key].seq != keys[__key].seq)
+  {
+    return NULL;
+  }
+  return self->specific[__key].value;
+}
+
+/* Run the destructors of the values of TH, and clear them for the next
+   thread using this TCB.  */
+void __mthread_key_exit(struct mthread_s *th)
+{
+  int round;
+  int again = 1;
+  mthread_key_t k;
+
+  for (round = 0; round < MTHREAD_DESTRUCTOR_ITERATIONS && again; round++)
+  {
+    again = 0;
+    for (k = 0; k < MTHREAD_KEYS_MAX; k++)
+    {
+      void (*destr)(void *) = keys[k].destr;
+      void *value = th->specific[k].value;
+
+      if (value == NULL || destr == NULL || !keys[k].used || th->specific[k].seq != keys[k].seq)
+        continue;
+
+      // A destructor may set values again, hence the rounds
+      th->specific[k].value = NULL;
+      destr(value);
+      again = 1;
+    }
+  }
+
+  for (k = 0; k < MTHREAD_KEYS_MAX; k++)
+  {
+    th->specific[k].value = NULL;
+  }
 }
@@ -0,0 +1,248 @@
+#include <execinfo.h>
+#include <string.h>
+#include <time.h>
+
+#include "mthread_internal.h"
+
+/* Lock contention profiler.  */
+
+// Every VP owns an open addressing table keyed by the lock address, written
+// only by the thread running on that VP: recording never takes a lock nor
+// bounces a shared cache line. The tables are merged when the report is
+// printed. Waits are measured from the lock call to the acquisition, holds
+// from the acquisition to the release by the same thread, both in rdtsc
+// ticks converted to nanoseconds with a calibration done at startup.
+
+#define MTHREAD_LOCKPROF_SIZE 1024 /* entries per VP, power of 2 */
+
+typedef struct
+{
+  void *lock;
+  void *site; /* return address of the first acquisition */
+  mthread_wait_kind_t kind;
+  unsigned long acquisitions;
+  unsigned long contended;
+  unsigned long wait;
+  unsigned long max_wait;
+  unsigned long hold;
+} mthread_lockprof_entry_t;
+
+struct mthread_lockprof_s
+{
+  mthread_lockprof_entry_t entries[MTHREAD_LOCKPROF_SIZE];
+  unsigned long dropped;
+};
+
+int mthread_lockprof_enabled = 0;
+static int lockprof_top = 0;
+static unsigned long lockprof_tsc0;
+static struct timespec lockprof_ts0;
+
+static struct mthread_lockprof_s *lockprof_tables[MTHREAD_MAX_LWP];
+static int lockprof_nb_tables = 0;
+static mthread_tst_t lockprof_tables_lock = 0;
+
+static mthread_lockprof_entry_t *mthread_lockprof_lookup(struct mthread_lockprof_s *table, void *lock)
+{
+  unsigned long h = ((unsigned long)lock >> 4) * 0x9E3779B97F4A7C15UL;
+  unsigned int i = (unsigned int)(h >> 32) & (MTHREAD_LOCKPROF_SIZE - 1);
+  unsigned int n;
+
+  for (n = 0; n < MTHREAD_LOCKPROF_SIZE; n++)
+  {
+    mthread_lockprof_entry_t *e = &(table->entries[i]);
+    if (e->lock == lock)
+      return e;
+    if (e->lock == NULL)
+    {
+      e->lock = lock;
+      return e;
+    }
+    i = (i + 1) & (MTHREAD_LOCKPROF_SIZE - 1);
+  }
+
+  table->dropped++;
+  return NULL;
+}
+
+void __mthread_lockprof_acquired(void *lock, mthread_wait_kind_t kind, void *site,
+                                 unsigned long start, int contended)
+{
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  struct mthread_s *self;
+  mthread_lockprof_entry_t *e;
+  unsigned long now = mthread_lockprof_now();
+  unsigned long wait = now - start;
+
+  if (vp == NULL || vp->lockprof == NULL)
+    return;
+
+  e = mthread_lockprof_lookup(vp->lockprof, lock);
+  if (e != NULL)
+  {
+    if (e->site == NULL)
+    {
+      e->site = site;
+      e->kind = kind;
+    }
+    e->acquisitions++;
+    e->contended += contended;
+    e->wait += wait;
+    if (wait > e->max_wait)
+      e->max_wait = wait;
+  }
+
+  self = (struct mthread_s *)vp->current;
+  if (self->lockprof_nheld < MTHREAD_LOCKPROF_HELD)
+  {
+    self->lockprof_held[self->lockprof_nheld].lock = lock;
+    self->lockprof_held[self->lockprof_nheld].since = now;
+    self->lockprof_nheld++;
+  }
+}
+
+void __mthread_lockprof_released(void *lock)
+{
+  mthread_virtual_processor_t *vp = mthread_get_vp();
+  struct mthread_s *self;
+  mthread_lockprof_entry_t *e;
+  int i;
+
+  if (vp == NULL || vp->lockprof == NULL)
+    return;
+
+  // Semaphores may be posted by a thread that never waited on them
+  self = (struct mthread_s *)vp->current;
+  for (i = self->lockprof_nheld - 1; i >= 0; i--)
+  {
+    if (self->lockprof_held[i].lock == lock)
+      break;
+  }
+  if (i < 0)
+    return;
+
+  e = mthread_lockprof_lookup(vp->lockprof, lock);
+  if (e != NULL)
+    e->hold += mthread_lockprof_now() - self->lockprof_held[i].since;
+
+  self->lockprof_nheld--;
+  self->lockprof_held[i] = self->lockprof_held[self->lockprof_nheld];
+}
+
+static int mthread_lockprof_cmp(const void *a, const void *b)
+{
+  const mthread_lockprof_entry_t *ea = a;
+  const mthread_lockprof_entry_t *eb = b;
+  if (ea->wait != eb->wait)
+    return ea->wait < eb->wait ? 1 : -1;
+  return ea->contended < eb->contended ? 1 : (ea->contended > eb->contended ? -1 : 0);
+}
+
+static void mthread_lockprof_report(void)
+{
+  mthread_lockprof_entry_t *merged;
+  unsigned long dropped = 0;
+  unsigned long tsc1 = mthread_lockprof_now();
+  struct timespec ts1;
+  double ns_per_tick;
+  int nb = 0;
+  int t;
+  int i;
+  int j;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+  ns_per_tick = ((ts1.tv_sec - lockprof_ts0.tv_sec) * 1e9 + (ts1.tv_nsec - lockprof_ts0.tv_nsec)) /
+                (double)(tsc1 - lockprof_tsc0 ? tsc1 - lockprof_tsc0 : 1);
+
+  merged = safe_malloc((size_t)lockprof_nb_tables * MTHREAD_LOCKPROF_SIZE * sizeof(mthread_lockprof_entry_t));
+
+  // Quadratic, but only once at exit and over a handful of tables
+  for (t = 0; t < lockprof_nb_tables; t++)
+  {
+    dropped += lockprof_tables[t]->dropped;
+    for (i = 0; i < MTHREAD_LOCKPROF_SIZE; i++)
+    {
+      mthread_lockprof_entry_t *e = &(lockprof_tables[t]->entries[i]);
+      if (e->lock == NULL)
+        continue;
+
+      for (j = 0; j < nb && merged[j].lock != e->lock; j++)
+        ;
+      if (j == nb)
+      {
+        merged[nb] = *e;
+        nb++;
+        continue;
+      }
+      if (merged[j].site == NULL)
+      {
+        merged[j].site = e->site;
+        merged[j].kind = e->kind;
+      }
+      merged[j].acquisitions += e->acquisitions;
+      merged[j].contended += e->contended;
+      merged[j].wait += e->wait;
+      merged[j].hold += e->hold;
+      if (e->max_wait > merged[j].max_wait)
+        merged[j].max_wait = e->max_wait;
+    }
+  }
+
+  qsort(merged, nb, sizeof(mthread_lockprof_entry_t), mthread_lockprof_cmp);
+
+  fprintf(stderr, "[MTHREAD LOCKPROF] %d locks profiled, top %d by wait time:\n", nb,
+          nb < lockprof_top ? nb : lockprof_top);
+  fprintf(stderr, "[MTHREAD LOCKPROF] %-18s %-5s %10s %10s %12s %12s %12s  %s\n", "lock", "kind",
+          "acquired", "contended", "wait_us", "max_wait_us", "hold_us", "first acquired at");
+  for (i = 0; i < nb && i < lockprof_top; i++)
+  {
+    mthread_lockprof_entry_t *e = &(merged[i]);
+    char **site = backtrace_symbols(&(e->site), 1);
+
+    fprintf(stderr, "[MTHREAD LOCKPROF] %-18p %-5s %10lu %10lu %12.1f %12.1f %12.1f  %s\n", e->lock,
+            e->kind == MTHREAD_WAIT_SEM ? "sem" : "mutex", e->acquisitions, e->contended,
+            e->wait * ns_per_tick / 1000, e->max_wait * ns_per_tick / 1000, e->hold * ns_per_tick / 1000,
+            site != NULL ? site[0] : "?");
+    free(site);
+  }
+  if (dropped > 0)
+    fprintf(stderr, "[MTHREAD LOCKPROF] %lu acquisitions dropped, tables full\n", dropped);
+
+  mthread_free(merged);
+}
+
+struct mthread_lockprof_s *mthread_lockprof_vp_new()
+{
+  struct mthread_lockprof_s *table;
+
+  if (!mthread_lockprof_enabled)
+    return NULL;
+
+  table = safe_malloc(sizeof(struct mthread_lockprof_s));
+  memset(table, 0, sizeof(struct mthread_lockprof_s));
+
+  mthread_spinlock_lock(&lockprof_tables_lock);
+  if (lockprof_nb_tables < MTHREAD_MAX_LWP)
+  {
+    lockprof_tables[lockprof_nb_tables] = table;
+    lockprof_nb_tables++;
+  }
+  mthread_spinlock_unlock(&lockprof_tables_lock);
+
+  return table;
+}
+
+void mthread_lockprof_init()
+{
+  char *env = getenv("MTHREAD_LOCKPROF");
+
+  if (env == NULL)
+    return;
+
+  lockprof_top = atoi(env) > 0 ? atoi(env) : 10;
+  clock_gettime(CLOCK_MONOTONIC, &lockprof_ts0);
+  lockprof_tsc0 = mthread_lockprof_now();
+  mthread_lockprof_enabled = 1;
+  atexit(mthread_lockprof_report);
+  mthread_log("LOCKPROF", "Profiling locks, top %d reported at exit\n", lockprof_top);
+}